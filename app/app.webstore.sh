@@ -28,12 +28,121 @@ if [ -n "${CERTFILE}" ] && [ -n "${KEYFILE}" ]; then
   KEYARG="--key ${KEYPATH}"
 fi
 
+unset WORKERSARG
+if [ -n "${WORKERS}" ]; then
+  WORKERSARG="--workers ${WORKERS}"
+fi
+
+unset SOCKARGS
+if [ -n "${BACKLOG}" ]; then
+  SOCKARGS+=" --backlog ${BACKLOG}"
+fi
+if [ -n "${DEFERACCEPT}" ]; then
+  SOCKARGS+=" --deferaccept ${DEFERACCEPT}"
+fi
+if [ -n "${FASTOPEN}" ]; then
+  SOCKARGS+=" --fastopen ${FASTOPEN}"
+fi
+if [ -n "${NODELAY}" ]; then
+  SOCKARGS+=" --nodelay"
+fi
+if [ -n "${RCVBUF}" ]; then
+  SOCKARGS+=" --rcvbuf ${RCVBUF}"
+fi
+if [ -n "${SNDBUF}" ]; then
+  SOCKARGS+=" --sndbuf ${SNDBUF}"
+fi
+
+unset CONNARGS
+if [ -n "${IDLETIMEOUT}" ]; then
+  CONNARGS+=" --idletimeout ${IDLETIMEOUT}"
+fi
+if [ -n "${HEADERTIMEOUT}" ]; then
+  CONNARGS+=" --headertimeout ${HEADERTIMEOUT}"
+fi
+if [ -n "${BODYTIMEOUT}" ]; then
+  CONNARGS+=" --bodytimeout ${BODYTIMEOUT}"
+fi
+if [ -n "${IPCONNS}" ]; then
+  CONNARGS+=" --ipconns ${IPCONNS}"
+fi
+if [ -n "${CONNMEM}" ]; then
+  CONNARGS+=" --connmem ${CONNMEM}"
+fi
+
+unset SHEDARGS
+if [ -n "${MAXINFLIGHT}" ]; then
+  SHEDARGS+=" --maxinflight ${MAXINFLIGHT}"
+fi
+if [ -n "${UPLOADBUDGET}" ]; then
+  SHEDARGS+=" --uploadbudget ${UPLOADBUDGET}"
+fi
+if [ -n "${RETRYAFTER}" ]; then
+  SHEDARGS+=" --retryafter ${RETRYAFTER}"
+fi
+if [ -n "${BULKSIZE}" ]; then
+  SHEDARGS+=" --bulksize ${BULKSIZE}"
+fi
+if [ -n "${FASTWORKERS}" ]; then
+  SHEDARGS+=" --fastworkers ${FASTWORKERS}"
+fi
+if [ -n "${BULKWORKERS}" ]; then
+  SHEDARGS+=" --bulkworkers ${BULKWORKERS}"
+fi
+if [ -n "${LANEWAIT}" ]; then
+  SHEDARGS+=" --lanewait ${LANEWAIT}"
+fi
+
+unset REDISARGS
+if [ -n "${REDISCONNECTTIMEOUT}" ]; then
+  REDISARGS+=" --rconnecttimeout ${REDISCONNECTTIMEOUT}"
+fi
+if [ -n "${REDISTIMEOUT}" ]; then
+  REDISARGS+=" --rtimeout ${REDISTIMEOUT}"
+fi
+if [ -n "${MEMWATERMARK}" ]; then
+  REDISARGS+=" --memwatermark ${MEMWATERMARK}"
+fi
+
 unset DSIZEARG
 if [ -n "${MAXPOSTSIZE}" ]; then
   DSIZEARG="--dsize ${MAXPOSTSIZE}"
 fi
 
+unset LOGPOLICYARG
+if [ -n "${LOGPOLICY}" ]; then
+  LOGPOLICYARG="--logpolicy ${LOGPOLICY}"
+fi
+
+unset LOGSIZEARG
+if [ -n "${LOGROTATESIZE}" ]; then
+  LOGSIZEARG="--logsize ${LOGROTATESIZE}"
+fi
+
+unset LOGAGEARG
+if [ -n "${LOGROTATEAGE}" ]; then
+  LOGAGEARG="--logage ${LOGROTATEAGE}"
+fi
+
+unset LOGLEVELARG
+if [ -n "${LOGLEVEL}" ]; then
+  LOGLEVELARG="--loglevel ${LOGLEVEL}"
+fi
+
+unset SAMPLEARGS
+if [ -n "${LOGSAMPLEGET}" ]; then
+  SAMPLEARGS+=" --sampleget ${LOGSAMPLEGET}"
+fi
+if [ -n "${LOGSAMPLEPOST}" ]; then
+  SAMPLEARGS+=" --samplepost ${LOGSAMPLEPOST}"
+fi
+if [ -n "${LOGSAMPLECONN}" ]; then
+  SAMPLEARGS+=" --sampleconn ${LOGSAMPLECONN}"
+fi
+
 exec /app/webstore.exe -P ${HTTPPORT} \
---rtcp ${REDISIP}:${REDISPORT} \
+--rtcp ${REDISIP}:${REDISPORT} ${REDISARGS} \
 -l /log/webstore.log \
-${MTARG} ${CERTARG} ${KEYARG} ${DSIZEARG}
+${MTARG} ${WORKERSARG} ${SOCKARGS} ${CONNARGS} ${SHEDARGS} ${CERTARG} ${KEYARG} ${DSIZEARG} \
+${LOGPOLICYARG} ${LOGSIZEARG} ${LOGAGEARG} \
+${LOGLEVELARG} ${SAMPLEARGS}
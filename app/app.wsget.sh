@@ -24,4 +24,9 @@ if [ "${HTTPS}" == "0" ]; then unset SECURE; fi
 if [ "${HTTPS}" == "false" ]; then unset SECURE; fi
 if [ "${HTTPS}" == "FALSE" ]; then unset SECURE; fi
 
-exec /app/ws_get.exe ${SECURE} -H ${WSHOST} -P ${WSPORT} -t ${TOKEN}
+unset WAITARG
+if [ -n "${WAIT}" ]; then
+  WAITARG="-w ${WAIT}"
+fi
+
+exec /app/ws_get.exe ${SECURE} -H ${WSHOST} -P ${WSPORT} -t ${TOKEN} ${WAITARG}
@@ -0,0 +1,68 @@
+#!/bin/bash
+
+# Compare redis memory and read time per object for the plain layout (one key per object)
+# and the packed layout (PACKSIZE, objects as fields of P:<prefix> hashes)
+# Usage: ./bench_pack.sh [count] [object size] [prefix digits]
+# Uses (and flushes) database 15 of the redis server at REDISIP:REDISPORT
+
+set -e
+
+REDISIP=${REDISIP:-127.0.0.1}
+REDISPORT=${REDISPORT:-6379}
+COUNT=${1:-1000000}
+SIZE=${2:-40}
+PREFIX=${3:-4}
+RCLI="redis-cli -h ${REDISIP} -p ${REDISPORT} -n 15"
+
+used_memory()
+{
+  ${RCLI} INFO memory | grep '^used_memory:' | cut -d: -f2 | tr -d '\r'
+}
+
+# Emit COUNT writes (or reads with $2 = get) in the redis protocol, with random 32 digit tokens
+gen_cmds()
+{
+  awk -v count=${COUNT} -v size=${SIZE} -v prefix=${PREFIX} -v layout=$1 -v op=$2 'BEGIN {
+    srand(1)
+    value = ""
+    while(length(value) < size) { value = value "0123456789abcdefghij" }
+    value = substr(value, 1, size)
+    for(i=0; i<count; i++) {
+      token = sprintf("%08x%08x%08x%08x", rand()*4294967295, rand()*4294967295, rand()*4294967295, i)
+      bucket = "P:" substr(token, 1, prefix)
+      field = substr(token, prefix+1)
+      if((layout == "plain") && (op == "get")) {
+        printf("*2\r\n$3\r\nGET\r\n$%d\r\n%s\r\n", length(token), token)
+      } else if(layout == "plain") {
+        printf("*3\r\n$3\r\nSET\r\n$%d\r\n%s\r\n$%d\r\n%s\r\n", length(token), token, size, value)
+      } else if(op == "get") {
+        printf("*3\r\n$4\r\nHGET\r\n$%d\r\n%s\r\n$%d\r\n%s\r\n", length(bucket), bucket, length(field), field)
+      } else {
+        printf("*4\r\n$4\r\nHSET\r\n$%d\r\n%s\r\n$%d\r\n%s\r\n$%d\r\n%s\r\n", length(bucket), bucket, length(field), field, size, value)
+      }
+    }
+  }'
+}
+
+# Keep the buckets in listpack encoding (older redis calls it ziplist)
+${RCLI} CONFIG SET hash-max-listpack-value ${SIZE} >/dev/null 2>&1 || true
+${RCLI} CONFIG SET hash-max-ziplist-value ${SIZE} >/dev/null 2>&1 || true
+
+for LAYOUT in plain packed; do
+  ${RCLI} FLUSHDB >/dev/null
+  BEFORE=`used_memory`
+  gen_cmds ${LAYOUT} set | ${RCLI} --pipe >/dev/null
+  AFTER=`used_memory`
+  KEYS=`${RCLI} DBSIZE`
+
+  # Pipelined reads of every object, the time is dominated by the lookup and not by round trips
+  gen_cmds ${LAYOUT} get > /tmp/bench_pack.$$
+  START=`date +%s%N`
+  ${RCLI} --pipe < /tmp/bench_pack.$$ >/dev/null
+  END=`date +%s%N`
+  rm -f /tmp/bench_pack.$$
+
+  echo "${LAYOUT}: ${COUNT} objects of ${SIZE} bytes in ${KEYS} keys, $(( (AFTER - BEFORE) / COUNT )) bytes per object, $(( (END - START) / COUNT )) ns per pipelined read"
+done
+
+${RCLI} FLUSHDB >/dev/null
@@ -5,16 +5,17 @@ set -e
 OPT="-O2"
 DBG="-ggdb3 -DDEBUG"
 CFLAGS="-Wall"
+CFLAGS+=" -DMINIZ_COMPRESSION"
 OPTCFLAGS="${CFLAGS} ${OPT}"
 DBGCFLAGS="${CFLAGS} ${DBG}"
 # DBGCFLAGS+=" -DSRNODECHRONOMETRY"
 
 rm -f *.exe *.dbg
 
-gcc ${OPTCFLAGS} webstore*.c getopts.c searest*.c rai.c futils.c \
--lpthread -lmicrohttpd -lhiredis -o webstore.exe
+gcc ${OPTCFLAGS} webstore*.c getopts.c searest*.c rai.c futils.c z85.c compression.c \
+-lpthread -lm -lmicrohttpd -lhiredis -o webstore.exe
 
-gcc ${DBGCFLAGS} webstore*.c getopts.c searest*.c rai.c futils.c chronometry.c \
--lpthread -lmicrohttpd -lhiredis -o webstore.dbg
+gcc ${DBGCFLAGS} webstore*.c getopts.c searest*.c rai.c futils.c z85.c compression.c chronometry.c \
+-lpthread -lm -lmicrohttpd -lhiredis -o webstore.dbg
 
 strip *.exe
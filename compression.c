@@ -66,6 +66,67 @@ md_t* mza_restore(const unsigned char *comp_str, size_t comp_len, size_t orig_le
 	return mz;
 }
 
+#define MZA_CHUNK (64*1024)
+
+// Stream the file at src into a gzip file at dst
+// return 0 on success
+int mza_gzip_file(const char *src, const char *dst)
+{
+	static const unsigned char gzhdr[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+	unsigned char trailer[8];
+	FILE *in = NULL, *out = NULL;
+	tdefl_compressor *d = NULL;
+	unsigned char *ibuf = NULL, *obuf = NULL;
+	const unsigned char *p;
+	size_t n, left, ilen, olen;
+	mz_ulong crc = MZ_CRC32_INIT;
+	mz_uint32 total = 0;
+	tdefl_status status = TDEFL_STATUS_OKAY;
+	tdefl_flush flush;
+	int i, retval = -1;
+
+	in = fopen(src, "r");
+	out = fopen(dst, "w");
+	d = malloc(sizeof(tdefl_compressor));
+	ibuf = malloc(MZA_CHUNK);
+	obuf = malloc(MZA_CHUNK);
+	if(!in || !out || !d || !ibuf || !obuf) { goto done; }
+
+	// Raw deflate stream wrapped in a gzip header/trailer
+	tdefl_init(d, NULL, NULL, TDEFL_DEFAULT_MAX_PROBES);
+	if(fwrite(gzhdr, sizeof(gzhdr), 1, out) != 1) { goto done; }
+
+	do {
+		n = fread(ibuf, 1, MZA_CHUNK, in);
+		if(ferror(in)) { goto done; }
+		flush = feof(in) ? TDEFL_FINISH : TDEFL_NO_FLUSH;
+		crc = mz_crc32(crc, ibuf, n);
+		total += n;
+
+		p = ibuf; left = n;
+		do {
+			ilen = left; olen = MZA_CHUNK;
+			status = tdefl_compress(d, p, &ilen, obuf, &olen, flush);
+			if(status < 0) { goto done; }
+			p += ilen; left -= ilen;
+			if(olen && (fwrite(obuf, 1, olen, out) != olen)) { goto done; }
+		} while((status != TDEFL_STATUS_DONE) && (left || (olen == MZA_CHUNK) || (flush == TDEFL_FINISH)));
+	} while(flush != TDEFL_FINISH);
+
+	for(i=0; i<4; i++) { trailer[i] = (crc >> (8*i)) & 0xFF; }
+	for(i=0; i<4; i++) { trailer[4+i] = (total >> (8*i)) & 0xFF; }
+	if(fwrite(trailer, sizeof(trailer), 1, out) != 1) { goto done; }
+	retval = 0;
+
+done:
+	if(in) { fclose(in); }
+	if(out) { if(fclose(out)) { retval = -1; } }
+	if(d) { free(d); }
+	if(ibuf) { free(ibuf); }
+	if(obuf) { free(obuf); }
+	return retval;
+}
+
 void mza_free(md_t *mz)
 {
 	if(mz) {
@@ -16,6 +16,7 @@ typedef struct miniz_data {
 
 md_t* mza_squash(const unsigned char *, size_t);
 md_t* mza_restore(const unsigned char *, size_t, size_t);
+int mza_gzip_file(const char *, const char *);
 void mza_free(md_t *);
 
 #endif	/* __WEBSTORE_COMPRESSION_API_H__ */
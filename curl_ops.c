@@ -19,6 +19,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 //#include <unistd.h>
 #include <curl/curl.h>
 
@@ -50,7 +51,28 @@ static size_t save_response(void *ptr, size_t size, size_t nmemb, void *user_dat
 	return incdatasize;
 }
 
+// Pick the complete length out of a Content-Range header
+static size_t save_header(char *buf, size_t size, size_t nitems, void *user_data)
+{
+	curlresp_t *r = (curlresp_t *)user_data;
+	size_t len = size*nitems;
+	char *slash;
+
+	if((len > 14) && (strncasecmp(buf, "Content-Range:", 14) == 0)) {
+		slash = memchr(buf, '/', len);
+		if(slash) { r->range_total = strtol(slash+1, NULL, 10); }
+	}
+
+	return len;
+}
+
 int ws_curl_get(char *url, curlresp_t *r)
+{
+	return ws_curl_get_range(url, r, NULL);
+}
+
+// range is "first-last" as in a Range: bytes= header, NULL for the whole object
+int ws_curl_get_range(char *url, curlresp_t *r, char *range)
 {
 	CURL *ch;
 	CURLcode res;
@@ -69,6 +91,11 @@ int ws_curl_get(char *url, curlresp_t *r)
 	curl_easy_setopt(ch, CURLOPT_FOLLOWLOCATION, 0L);
 	curl_easy_setopt(ch, CURLOPT_WRITEFUNCTION, save_response);
 	curl_easy_setopt(ch, CURLOPT_WRITEDATA, r);
+	if(range) {
+		curl_easy_setopt(ch, CURLOPT_RANGE, range);
+		curl_easy_setopt(ch, CURLOPT_HEADERFUNCTION, save_header);
+		curl_easy_setopt(ch, CURLOPT_HEADERDATA, r);
+	}
 	//CURLcode curl_easy_setopt(ch, CURLOPT_TIMEOUT, long timeout);
 
 	res = curl_easy_perform(ch);
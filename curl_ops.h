@@ -23,6 +23,7 @@ typedef struct {
 	long bytecount;
 	char *page;	// free() this
 	long http_code;
+	long range_total;	// from Content-Range, 0 if there was none
 } curlresp_t;
 
 typedef struct {
@@ -31,6 +32,7 @@ typedef struct {
 } curlpost_t;
 
 int ws_curl_get(char *, curlresp_t *);
+int ws_curl_get_range(char *, curlresp_t *, char *);
 int ws_curl_post(char *, curlresp_t *, curlpost_t *);
 
 #endif
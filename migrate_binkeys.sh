@@ -0,0 +1,43 @@
+#!/bin/bash
+
+# Convert keys stored as lowercase hex (the default layout) to the BINKEYS layout
+# Run webstore with BINKEYS=migrate while this runs, then switch to BINKEYS=1
+# Usage: ./migrate_binkeys.sh [PACKPREFIX]
+# Safe to run more than once; binary keys that already exist are kept
+
+set -e
+
+REDISIP=${REDISIP:-127.0.0.1}
+REDISPORT=${REDISPORT:-6379}
+PREFIX=${1:-4}
+RCLI="redis-cli -h ${REDISIP} -p ${REDISPORT}"
+
+# One SCAN step per call, returns the next cursor
+LUA='
+local types = { [32]="1", [40]="2", [56]="3", [64]="4", [96]="5", [128]="6" }
+local prefix = tonumber(ARGV[2])
+local function unhex(h) return (h:gsub("..", function(x) return string.char(tonumber(x, 16)) end)) end
+local r = redis.call("SCAN", ARGV[1], "COUNT", 1000)
+for _, k in ipairs(r[2]) do
+  local t = types[#k]
+  if t and k:match("^[0-9a-f]+$") then
+    if redis.call("RENAMENX", k, "B" .. t .. unhex(k)) == 0 then redis.call("DEL", k) end
+  elseif (k:sub(1, 2) == "P:") and (#k == 2 + prefix) then
+    for _, f in ipairs(redis.call("HKEYS", k)) do
+      if types[#f + prefix] and f:match("^[0-9a-f]+$") then
+        redis.call("HSETNX", k, unhex(k:sub(3) .. f), redis.call("HGET", k, f))
+        redis.call("HDEL", k, f)
+      end
+    end
+  end
+end
+return r[1]
+'
+
+CURSOR=0
+while :; do
+  CURSOR=`${RCLI} EVAL "${LUA}" 0 ${CURSOR} ${PREFIX}`
+  if [ "${CURSOR}" == "0" ]; then break; fi
+done
+
+echo "Migration complete"
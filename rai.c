@@ -25,8 +25,10 @@
 #endif
 */
 
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 
 #include "rai.h"
 
@@ -40,10 +42,63 @@ void rai_unlock(rai_t *r)
 	pthread_mutex_unlock(&r->rl);
 }
 
+#define RAI_RETRY_MIN_MS (100)
+#define RAI_RETRY_MAX_MS (5000)
+
+static long rai_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000L) + (ts.tv_nsec / 1000000);
+}
+
+static void ms_to_tv(struct timeval *tv, long ms)
+{
+	tv->tv_sec = ms / 1000;
+	tv->tv_usec = (ms % 1000) * 1000;
+}
+
+// Connect and set the command timeout, returns NULL on failure
+static redisContext* rai_open(rai_t *r)
+{
+	redisContext *c;
+	int timed = (r->connect_tv.tv_sec || r->connect_tv.tv_usec);
+
+	if(r->port) {
+		if(timed)	c = redisConnectWithTimeout(r->dest, r->port, r->connect_tv);
+		else		c = redisConnect(r->dest, r->port);
+	} else {
+		if(timed)	c = redisConnectUnixWithTimeout(r->dest, r->connect_tv);
+		else		c = redisConnectUnix(r->dest);
+	}
+	if(!c) { return NULL; }
+
+	if(c->err) {
+		//fprintf(stderr, "Connection error: %s\n", c->errstr);
+		redisFree(c);
+		return NULL;
+	}
+
+	if(r->cmd_tv.tv_sec || r->cmd_tv.tv_usec) {
+		if(redisSetTimeout(c, r->cmd_tv) != REDIS_OK) {
+			redisFree(c);
+			return NULL;
+		}
+	}
+
+	return c;
+}
+
+// Call before rai_connect(), 0 means no timeout
+void rai_set_timeouts(rai_t *r, long connect_ms, long cmd_ms)
+{
+	if(connect_ms > 0) { ms_to_tv(&r->connect_tv, connect_ms); }
+	if(cmd_ms > 0) { ms_to_tv(&r->cmd_tv, cmd_ms); }
+}
+
 // return -1 means you have an open redis handle already (or it appears that way), bail
 // return -2 means pthread_mutex_init() failed, bail
 // return -3 means redisConnect() failed, bail
-// return -4 means there was an connetion error during redisConnect()
 int rai_connect(rai_t *r, char *dest, unsigned short port)
 {
 	int z;
@@ -55,23 +110,100 @@ int rai_connect(rai_t *r, char *dest, unsigned short port)
 		return -2;
 	}
 
-	if(port) r->c = redisConnect(dest, port);
-	else	r->c = redisConnectUnix(dest);
+	r->dest = strdup(dest);
+	r->port = port;
+	r->retry_ms = RAI_RETRY_MIN_MS;
+	r->seed = (unsigned int)rai_now_ms() ^ (unsigned int)getpid();
+
+	r->c = rai_open(r);
+	if(!r->c) { return -3; }
+
+	r->connected = 1;
+	r->breaker = RAI_BREAKER_CLOSED;
+	return 0;
+}
 
-	if(!r->c) {
-		//fprintf(stderr, "Connection error: can't allocate redis context\n");
-		return -3;
+// Call with the lock held before talking to redis
+// returns 1 if a command may be sent, 0 if the request should fail fast
+int rai_ready(rai_t *r)
+{
+	switch(r->breaker) {
+		case RAI_BREAKER_CLOSED:
+			// The command after a successful probe: redis is healthy again
+			if(r->probing) { r->probing = 0; r->retry_ms = RAI_RETRY_MIN_MS; }
+			return 1;
+		case RAI_BREAKER_HALF:
+			// Let one command through to probe the new connection
+			r->breaker = RAI_BREAKER_CLOSED;
+			r->probing = 1;
+			return 1;
 	}
 
-	if(r->c->err) {
-		//fprintf(stderr, "Connection error: %s\n", c->errstr);
-		redisFree(r->c);
-		r->c = NULL;
-		return -4;
+	r->fastfails++;
+	return 0;
+}
+
+// Call with the lock held when redis returned no reply
+// The context is unusable after an error, drop it and open the breaker until rai_reconnect() succeeds
+void rai_failed(rai_t *r)
+{
+	long wait;
+
+	if(r->c) { redisFree(r->c); r->c = NULL; }
+	r->connected = 0;
+	if(r->breaker != RAI_BREAKER_OPEN) { r->trips++; }
+	r->breaker = RAI_BREAKER_OPEN;
+
+	// A failed probe backs off further, a fresh failure starts over
+	if(r->probing) {
+		r->retry_ms *= 2;
+		if(r->retry_ms > RAI_RETRY_MAX_MS) { r->retry_ms = RAI_RETRY_MAX_MS; }
+	} else {
+		r->retry_ms = RAI_RETRY_MIN_MS;
 	}
+	r->probing = 0;
+
+	// Jitter so that worker processes don't reconnect in lockstep
+	wait = (r->retry_ms / 2) + (rand_r(&r->seed) % (r->retry_ms / 2 + 1));
+	r->next_try_ms = rai_now_ms() + wait;
+}
+
+// Call periodically from a background thread, without the lock
+// Connecting happens outside the lock so requests keep failing fast meanwhile
+// returns 0 if there was nothing to do, 1 on reconnect, -1 if the attempt failed
+int rai_reconnect(rai_t *r)
+{
+	redisContext *c;
+	long wait;
 
+	rai_lock(r);
+	if(r->connected || (rai_now_ms() < r->next_try_ms)) { rai_unlock(r); return 0; }
+	rai_unlock(r);
+
+	c = rai_open(r);
+
+	rai_lock(r);
+	if(!c) {
+		r->retry_ms *= 2;
+		if(r->retry_ms > RAI_RETRY_MAX_MS) { r->retry_ms = RAI_RETRY_MAX_MS; }
+		wait = (r->retry_ms / 2) + (rand_r(&r->seed) % (r->retry_ms / 2 + 1));
+		r->next_try_ms = rai_now_ms() + wait;
+		rai_unlock(r);
+		return -1;
+	}
+	r->c = c;
 	r->connected = 1;
-	return 0;
+	r->breaker = RAI_BREAKER_HALF;
+	rai_unlock(r);
+
+	return 1;
+}
+
+// Milliseconds until rai_reconnect() will try again, call with the lock held
+long rai_retry_in(rai_t *r)
+{
+	long wait = r->next_try_ms - rai_now_ms();
+	return (wait > 0) ? wait : 0;
 }
 
 // returns the last known state of our redis handle
@@ -87,6 +219,7 @@ void rai_disconnect(rai_t *r)
 	//Disconnects and frees the context
 	if(r->c) { redisFree(r->c); r->c = NULL; }
 	r->connected = 0;
+	if(r->dest) { free(r->dest); r->dest = NULL; }
 
 	rai_unlock(r);
 }
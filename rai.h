@@ -19,18 +19,43 @@
 #define __REDIS_ADVANCED_INTERFACE_H__
 
 #include <pthread.h>
+#include <sys/time.h>
 #include <hiredis/hiredis.h>
 
+#define RAI_BREAKER_CLOSED	(0)
+#define RAI_BREAKER_OPEN	(1)
+#define RAI_BREAKER_HALF	(2)
+
 typedef struct {
 	redisContext *c;
 	pthread_mutex_t rl;
 	int connected;
+
+	// Everything needed to reconnect
+	char *dest;
+	unsigned short port;
+	struct timeval connect_tv;
+	struct timeval cmd_tv;
+
+	// Circuit breaker
+	int breaker;
+	int probing;
+	long retry_ms;			// current backoff
+	long next_try_ms;
+	unsigned int seed;
+	unsigned long trips;
+	unsigned long fastfails;
 } rai_t;
 
 void rai_lock(rai_t *r);
 void rai_unlock(rai_t *r);
 
+void rai_set_timeouts(rai_t *r, long connect_ms, long cmd_ms);
 int rai_connect(rai_t *r, char *dest, unsigned short port);
+int rai_ready(rai_t *r);
+void rai_failed(rai_t *r);
+int rai_reconnect(rai_t *r);
+long rai_retry_in(rai_t *r);
 int rai_check_connection(rai_t *r);
 int rai_is_connected(rai_t *r);
 void rai_disconnect(rai_t *r);
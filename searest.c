@@ -25,6 +25,11 @@
 #include <string.h>
 #include <arpa/inet.h>
 
+#include <unistd.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
 #include <sys/types.h>
 #include <sys/select.h>
 #include <sys/socket.h>
@@ -78,6 +83,36 @@ int srci_get_method_type(srci_t *ri)
 	return ri->method_type;
 }
 
+// Any request header, valid until the node callback returns
+const char* srci_get_request_header(srci_t *ri, const char *name)
+{
+	return MHD_lookup_connection_value(ri->connection, MHD_HEADER_KIND, name);
+}
+
+const char* srci_get_query_arg(srci_t *ri, const char *name)
+{
+	return MHD_lookup_connection_value(ri->connection, MHD_GET_ARGUMENT_KIND, name);
+}
+
+// Return NULL from the node after this: the request gives up its lane and limiter slots,
+// the park callback sleeps on ctx until it is woken or until_ms, then the node is called again
+void srci_park(srci_t *ri, long until_ms, void *ctx)
+{
+	ri->park_until = until_ms;
+	ri->park_ctx = ctx;
+}
+
+long srci_get_park_until(srci_t *ri)
+{
+	return ri->park_until;
+}
+
+// SR_LANE_FAST or SR_LANE_BULK, always SR_LANE_FAST without lanes
+int srci_get_lane(srci_t *ri)
+{
+	return ri->lane;
+}
+
 void srci_set_response_content_type(srci_t *ri, char *ct)
 {
 	if(ri->content_type) { free(ri->content_type); }
@@ -97,6 +132,16 @@ void srci_set_response_cors(srci_t *ri)
 	ri->cors = 1;
 }
 
+// returns -1 if SR_MAXHEADERS headers were already added
+int srci_add_response_header(srci_t *ri, const char *name, const char *value)
+{
+	if(ri->hdr_count >= SR_MAXHEADERS) { return -1; }
+	ri->hdr_name[ri->hdr_count] = strdup(name);
+	ri->hdr_value[ri->hdr_count] = strdup(value);
+	ri->hdr_count++;
+	return 0;
+}
+
 const unsigned char* srci_get_post_data_ptr(srci_t *ri)
 {
 	return ri->post_data;
@@ -112,31 +157,96 @@ void srci_set_return_code(srci_t *ri, int code)
 	ri->return_code = code;
 }
 
-// THIS MUST BE FREE()'d -- and it does get free()'d in uhd_request_completed()
-static char* client_ip_str (struct MHD_Connection *connection)
+// The page returned by the node callback is shared and must not be copied or freed
+// release(ctx) is called once the response has been sent
+void srci_set_return_shared(srci_t *ri, size_t len, void (*release)(void *), void *ctx)
 {
-	const union MHD_ConnectionInfo *ci;
-	struct sockaddr_in *in;
-	char ip_str[128];
+	ri->return_len = len;
+	ri->return_release = release;
+	ri->return_release_ctx = ctx;
+}
 
-	ci = MHD_get_connection_info (connection, MHD_CONNECTION_INFO_CLIENT_ADDRESS);
-	if(!ci) { return NULL; }
+// Answer a HEAD request without a body, advertising len as the Content-Length
+void srci_set_return_head(srci_t *ri, size_t len)
+{
+	ri->head_only = 1;
+	ri->head_len = len;
+}
 
-	in = (struct sockaddr_in *)ci->client_addr;
-	if(!in) { return NULL; }
+// The body is produced by reader(ctx, pos, buf, max) as it is sent, with chunked encoding
+// (MHD_ContentReaderCallback), release(ctx) is called once the response is gone
+void srci_set_return_stream(srci_t *ri, ssize_t (*reader)(void *, uint64_t, char *, size_t), void (*release)(void *), void *ctx)
+{
+	ri->stream_read = reader;
+	ri->stream_free = release;
+	ri->stream_ctx = ctx;
+}
 
-	switch(in->sin_family) {
+// MHD never asks for the body of a HEAD response
+static ssize_t head_reader(void *cls, uint64_t pos, char *buf, size_t max)
+{
+	return MHD_CONTENT_READER_END_WITH_ERROR;
+}
+
+// Format a client address
+// IPv4-mapped IPv6 addresses (dual-stack listener) come out as plain IPv4
+static int addr_to_str(const struct sockaddr *sa, char *buf, socklen_t len)
+{
+	const struct sockaddr_in6 *in6;
+
+	switch(sa->sa_family) {
 		case AF_INET:
-			inet_ntop(AF_INET, &in->sin_addr, &ip_str[0], INET_ADDRSTRLEN);
-			break;
+			if(!inet_ntop(AF_INET, &((const struct sockaddr_in *)sa)->sin_addr, buf, len)) { return -1; }
+			return 0;
 		case AF_INET6:
-			inet_ntop(AF_INET6, &in->sin_addr, &ip_str[0], INET6_ADDRSTRLEN);
-			break;
-		default:
-			return NULL;
+			in6 = (const struct sockaddr_in6 *)sa;
+			if(IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+				if(!inet_ntop(AF_INET, &in6->sin6_addr.s6_addr[12], buf, len)) { return -1; }
+			} else {
+				if(!inet_ntop(AF_INET6, &in6->sin6_addr, buf, len)) { return -1; }
+			}
+			return 0;
 	}
 
-	return strdup(ip_str);
+	return -1;
+}
+
+// Monotonic clock in microseconds, shared by the limiter and the lanes
+long searest_mono_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000L) + (ts.tv_nsec / 1000);
+}
+
+// Error with Retry-After, queued without ever touching a node callback
+static int queue_reject_response(sri_t *ws, struct MHD_Connection *connection, int code, char *page)
+{
+	struct MHD_Response *response;
+	char ra[16];
+	int ret;
+
+	response = MHD_create_response_from_buffer(strlen(page), page, MHD_RESPMEM_PERSISTENT);
+	snprintf(ra, sizeof(ra), "%d", ws->retry_after);
+	MHD_add_response_header(response, "Retry-After", ra);
+	ret = MHD_queue_response (connection, code, response);
+	MHD_destroy_response (response);
+	return ret;
+}
+
+static int queue_shed_response(sri_t *ws, struct MHD_Connection *connection)
+{
+	static char page[] = "service overloaded";
+	return queue_reject_response(ws, connection, MHD_HTTP_SERVICE_UNAVAILABLE, page);
+}
+
+static srcc_t* conn_ctx(struct MHD_Connection *connection)
+{
+	const union MHD_ConnectionInfo *ci;
+
+	ci = MHD_get_connection_info (connection, MHD_CONNECTION_INFO_SOCKET_CONTEXT);
+	if(!ci) { return NULL; }
+	return ci->socket_context;
 }
 
 static char* process_request(sri_t *ws, srci_t *ri, void *sri_user_data)
@@ -169,6 +279,28 @@ static char* process_request(sri_t *ws, srci_t *ri, void *sri_user_data)
 	return ri->return_page;
 }
 
+// Run the node inside its lane and the limiter, returns -1 if the request was shed
+static int run_request(sri_t *ws, srci_t *ri, char **page)
+{
+	long t0;
+
+	if(ws->lanes && searest_lanes_enter(ws->lanes, ri->lane)) { return -1; }
+	if(ws->limiter) {
+		if(searest_limit_enter(ws->limiter)) {
+			if(ws->lanes) { searest_lanes_leave(ws->lanes, ri->lane); }
+			return -1;
+		}
+		t0 = searest_mono_us();
+		*page = process_request(ws, ri, ws->sri_user_data);
+		searest_limit_leave(ws->limiter, searest_mono_us() - t0);
+	} else {
+		*page = process_request(ws, ri, ws->sri_user_data);
+	}
+	if(ws->lanes) { searest_lanes_leave(ws->lanes, ri->lane); }
+
+	return 0;
+}
+
 /* https://www.gnu.org/software/libmicrohttpd/manual/html_node/microhttpd_002dcb.html
  *
  * upload_data
@@ -200,10 +332,13 @@ static int uhd_request_started (void *sri_user_data, struct MHD_Connection *conn
 const char *url, const char *method, const char *version,
 const char *upload_data, size_t *upload_data_size, void **con_cls)
 {
-	int ret = MHD_NO;
+	int i, ret = MHD_NO;
 	char *page = NULL;
 	sri_t *ws = sri_user_data;
 	srci_t *ri = *con_cls;
+	srcc_t *cc;
+	void *ctx;
+	int code;
 	struct MHD_Response *response;
 	const char *accept_header;
 	const char *auth_header;
@@ -219,6 +354,7 @@ const char *upload_data, size_t *upload_data_size, void **con_cls)
 		if(!ri) { return MHD_NO; }
 		*con_cls = (void *)ri;
 
+		ri->connection = connection;
 		ri->url = strdup(url);
 		ri->urllen = strlen(url);
 		if(ri->urllen < ws->min_url_len) { return MHD_NO; }
@@ -226,7 +362,24 @@ const char *upload_data, size_t *upload_data_size, void **con_cls)
 		if(strlen(method) < 3) { return MHD_NO; }
 		if(strlen(method) > 7) { return MHD_NO; }
 
-		ri->ip = client_ip_str(connection);
+		// The client address was formatted once when the connection was accepted
+		cc = conn_ctx(connection);
+		if(!cc) { return MHD_NO; }
+		ri->ip = cc->ip;
+
+		// Drop clients that dribble their request headers in
+		ri->started_ms = searest_mono_us() / 1000;
+		cc->active = 1;
+		if((ws->header_timeout > 0) && (ri->started_ms - cc->ready_ms > ws->header_timeout*1000L)) {
+			atomic_fetch_add(&ws->evict_header, 1);
+			cc->evicted = 1;
+			return MHD_NO;
+		}
+
+		// The headers are in, the first request goes back to the inactivity timeout
+		if((ws->header_timeout > 0) && (cc->requests++ == 0)) {
+			MHD_set_connection_option(connection, MHD_CONNECTION_OPTION_TIMEOUT, (unsigned int)ws->inactivity_timeout);
+		}
 
 		// Process Headers
 		accept_header = MHD_lookup_connection_value (connection, MHD_HEADER_KIND, HDRASTR);
@@ -245,9 +398,24 @@ const char *upload_data, size_t *upload_data_size, void **con_cls)
 		else if (strcmp (method, "PUT") == 0)		{ ri->method_type = METHOD_PUT; }
 		else if (strcmp (method, "DELETE") == 0)	{ ri->method_type = METHOD_DEL; }
 		else if (strcmp (method, "OPTIONS") == 0)	{ ri->method_type = METHOD_OPT; }
+		else if (strcmp (method, "HEAD") == 0)		{ ri->method_type = METHOD_HEAD; }
 		else { return MHD_NO; }
 
-		//We need to ask the caller if XXX bytes of upload data is ok 
+		// Let the caller refuse the request on URL, method and size alone
+		if(ws->admit_cb) {
+			code = ws->admit_cb(ri->url, ri->method_type, ri->content_length, ws->sri_user_data);
+			if(code == MHD_HTTP_INSUFFICIENT_STORAGE) { return queue_reject_response(ws, connection, code, "insufficient storage"); }
+			if(code) { return queue_reject_response(ws, connection, code, "request refused"); }
+		}
+
+		// Pick a lane while we know the size but before any of the body is read
+		if(ws->lanes) { ri->lane = searest_lanes_classify(ws->lanes, ri->method_type, ri->content_length); }
+
+		// Shed load before reading any of the body
+		if(ws->limiter) {
+			if(searest_limit_admit(ws->limiter, ri->content_length)) { return queue_shed_response(ws, connection); }
+			ri->upload_reserved = ri->content_length;
+		}
 
 #ifdef DEBUG
 		//if(content_length_header) printf ("Content-Length: %s \n", content_length_header);
@@ -260,6 +428,10 @@ const char *upload_data, size_t *upload_data_size, void **con_cls)
 	// While we have post data to gather, gather and save
 	if(upload_data && *upload_data_size) {
 		size_t blobsize = *upload_data_size;
+		if((ws->body_timeout > 0) && ((searest_mono_us() / 1000) - ri->started_ms > ws->body_timeout*1000L)) {
+			atomic_fetch_add(&ws->evict_body, 1);
+			return MHD_NO;
+		}
 		size_t newbufsize = ri->post_data_len + blobsize;
 		if(newbufsize > ri->content_length) { return MHD_NO; }
 
@@ -278,7 +450,15 @@ const char *upload_data, size_t *upload_data_size, void **con_cls)
 	if(ri->post_data) { printf ("Content: %s \n", ri->post_data); }
 #endif
 
-	page = process_request(ws, ri, ws->sri_user_data);
+	if(run_request(ws, ri, &page)) { return queue_shed_response(ws, connection); }
+
+	// A parked request sleeps in its connection thread without holding a lane or limiter slot
+	while(!page && ri->park_ctx && ws->park_cb) {
+		ctx = ri->park_ctx;
+		ri->park_ctx = NULL;
+		ws->park_cb(ctx, ri->park_until, ws->sri_user_data);
+		if(run_request(ws, ri, &page)) { return queue_shed_response(ws, connection); }
+	}
 
 	if(page) {
 		// What if the caller never set return code with srci_set_return_code() ?
@@ -287,10 +467,18 @@ const char *upload_data, size_t *upload_data_size, void **con_cls)
 		if(ri->return_code == 0) ri->return_code = MHD_HTTP_OK;
 
 		// This will only work with text, modify this for binary file transfer
-		response = MHD_create_response_from_buffer(strlen(page), page, MHD_RESPMEM_MUST_COPY);
+		// A shared page stays valid until uhd_request_completed() releases it
+		if(ri->head_only) { response = MHD_create_response_from_callback(ri->head_len, 4096, &head_reader, NULL, NULL); }
+		else if(ri->stream_read) {
+			response = MHD_create_response_from_callback(MHD_SIZE_UNKNOWN, 32*1024, ri->stream_read, ri->stream_ctx, ri->stream_free);
+			if(response) { ri->stream_free = NULL; }	// MHD owns the stream now
+		}
+		else if(ri->return_release) { response = MHD_create_response_from_buffer(ri->return_len, page, MHD_RESPMEM_PERSISTENT); }
+		else { response = MHD_create_response_from_buffer(strlen(page), page, MHD_RESPMEM_MUST_COPY); }
 		if(ri->content_type) { MHD_add_response_header(response, HDRCTSTR, ri->content_type); }
 		if(ri->allow) { MHD_add_response_header(response, "Allow", ri->allow); }
 		if(ri->cors) { MHD_add_response_header(response, "Access-Control-Allow-Origin", "*"); }
+		for(i=0; i<ri->hdr_count; i++) { MHD_add_response_header(response, ri->hdr_name[i], ri->hdr_value[i]); }
 		ret = MHD_queue_response (connection, ri->return_code, response);
 		MHD_destroy_response (response);
 	}
@@ -306,16 +494,36 @@ const char *upload_data, size_t *upload_data_size, void **con_cls)
 static void uhd_request_completed (void *user_data, struct MHD_Connection *connection, void **con_cls, enum MHD_RequestTerminationCode toe)
 {
 	srci_t *ri = *con_cls;
+	sri_t *ws = user_data;
+	srcc_t *cc;
+	int i;
+
+	cc = conn_ctx(connection);
+	if(toe == MHD_REQUEST_TERMINATED_TIMEOUT_REACHED) {
+		atomic_fetch_add(&ws->evict_idle, 1);
+		if(cc) { cc->evicted = 1; }
+	}
+	if(cc) {
+		cc->ready_ms = searest_mono_us() / 1000;
+		cc->active = 0;
+	}
+
 	if (!ri) { return; }
 
-	if(ri->ip) { free(ri->ip); }
+	if(ri->upload_reserved) { searest_limit_release_upload(ws->limiter, ri->upload_reserved); }
 	if(ri->url) { free(ri->url); }
 	if(ri->accept) { free(ri->accept); }
 	if(ri->auth) { free(ri->auth); }
 	if(ri->post_data) { free(ri->post_data); }
 	if(ri->content_type) { free(ri->content_type); }
 	if(ri->allow) { free(ri->allow); }
-	if(ri->return_page) { free(ri->return_page); }
+	for(i=0; i<ri->hdr_count; i++) {
+		free(ri->hdr_name[i]);
+		free(ri->hdr_value[i]);
+	}
+	if(ri->return_release) { ri->return_release(ri->return_release_ctx); }
+	else if(ri->return_page) { free(ri->return_page); }
+	if(ri->stream_free) { ri->stream_free(ri->stream_ctx); }
 	free(ri);
 	*con_cls = NULL;   
 }
@@ -340,41 +548,126 @@ static void* uhd_logger (void *user_data, const char *uri)
 
 static int uhd_client_connect (void *user_data, const struct sockaddr *addr, socklen_t addrlen)
 {
-	struct sockaddr_in *in = (struct sockaddr_in *)addr;
 	sri_t *ws = user_data;
-	int retval;
-	char ip_str[128];
-	char *ip;
+	char ip_str[INET6_ADDRSTRLEN];
 
 	if(!addr) { return MHD_NO; }	//this should never happen
+	if(!ws->addr_cb && !ws->iptrack) { return MHD_YES; }
+
+	if(addr_to_str(addr, ip_str, sizeof(ip_str))) { return MHD_NO; }
+
+#ifdef DEBUG
+	//printf("New Connection from: %s\n", ip_str);
+#endif
+
+	// Cheap local check before any caller policy
+	if(ws->iptrack && (searest_iptrack_count(ws->iptrack, ip_str) >= ws->per_ip_limit)) {
+		atomic_fetch_add(&ws->evict_ipcap, 1);
+		return MHD_NO;
+	}
+
 	if(!ws->addr_cb) { return MHD_YES; }
+	return ws->addr_cb(ip_str, ws->sri_user_data);
+}
 
-	switch(in->sin_family) {
-		case AF_INET:
-			inet_ntop(AF_INET, &in->sin_addr, &ip_str[0], INET_ADDRSTRLEN);
+// A connection closed between requests: count it if it sat there for the whole timeout
+// NOTIFY_COMPLETED never runs for these, there is no request
+static void conn_timed_out(sri_t *ws, srcc_t *cc)
+{
+	long idle = (searest_mono_us() / 1000) - cc->ready_ms;
+	int timeout = cc->requests ? ws->inactivity_timeout : ws->header_timeout;
+
+	if(cc->requests == 0 && timeout <= 0) { timeout = ws->inactivity_timeout; }
+	if(timeout <= 0) { return; }
+
+	// MHD checks its timeouts with a one second resolution
+	if(idle < (timeout - 1) * 1000L) { return; }
+	if(cc->requests == 0 && ws->header_timeout > 0) { atomic_fetch_add(&ws->evict_header, 1); }
+	else { atomic_fetch_add(&ws->evict_idle, 1); }
+}
+
+// Build the per-connection context once, every request on a keep-alive connection reuses it
+static void uhd_connection_notify (void *user_data, struct MHD_Connection *connection, void **socket_context, enum MHD_ConnectionNotificationCode toe)
+{
+	const union MHD_ConnectionInfo *ci;
+	sri_t *ws = user_data;
+	srcc_t *cc;
+
+	switch(toe) {
+		case MHD_CONNECTION_NOTIFY_STARTED:
+			cc = calloc(1, sizeof(srcc_t));
+			if(!cc) { return; }
+			ci = MHD_get_connection_info (connection, MHD_CONNECTION_INFO_CLIENT_ADDRESS);
+			if(ci && ci->client_addr) {
+				switch(ci->client_addr->sa_family) {
+					case AF_INET:	cc->addrlen = sizeof(struct sockaddr_in);	break;
+					case AF_INET6:	cc->addrlen = sizeof(struct sockaddr_in6);	break;
+				}
+				memcpy(&cc->addr, ci->client_addr, cc->addrlen);
+				if(addr_to_str(ci->client_addr, cc->ip, sizeof(cc->ip))) { cc->ip[0] = 0; }
+			}
+			cc->ready_ms = searest_mono_us() / 1000;
+			if(ws->iptrack && cc->ip[0]) {
+				searest_iptrack_inc(ws->iptrack, cc->ip);
+				cc->tracked = 1;
+			}
+			// MHD only calls us once the headers are complete, its timeout cuts off a client
+			// that stalls while sending them (one that keeps trickling is caught in request_started)
+			if(ws->header_timeout > 0) {
+				MHD_set_connection_option(connection, MHD_CONNECTION_OPTION_TIMEOUT, (unsigned int)ws->header_timeout);
+			}
+			*socket_context = cc;
 			break;
-		case AF_INET6:
-			inet_ntop(AF_INET6, &in->sin_addr, &ip_str[0], INET6_ADDRSTRLEN);
+		case MHD_CONNECTION_NOTIFY_CLOSED:
+			cc = *socket_context;
+			if(cc && !cc->active && !cc->evicted) { conn_timed_out(ws, cc); }
+			if(cc && cc->tracked) { searest_iptrack_dec(ws->iptrack, cc->ip); }
+			if(cc) { free(cc); }
+			*socket_context = NULL;
 			break;
-		default:
-			return MHD_NO;
 	}
+}
 
-#ifdef DEBUG
-	//printf("New Connection from: %s\n", ip_str);
-#endif
+static void set_sockopt_int(int fd, int level, int name, int value, const char *desc)
+{
+	if(setsockopt(fd, level, name, &value, sizeof(value))) {
+		fprintf(stderr, "setsockopt(%s, %d) failed: %s\n", desc, value, strerror(errno));
+	}
+}
+
+// Create, tune, bind and listen on the server socket ourselves
+// so that MHD never has to be taught about any of these options
+// Accepted sockets inherit TCP_NODELAY and the buffer sizes from the listener
+static int listen_socket(sri_t *ws, struct sockaddr *server, socklen_t len)
+{
+	int fd;
+
+	fd = socket(server->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd < 0) { return -1; }
+
+	// Accept IPv4 clients on the IPv6 socket too (dual-stack)
+	if(server->sa_family == AF_INET6) { set_sockopt_int(fd, IPPROTO_IPV6, IPV6_V6ONLY, 0, "IPV6_V6ONLY"); }
+	set_sockopt_int(fd, SOL_SOCKET, SO_REUSEADDR, 1, "SO_REUSEADDR");
+	if(ws->reuse_port) { set_sockopt_int(fd, SOL_SOCKET, SO_REUSEPORT, 1, "SO_REUSEPORT"); }
+	if(ws->defer_accept > 0) { set_sockopt_int(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, ws->defer_accept, "TCP_DEFER_ACCEPT"); }
+	if(ws->fastopen > 0) { set_sockopt_int(fd, IPPROTO_TCP, TCP_FASTOPEN, ws->fastopen, "TCP_FASTOPEN"); }
+	if(ws->nodelay) { set_sockopt_int(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY"); }
+	if(ws->rcvbuf > 0) { set_sockopt_int(fd, SOL_SOCKET, SO_RCVBUF, ws->rcvbuf, "SO_RCVBUF"); }
+	if(ws->sndbuf > 0) { set_sockopt_int(fd, SOL_SOCKET, SO_SNDBUF, ws->sndbuf, "SO_SNDBUF"); }
 
-	ip = strdup(ip_str);
-	retval = ws->addr_cb(ip, ws->sri_user_data);
-	free(ip);
-	return retval;
+	if(bind(fd, server, len)) { close(fd); return -2; }
+	if(listen(fd, ws->listen_backlog)) { close(fd); return -3; }
+
+	return fd;
 }
 
 // Consider MHD_OPTION_CONNECTION_LIMIT here too
 // Maximum number of concurrent connections to accept (followed by an unsigned int).
 // The default is FD_SETSIZE - 4 (the maximum number of file descriptors supported by select minus four for stdin, stdout, stderr and the server socket).
 // In other words, the default is as large as possible.
-int searest_start(sri_t *ws, char *ip4addr, unsigned short port, void *sri_user_data)
+// With no ipaddr, listen on every IPv6 and IPv4 address (dual-stack)
+// falling back to IPv4 only if the IPv6 socket cannot be created, bound or listened on
+int searest_start(sri_t *ws, char *ipaddr, unsigned short port, void *sri_user_data)
 {
 #ifdef USEMHDOPTS
 	int i;
@@ -382,6 +675,7 @@ int searest_start(sri_t *ws, char *ip4addr, unsigned short port, void *sri_user_
 #endif
 	//struct MHD_OptionItem mhdops[12];
 	struct sockaddr_in server;
+	struct sockaddr_in6 server6;
 
 	// https://www.gnu.org/software/libmicrohttpd/manual/libmicrohttpd.html
 	// https://www.gnu.org/software/libmicrohttpd/manual/html_node/microhttpd_002dconst.html
@@ -393,14 +687,29 @@ int searest_start(sri_t *ws, char *ip4addr, unsigned short port, void *sri_user_
 	memset(&server, 0, sizeof(server));
 	server.sin_family = AF_INET;
 	server.sin_port = htons(port);
-	if(!ip4addr) { server.sin_addr.s_addr = INADDR_ANY; }
-	else { inet_pton(AF_INET, ip4addr, &server.sin_addr); }
+	server.sin_addr.s_addr = INADDR_ANY;
+	memset(&server6, 0, sizeof(server6));
+	server6.sin6_family = AF_INET6;
+	server6.sin6_port = htons(port);
+	server6.sin6_addr = in6addr_any;
+
+	if(!ipaddr) {
+		ws->listen_fd = listen_socket(ws, (struct sockaddr *)&server6, sizeof(server6));
+		if(ws->listen_fd < 0) { ws->listen_fd = listen_socket(ws, (struct sockaddr *)&server, sizeof(server)); }
+	} else if(strchr(ipaddr, ':')) {
+		if(inet_pton(AF_INET6, ipaddr, &server6.sin6_addr) != 1) { return 4; }
+		ws->listen_fd = listen_socket(ws, (struct sockaddr *)&server6, sizeof(server6));
+	} else {
+		if(inet_pton(AF_INET, ipaddr, &server.sin_addr) != 1) { return 4; }
+		ws->listen_fd = listen_socket(ws, (struct sockaddr *)&server, sizeof(server));
+	}
+	if(ws->listen_fd < 0) { return 3; }
 
 #ifdef USEMHDOPTS
 	i=0; mhdops=NULL;
 	mhdops = realloc(mhdops, (i+1)*sizeof(struct MHD_OptionItem));
-	mhdops[i].option = MHD_OPTION_SOCK_ADDR;
-	mhdops[i].value = (intptr_t)&server;
+	mhdops[i].option = MHD_OPTION_LISTEN_SOCKET;
+	mhdops[i].value = ws->listen_fd;
 	mhdops[i++].ptr_value = NULL;
 
 	mhdops = realloc(mhdops, (i+1)*sizeof(struct MHD_OptionItem));
@@ -411,7 +720,12 @@ int searest_start(sri_t *ws, char *ip4addr, unsigned short port, void *sri_user_
 	mhdops = realloc(mhdops, (i+1)*sizeof(struct MHD_OptionItem));
 	mhdops[i].option = MHD_OPTION_NOTIFY_COMPLETED;
 	mhdops[i].value = (intptr_t)&uhd_request_completed;
-	mhdops[i++].ptr_value = sri_user_data;
+	mhdops[i++].ptr_value = ws;
+
+	mhdops = realloc(mhdops, (i+1)*sizeof(struct MHD_OptionItem));
+	mhdops[i].option = MHD_OPTION_NOTIFY_CONNECTION;
+	mhdops[i].value = (intptr_t)&uhd_connection_notify;
+	mhdops[i++].ptr_value = ws;
 
 	mhdops = realloc(mhdops, (i+1)*sizeof(struct MHD_OptionItem));
 	mhdops[i].option = MHD_OPTION_CONNECTION_TIMEOUT;
@@ -423,6 +737,11 @@ int searest_start(sri_t *ws, char *ip4addr, unsigned short port, void *sri_user_
 	mhdops[i].value = ws->conn_limit;
 	mhdops[i++].ptr_value = NULL;
 
+	mhdops = realloc(mhdops, (i+1)*sizeof(struct MHD_OptionItem));
+	mhdops[i].option = MHD_OPTION_CONNECTION_MEMORY_LIMIT;
+	mhdops[i].value = ws->conn_mem_limit;
+	mhdops[i++].ptr_value = NULL;
+
 	if(ws->https_cert && ws->https_key) {
 		mhdops = realloc(mhdops, (i+1)*sizeof(struct MHD_OptionItem));
 		mhdops[i].option = MHD_OPTION_HTTPS_MEM_CERT;
@@ -459,11 +778,13 @@ int searest_start(sri_t *ws, char *ip4addr, unsigned short port, void *sri_user_
 			ws->mhd_srv = MHD_start_daemon (ws->socket_model | ws->ssl_flag, 0,
 						&uhd_client_connect, ws,
 						&uhd_request_started, ws,
-						MHD_OPTION_SOCK_ADDR, &server, 
+						MHD_OPTION_LISTEN_SOCKET, ws->listen_fd,
 						MHD_OPTION_URI_LOG_CALLBACK, &uhd_logger, sri_user_data,
-						MHD_OPTION_NOTIFY_COMPLETED, &uhd_request_completed, sri_user_data,
+						MHD_OPTION_NOTIFY_COMPLETED, &uhd_request_completed, ws,
+						MHD_OPTION_NOTIFY_CONNECTION, &uhd_connection_notify, ws,
 						MHD_OPTION_CONNECTION_TIMEOUT, ws->inactivity_timeout,
 						MHD_OPTION_CONNECTION_LIMIT, ws->conn_limit,
+						MHD_OPTION_CONNECTION_MEMORY_LIMIT, ws->conn_mem_limit,
 						MHD_OPTION_HTTPS_MEM_CERT, ws->https_cert,
 						MHD_OPTION_HTTPS_MEM_KEY, ws->https_key,
 						MHD_OPTION_HTTPS_MEM_TRUST, ws->https_ca,
@@ -472,11 +793,13 @@ int searest_start(sri_t *ws, char *ip4addr, unsigned short port, void *sri_user_
 			ws->mhd_srv = MHD_start_daemon (ws->socket_model | ws->ssl_flag, 0,
 						&uhd_client_connect, ws,
 						&uhd_request_started, ws,
-						MHD_OPTION_SOCK_ADDR, &server, 
+						MHD_OPTION_LISTEN_SOCKET, ws->listen_fd,
 						MHD_OPTION_URI_LOG_CALLBACK, &uhd_logger, sri_user_data,
-						MHD_OPTION_NOTIFY_COMPLETED, &uhd_request_completed, sri_user_data,
+						MHD_OPTION_NOTIFY_COMPLETED, &uhd_request_completed, ws,
+						MHD_OPTION_NOTIFY_CONNECTION, &uhd_connection_notify, ws,
 						MHD_OPTION_CONNECTION_TIMEOUT, ws->inactivity_timeout,
 						MHD_OPTION_CONNECTION_LIMIT, ws->conn_limit,
+						MHD_OPTION_CONNECTION_MEMORY_LIMIT, ws->conn_mem_limit,
 						MHD_OPTION_HTTPS_MEM_CERT, ws->https_cert,
 						MHD_OPTION_HTTPS_MEM_KEY, ws->https_key,
 						MHD_OPTION_END);
@@ -485,16 +808,18 @@ int searest_start(sri_t *ws, char *ip4addr, unsigned short port, void *sri_user_
 		ws->mhd_srv = MHD_start_daemon (ws->socket_model | ws->ssl_flag, 0,
 						&uhd_client_connect, ws,
 						&uhd_request_started, ws,
-						MHD_OPTION_SOCK_ADDR, &server, 
+						MHD_OPTION_LISTEN_SOCKET, ws->listen_fd,
 						MHD_OPTION_URI_LOG_CALLBACK, &uhd_logger, sri_user_data,
-						MHD_OPTION_NOTIFY_COMPLETED, &uhd_request_completed, sri_user_data,
+						MHD_OPTION_NOTIFY_COMPLETED, &uhd_request_completed, ws,
+						MHD_OPTION_NOTIFY_CONNECTION, &uhd_connection_notify, ws,
 						MHD_OPTION_CONNECTION_TIMEOUT, ws->inactivity_timeout,
 						MHD_OPTION_CONNECTION_LIMIT, ws->conn_limit,
+						MHD_OPTION_CONNECTION_MEMORY_LIMIT, ws->conn_mem_limit,
 						MHD_OPTION_END);
 	}
 #endif
 
-	if(!ws->mhd_srv) { return 2; }
+	if(!ws->mhd_srv) { close(ws->listen_fd); ws->listen_fd = -1; return 2; }
 	return 0;
 }
 
@@ -521,25 +846,153 @@ void searest_set_conn_limit(sri_t *ws, unsigned int limit)
 	ws->conn_limit = limit;
 }
 
+// Close connections that have been idle (including keep-alive) for this many seconds
 void searest_set_inactivity_timeout(sri_t *ws, int timeout)
 {
 	ws->inactivity_timeout = timeout;
 }
 
+// Seconds allowed to receive request headers (counted from accept or from the end of the previous request)
+// and to receive the upload body (counted from the end of the headers), 0 disables either
+void searest_set_request_timeouts(sri_t *ws, int header, int body)
+{
+	ws->header_timeout = header;
+	ws->body_timeout = body;
+}
+
+// Maximum number of concurrent connections from one client IP, 0 disables
+void searest_set_per_ip_limit(sri_t *ws, unsigned int limit)
+{
+	ws->per_ip_limit = limit;
+	if(limit && !ws->iptrack) { ws->iptrack = searest_iptrack_new(); }
+}
+
+// Size of the memory pool MHD gives each connection for headers and buffering
+void searest_set_conn_memory_limit(sri_t *ws, size_t bytes)
+{
+	if(bytes > 0) { ws->conn_mem_limit = bytes; }
+}
+
+void searest_get_evictions(sri_t *ws, sr_evictions_t *e)
+{
+	e->idle = atomic_load(&ws->evict_idle);
+	e->header = atomic_load(&ws->evict_header);
+	e->body = atomic_load(&ws->evict_body);
+	e->ipcap = atomic_load(&ws->evict_ipcap);
+}
+
+// Adapt the number of requests allowed inside node callbacks between min and max
+// Requests over the limit get a 503 with Retry-After
+void searest_set_adaptive_limit(sri_t *ws, unsigned int min, unsigned int max)
+{
+	if(ws->limiter) { return; }
+	ws->limiter = searest_limit_new(min, max);
+}
+
+// Maximum number of announced upload bytes being received at once, 0 disables
+// Needs searest_set_adaptive_limit() first
+void searest_set_upload_budget(sri_t *ws, size_t bytes)
+{
+	if(ws->limiter) { searest_limit_set_upload_budget(ws->limiter, bytes); }
+}
+
+void searest_set_retry_after(sri_t *ws, int seconds)
+{
+	if(seconds > 0) { ws->retry_after = seconds; }
+}
+
+// returns -1 if load shedding is not enabled
+int searest_get_limits(sri_t *ws, sr_limits_t *s)
+{
+	if(!ws->limiter) { return -1; }
+	searest_limit_get(ws->limiter, s);
+	return 0;
+}
+
+// Split requests into a latency lane and a bulk lane (POST/PUT bodies of bulk_size bytes or more)
+// Each lane allows budget requests inside node callbacks at once (0 is unlimited),
+// the rest wait up to max_wait_ms and then get a 503
+// Only useful with a thread per connection
+void searest_set_lanes(sri_t *ws, size_t bulk_size, unsigned int fast_budget, unsigned int bulk_budget, long max_wait_ms)
+{
+	if(ws->lanes) { return; }
+	ws->lanes = searest_lanes_new(bulk_size, fast_budget, bulk_budget, max_wait_ms);
+}
+
+// returns -1 if lanes are not enabled
+int searest_get_lane(sri_t *ws, int lane, sr_lane_t *s)
+{
+	if(!ws->lanes) { return -1; }
+	if((lane < 0) || (lane >= SR_LANES)) { return -1; }
+	searest_lanes_get(ws->lanes, lane, s);
+	return 0;
+}
+
 void searest_set_internal_select(sri_t *ws)
 {
 	ws->socket_model = MHD_USE_SELECT_INTERNALLY;
 }
 
+// Let several processes bind the same ip:port (SO_REUSEPORT)
+// The kernel then spreads incoming connections across all of them
+void searest_set_reuseport(sri_t *ws)
+{
+	ws->reuse_port = 1;
+}
+
+void searest_set_listen_backlog(sri_t *ws, int backlog)
+{
+	if(backlog > 0) { ws->listen_backlog = backlog; }
+}
+
+// Don't wake up the accept()ing thread until the client has sent data
+void searest_set_defer_accept(sri_t *ws, int seconds)
+{
+	ws->defer_accept = seconds;
+}
+
+// Allow clients to send their request in the SYN (qlen pending TFO requests)
+void searest_set_fastopen(sri_t *ws, int qlen)
+{
+	ws->fastopen = qlen;
+}
+
+void searest_set_nodelay(sri_t *ws)
+{
+	ws->nodelay = 1;
+}
+
+// 0 leaves the kernel default in place
+void searest_set_sockbufs(sri_t *ws, int rcvbuf, int sndbuf)
+{
+	ws->rcvbuf = rcvbuf;
+	ws->sndbuf = sndbuf;
+}
+
 void searest_set_addr_cb(sri_t *ws, void *func)
 {
 	ws->addr_cb = func;
 }
 
+// Called once the headers are in, returns 0 to accept or an HTTP status to refuse the request with
+void searest_set_admit_cb(sri_t *ws, void *func)
+{
+	ws->admit_cb = func;
+}
+
+// Called with the park_ctx of a request that parked, returns once it may run again
+// Only for the thread per connection model, the select thread must never block
+void searest_set_park_cb(sri_t *ws, void *func)
+{
+	ws->park_cb = func;
+}
+
+// MHD_stop_daemon() closes the listening socket we gave it
 void searest_stop(sri_t *ws)
 {
 	if(ws->mhd_srv) { MHD_stop_daemon(ws->mhd_srv); }
 	ws->mhd_srv = NULL;
+	ws->listen_fd = -1;
 }
 
 sri_t* searest_new(int urlmin, int urlmax, size_t contentmax)
@@ -552,6 +1005,10 @@ sri_t* searest_new(int urlmin, int urlmax, size_t contentmax)
 
 	ws->socket_model = MHD_USE_THREAD_PER_CONNECTION;
 	ws->conn_limit = FD_SETSIZE-4;  //-1 ??
+	ws->listen_fd = -1;
+	ws->listen_backlog = SOMAXCONN;
+	ws->conn_mem_limit = 32*1024;	// MHD default
+	ws->retry_after = 1;
 	ws->min_url_len = urlmin;
 	ws->max_url_len = urlmax;
 	ws->max_content_length = contentmax;
@@ -566,5 +1023,8 @@ void searest_del(sri_t *ws)
 	if(ws->https_cert) { free(ws->https_cert); }
 	if(ws->https_key) { free(ws->https_key); }
 	if(ws->https_ca) { free(ws->https_ca); }
+	searest_iptrack_del(ws->iptrack);
+	searest_limit_del(ws->limiter);
+	searest_lanes_del(ws->lanes);
 	free(ws);
 }
@@ -20,6 +20,9 @@
 #define __SEAREST_H__
 
 #include <time.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
 #include <microhttpd.h>
 
 #ifdef SRNODECHRONOMETRY
@@ -35,11 +38,15 @@
 #define METHOD_PUT	(3)
 #define METHOD_DEL	(4)
 #define METHOD_OPT	(5)
+#define METHOD_HEAD	(6)
 
 #define HDRASTR "Accept"
 #define HDRCTSTR "Content-Type"
 #define HDRCLSTR "Content-Length"
 #define HDRAUTHSTR "Authorization"
+#define HDRAESTR "Accept-Encoding"
+
+#define SR_MAXHEADERS (8)	// extra response headers per request
 
 #define MIMETYPETXTPLAINSTR "text/plain"
 #define MIMETYPEAPPBINSTR "application/octet-stream"
@@ -51,6 +58,8 @@
 
 #define SR_ADDR_CALLBACK(CB)	int (CB)(char *, void *);
 #define SR_NODE_CALLBACK(CB)	char* (CB)(char *, int, void *, void *, void *);
+#define SR_ADMIT_CALLBACK(CB)	int (CB)(const char *, int, size_t, void *);
+#define SR_PARK_CALLBACK(CB)	void (CB)(void *, long, void *);
 
 typedef struct searest_node {
 	unsigned int num;
@@ -71,9 +80,51 @@ typedef struct searest_node {
 	struct searest_node *prev;
 } srn_t;
 
+typedef struct searest_iptrack sript_t;
+
+// Snapshot of connections/requests that were cut off
+typedef struct {
+	unsigned long idle;		// inactivity timeout reached
+	unsigned long header;	// request headers took too long
+	unsigned long body;		// upload took too long
+	unsigned long ipcap;	// too many open connections from one IP
+} sr_evictions_t;
+
+typedef struct searest_limit srlim_t;
+
+// Snapshot of the load shedding state
+typedef struct {
+	unsigned int limit;			// current adaptive limit on requests in node callbacks
+	unsigned int inflight;
+	long base_us;				// no-load callback latency
+	size_t upload_budget;
+	size_t upload_inflight;
+	unsigned long shed_inflight;
+	unsigned long shed_upload;
+} sr_limits_t;
+
+typedef struct searest_lanes srlanes_t;
+
+#define SR_LANE_FAST	(0)
+#define SR_LANE_BULK	(1)
+#define SR_LANES		(2)
+
+// Snapshot of one request lane
+typedef struct {
+	unsigned int budget;
+	unsigned int active;
+	unsigned int waiting;		// queue depth
+	unsigned long served;
+	unsigned long timedout;
+	unsigned long wait_us_total;
+	long wait_us_max;
+} sr_lane_t;
+
 typedef struct searest_instance {
 	void *sri_user_data;
 	SR_ADDR_CALLBACK(*addr_cb);
+	SR_ADMIT_CALLBACK(*admit_cb);
+	SR_PARK_CALLBACK(*park_cb);
 	struct MHD_Daemon *mhd_srv;
 
 	char *https_cert;
@@ -82,16 +133,59 @@ typedef struct searest_instance {
 	int ssl_flag;
 	int socket_model;
 	int inactivity_timeout;
+
+	// Listening socket, created by searest and handed to MHD
+	int listen_fd;
+	int reuse_port;
+	int listen_backlog;
+	int defer_accept;
+	int fastopen;
+	int nodelay;
+	int rcvbuf;
+	int sndbuf;
+
 	unsigned int conn_limit;
 	int min_url_len;
 	int max_url_len;
 	size_t max_content_length;
 
+	// Connection lifecycle limits
+	int header_timeout;
+	int body_timeout;
+	unsigned int per_ip_limit;
+	size_t conn_mem_limit;
+	sript_t *iptrack;
+	atomic_ulong evict_idle;
+	atomic_ulong evict_header;
+	atomic_ulong evict_body;
+	atomic_ulong evict_ipcap;
+
+	// Load shedding
+	srlim_t *limiter;
+	int retry_after;
+	srlanes_t *lanes;
+
 	srn_t *nodelist_head;
 } sri_t;
 
+// Per-connection context, created once when MHD accepts the connection
+typedef struct searest_conn_ctx {
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	char ip[INET6_ADDRSTRLEN];
+	long ready_ms;			// when the connection started waiting for its next request
+	int tracked;			// counted in the per-IP table
+	int requests;			// started on this connection
+	int active;				// a request is in progress
+	int evicted;			// already counted as an eviction
+} srcc_t;
+
 typedef struct searest_conn_info {
-	char *ip;
+	struct MHD_Connection *connection;
+	char *ip;				//points into the connection context
+	long started_ms;
+	size_t upload_reserved;
+	int lane;
 	int method_type;
 	char *url;
 	int urllen;
@@ -106,8 +200,21 @@ typedef struct searest_conn_info {
 	char *content_type;	//response - to browser
 	char *allow;		//response - to browser
 	int cors;
+	int hdr_count;
+	char *hdr_name[SR_MAXHEADERS];	//response - to browser
+	char *hdr_value[SR_MAXHEADERS];
 	int return_code;
 	char *return_page;
+	size_t return_len;
+	void (*return_release)(void *);	//shared page, released instead of freed
+	void *return_release_ctx;
+	int head_only;			//HEAD: no body, head_len is the Content-Length
+	size_t head_len;
+	ssize_t (*stream_read)(void *, uint64_t, char *, size_t);	//body produced while it is sent
+	void (*stream_free)(void *);
+	void *stream_ctx;
+	long park_until;		//monotonic ms, 0 if the request never parked
+	void *park_ctx;			//handed to the park callback, the node runs again after it returns
 } srci_t;
 
 char* srci_get_client_ip(srci_t *ri);
@@ -116,29 +223,80 @@ int srci_browser_requests_text(srci_t *ri);
 int srci_browser_requests_xml(srci_t *ri);
 int srci_browser_requests_json(srci_t *ri);
 int srci_get_method_type(srci_t *ri);
+const char* srci_get_request_header(srci_t *ri, const char *name);
+const char* srci_get_query_arg(srci_t *ri, const char *name);
+void srci_park(srci_t *ri, long until_ms, void *ctx);
+long srci_get_park_until(srci_t *ri);
+int srci_get_lane(srci_t *ri);
 void srci_set_response_content_type(srci_t *ri, char *ct);
 void srci_set_response_allow(srci_t *ri, char *a);
 void srci_set_response_cors(srci_t *ri);
+int srci_add_response_header(srci_t *ri, const char *name, const char *value);
 
 const unsigned char* srci_get_post_data_ptr(srci_t *ri);
 size_t srci_get_post_data_size(srci_t *ri);
 void srci_set_return_code(srci_t *ri, int code);
+void srci_set_return_shared(srci_t *ri, size_t len, void (*release)(void *), void *ctx);
+void srci_set_return_head(srci_t *ri, size_t len);
+void srci_set_return_stream(srci_t *ri, ssize_t (*reader)(void *, uint64_t, char *, size_t), void (*release)(void *), void *ctx);
 
 void searest_set_https_cert(sri_t *ws, const char *cert);
 void searest_set_https_key(sri_t *ws, const char *key);
 void searest_set_https_ca(sri_t *ws, const char *ca);
 void searest_set_inactivity_timeout(sri_t *ws, int timeout);
+void searest_set_request_timeouts(sri_t *ws, int header, int body);
+void searest_set_per_ip_limit(sri_t *ws, unsigned int limit);
+void searest_set_conn_memory_limit(sri_t *ws, size_t bytes);
+void searest_set_conn_limit(sri_t *ws, unsigned int limit);
+void searest_get_evictions(sri_t *ws, sr_evictions_t *e);
+void searest_set_adaptive_limit(sri_t *ws, unsigned int min, unsigned int max);
+void searest_set_upload_budget(sri_t *ws, size_t bytes);
+void searest_set_retry_after(sri_t *ws, int seconds);
+int searest_get_limits(sri_t *ws, sr_limits_t *s);
+void searest_set_lanes(sri_t *ws, size_t bulk_size, unsigned int fast_budget, unsigned int bulk_budget, long max_wait_ms);
+int searest_get_lane(sri_t *ws, int lane, sr_lane_t *s);
 void searest_set_internal_select(sri_t *ws);
+void searest_set_reuseport(sri_t *ws);
+void searest_set_listen_backlog(sri_t *ws, int backlog);
+void searest_set_defer_accept(sri_t *ws, int seconds);
+void searest_set_fastopen(sri_t *ws, int qlen);
+void searest_set_nodelay(sri_t *ws);
+void searest_set_sockbufs(sri_t *ws, int rcvbuf, int sndbuf);
 void searest_set_addr_cb(sri_t *ws, void *func);
+void searest_set_admit_cb(sri_t *ws, void *func);
+void searest_set_park_cb(sri_t *ws, void *func);
 void searest_stop(sri_t *ws);
-int searest_start(sri_t *ws, char *ip4addr, unsigned short port, void *sri_user_data);
+int searest_start(sri_t *ws, char *ipaddr, unsigned short port, void *sri_user_data);
 sri_t* searest_new(int urlmin, int urlmax, size_t contentmax);
 void searest_del(sri_t *ws);
+long searest_mono_us(void);
 
 #ifdef SRNODECHRONOMETRY
 long searest_node_get_avg_duration(sri_t *ws, char *rootname);
 #endif
 
+sript_t* searest_iptrack_new(void);
+void searest_iptrack_del(sript_t *t);
+unsigned int searest_iptrack_count(sript_t *t, const char *ip);
+void searest_iptrack_inc(sript_t *t, const char *ip);
+void searest_iptrack_dec(sript_t *t, const char *ip);
+
+srlim_t* searest_limit_new(unsigned int min, unsigned int max);
+void searest_limit_del(srlim_t *l);
+void searest_limit_set_upload_budget(srlim_t *l, size_t bytes);
+int searest_limit_admit(srlim_t *l, size_t len);
+void searest_limit_release_upload(srlim_t *l, size_t len);
+int searest_limit_enter(srlim_t *l);
+void searest_limit_leave(srlim_t *l, long latency_us);
+void searest_limit_get(srlim_t *l, sr_limits_t *s);
+
+srlanes_t* searest_lanes_new(size_t bulk_size, unsigned int fast_budget, unsigned int bulk_budget, long max_wait_ms);
+void searest_lanes_del(srlanes_t *ls);
+int searest_lanes_classify(srlanes_t *ls, int method_type, size_t content_length);
+int searest_lanes_enter(srlanes_t *ls, int lane);
+void searest_lanes_leave(srlanes_t *ls, int lane);
+void searest_lanes_get(srlanes_t *ls, int lane, sr_lane_t *s);
+
 int searest_node_set_disabled(sri_t *ws, char *rootname);
 int searest_node_set_enabled(sri_t *ws, char *rootname);
 int searest_node_add(sri_t *ws, char *rootname, void *func, void *node_user_data);
@@ -0,0 +1,117 @@
+/*
+	SeaRest is a RESTFul service framework leveraging libmicrohttpd
+	Copyright (C) 2021 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Count open connections per client IP so that a handful of clients cannot hold every thread/fd
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "searest.h"
+
+#define IPT_BUCKETS (1024)
+
+typedef struct iptrack_entry {
+	char ip[INET6_ADDRSTRLEN];
+	unsigned int count;
+	struct iptrack_entry *next;
+} ipte_t;
+
+struct searest_iptrack {
+	pthread_mutex_t lock;
+	ipte_t *buckets[IPT_BUCKETS];
+};
+
+static unsigned int ipt_hash(const char *ip)
+{
+	unsigned int h = 5381;
+	while(*ip) { h = (h * 33) ^ (unsigned char)*ip++; }
+	return h % IPT_BUCKETS;
+}
+
+sript_t* searest_iptrack_new(void)
+{
+	sript_t *t = calloc(1, sizeof(sript_t));
+	if(!t) { return NULL; }
+	pthread_mutex_init(&t->lock, NULL);
+	return t;
+}
+
+void searest_iptrack_del(sript_t *t)
+{
+	ipte_t *e, *next;
+	int i;
+
+	if(!t) { return; }
+	for(i=0; i<IPT_BUCKETS; i++) {
+		for(e=t->buckets[i]; e; e=next) { next = e->next; free(e); }
+	}
+	pthread_mutex_destroy(&t->lock);
+	free(t);
+}
+
+// return the number of connections currently open from ip
+unsigned int searest_iptrack_count(sript_t *t, const char *ip)
+{
+	ipte_t *e;
+	unsigned int count = 0;
+
+	pthread_mutex_lock(&t->lock);
+	for(e=t->buckets[ipt_hash(ip)]; e; e=e->next) {
+		if(strcmp(e->ip, ip) == 0) { count = e->count; break; }
+	}
+	pthread_mutex_unlock(&t->lock);
+
+	return count;
+}
+
+void searest_iptrack_inc(sript_t *t, const char *ip)
+{
+	ipte_t *e;
+	unsigned int h = ipt_hash(ip);
+
+	pthread_mutex_lock(&t->lock);
+	for(e=t->buckets[h]; e; e=e->next) {
+		if(strcmp(e->ip, ip) == 0) { break; }
+	}
+	if(!e) {
+		e = calloc(1, sizeof(ipte_t));
+		if(e) {
+			strncpy(e->ip, ip, sizeof(e->ip)-1);
+			e->next = t->buckets[h];
+			t->buckets[h] = e;
+		}
+	}
+	if(e) { e->count++; }
+	pthread_mutex_unlock(&t->lock);
+}
+
+void searest_iptrack_dec(sript_t *t, const char *ip)
+{
+	ipte_t *e, **pp;
+
+	pthread_mutex_lock(&t->lock);
+	for(pp=&t->buckets[ipt_hash(ip)]; (e = *pp); pp=&e->next) {
+		if(strcmp(e->ip, ip) == 0) {
+			if(e->count > 0) { e->count--; }
+			if(e->count == 0) { *pp = e->next; free(e); }
+			break;
+		}
+	}
+	pthread_mutex_unlock(&t->lock);
+}
@@ -0,0 +1,156 @@
+/*
+	SeaRest is a RESTFul service framework leveraging libmicrohttpd
+	Copyright (C) 2021 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Requests are sorted into a latency lane (small bodies) and a bulk lane (large bodies)
+// when their headers arrive. Each lane has its own budget of requests allowed inside
+// node callbacks, so a burst of big uploads can only queue behind each other.
+// Waiting needs a thread per connection, with internal select every request is serialized anyway.
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "searest.h"
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int budget;	// 0 is unlimited
+	unsigned int active;
+	unsigned int waiting;
+	unsigned long served;
+	unsigned long timedout;
+	unsigned long wait_us_total;
+	long wait_us_max;
+} lane_t;
+
+struct searest_lanes {
+	size_t bulk_size;
+	long max_wait_ms;
+	lane_t lane[SR_LANES];
+};
+
+srlanes_t* searest_lanes_new(size_t bulk_size, unsigned int fast_budget, unsigned int bulk_budget, long max_wait_ms)
+{
+	srlanes_t *ls;
+	pthread_condattr_t ca;
+	int i;
+
+	ls = calloc(1, sizeof(srlanes_t));
+	if(!ls) { return NULL; }
+	ls->bulk_size = bulk_size;
+	ls->max_wait_ms = max_wait_ms;
+	ls->lane[SR_LANE_FAST].budget = fast_budget;
+	ls->lane[SR_LANE_BULK].budget = bulk_budget;
+
+	pthread_condattr_init(&ca);
+	pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+	for(i=0; i<SR_LANES; i++) {
+		pthread_mutex_init(&ls->lane[i].lock, NULL);
+		pthread_cond_init(&ls->lane[i].cond, &ca);
+	}
+	pthread_condattr_destroy(&ca);
+
+	return ls;
+}
+
+void searest_lanes_del(srlanes_t *ls)
+{
+	int i;
+
+	if(!ls) { return; }
+	for(i=0; i<SR_LANES; i++) {
+		pthread_mutex_destroy(&ls->lane[i].lock);
+		pthread_cond_destroy(&ls->lane[i].cond);
+	}
+	free(ls);
+}
+
+// Anything that carries a body over the threshold goes to the bulk lane
+int searest_lanes_classify(srlanes_t *ls, int method_type, size_t content_length)
+{
+	if((method_type == METHOD_POST) || (method_type == METHOD_PUT)) {
+		if(content_length >= ls->bulk_size) { return SR_LANE_BULK; }
+	}
+	return SR_LANE_FAST;
+}
+
+// Wait for room in the lane, returns -1 if none was found within max_wait_ms
+int searest_lanes_enter(srlanes_t *ls, int lane)
+{
+	lane_t *l = &ls->lane[lane];
+	struct timespec deadline;
+	long start, waited;
+	int z = 0;
+
+	pthread_mutex_lock(&l->lock);
+	if(l->budget && (l->active >= l->budget)) {
+		start = searest_mono_us();
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += ls->max_wait_ms / 1000;
+		deadline.tv_nsec += (ls->max_wait_ms % 1000) * 1000000;
+		if(deadline.tv_nsec >= 1000000000) { deadline.tv_sec++; deadline.tv_nsec -= 1000000000; }
+
+		l->waiting++;
+		while((l->active >= l->budget) && (z != ETIMEDOUT)) {
+			z = pthread_cond_timedwait(&l->cond, &l->lock, &deadline);
+		}
+		l->waiting--;
+
+		waited = searest_mono_us() - start;
+		l->wait_us_total += waited;
+		if(waited > l->wait_us_max) { l->wait_us_max = waited; }
+		if(l->active >= l->budget) {
+			l->timedout++;
+			pthread_mutex_unlock(&l->lock);
+			return -1;
+		}
+	}
+	l->active++;
+	l->served++;
+	pthread_mutex_unlock(&l->lock);
+
+	return 0;
+}
+
+void searest_lanes_leave(srlanes_t *ls, int lane)
+{
+	lane_t *l = &ls->lane[lane];
+
+	pthread_mutex_lock(&l->lock);
+	l->active--;
+	if(l->waiting) { pthread_cond_signal(&l->cond); }
+	pthread_mutex_unlock(&l->lock);
+}
+
+void searest_lanes_get(srlanes_t *ls, int lane, sr_lane_t *s)
+{
+	lane_t *l = &ls->lane[lane];
+
+	pthread_mutex_lock(&l->lock);
+	s->budget = l->budget;
+	s->active = l->active;
+	s->waiting = l->waiting;
+	s->served = l->served;
+	s->timedout = l->timedout;
+	s->wait_us_total = l->wait_us_total;
+	s->wait_us_max = l->wait_us_max;
+	pthread_mutex_unlock(&l->lock);
+}
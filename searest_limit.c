@@ -0,0 +1,171 @@
+/*
+	SeaRest is a RESTFul service framework leveraging libmicrohttpd
+	Copyright (C) 2021 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Adaptive limit on requests inside node callbacks (AIMD on callback latency)
+// and a fixed budget on upload bytes that are being received at the same time.
+// The limit grows by one per "window" of healthy requests and backs off by 10%
+// when latency climbs well above the no-load baseline.
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "searest.h"
+
+#define SRLIM_SLACK_US		(2000)	// latency below baseline*2 + slack is considered healthy
+#define SRLIM_BACKOFF_MS	(100)	// at most one decrease per period
+#define SRLIM_BACKOFF		(0.9)
+#define SRLIM_BASE_WINDOW_MS	(10000)	// the baseline is the fastest request seen in this window
+
+struct searest_limit {
+	pthread_mutex_t lock;
+	unsigned int min;
+	unsigned int max;
+	double limit;
+	unsigned int inflight;
+	long base_us;
+	long win_min_us;
+	long win_start_ms;
+	long last_backoff_ms;
+
+	size_t upload_budget;
+	size_t upload_inflight;
+
+	unsigned long shed_inflight;
+	unsigned long shed_upload;
+};
+
+srlim_t* searest_limit_new(unsigned int min, unsigned int max)
+{
+	srlim_t *l;
+
+	if(min < 1) { min = 1; }
+	if(max < min) { max = min; }
+
+	l = calloc(1, sizeof(srlim_t));
+	if(!l) { return NULL; }
+	pthread_mutex_init(&l->lock, NULL);
+	l->min = min;
+	l->max = max;
+	l->limit = max;
+	return l;
+}
+
+void searest_limit_del(srlim_t *l)
+{
+	if(!l) { return; }
+	pthread_mutex_destroy(&l->lock);
+	free(l);
+}
+
+void searest_limit_set_upload_budget(srlim_t *l, size_t bytes)
+{
+	pthread_mutex_lock(&l->lock);
+	l->upload_budget = bytes;
+	pthread_mutex_unlock(&l->lock);
+}
+
+// Called once the headers are in: refuse if we are already at the limit
+// or if the announced body would blow the upload budget
+// returns 0 and reserves len bytes on success
+int searest_limit_admit(srlim_t *l, size_t len)
+{
+	int z = 0;
+
+	pthread_mutex_lock(&l->lock);
+	if(l->inflight >= (unsigned int)l->limit) {
+		l->shed_inflight++;
+		z = -1;
+	} else if(l->upload_budget && len && (l->upload_inflight + len > l->upload_budget)) {
+		l->shed_upload++;
+		z = -1;
+	} else {
+		l->upload_inflight += len;
+	}
+	pthread_mutex_unlock(&l->lock);
+
+	return z;
+}
+
+void searest_limit_release_upload(srlim_t *l, size_t len)
+{
+	pthread_mutex_lock(&l->lock);
+	l->upload_inflight -= len;
+	pthread_mutex_unlock(&l->lock);
+}
+
+// Take a slot before running a node callback, returns -1 if the request should be shed
+int searest_limit_enter(srlim_t *l)
+{
+	int z = 0;
+
+	pthread_mutex_lock(&l->lock);
+	if(l->inflight >= (unsigned int)l->limit) {
+		l->shed_inflight++;
+		z = -1;
+	} else {
+		l->inflight++;
+	}
+	pthread_mutex_unlock(&l->lock);
+
+	return z;
+}
+
+// Give the slot back and feed the measured latency into the limit
+void searest_limit_leave(srlim_t *l, long latency_us)
+{
+	long now = searest_mono_us() / 1000;
+
+	pthread_mutex_lock(&l->lock);
+	l->inflight--;
+
+	// The baseline follows improvements at once and degradations one window later
+	if((l->base_us == 0) || (latency_us < l->base_us)) { l->base_us = latency_us; }
+	if((l->win_min_us == 0) || (latency_us < l->win_min_us)) { l->win_min_us = latency_us; }
+	if(now - l->win_start_ms >= SRLIM_BASE_WINDOW_MS) {
+		l->base_us = l->win_min_us;
+		l->win_min_us = 0;
+		l->win_start_ms = now;
+	}
+
+	if(latency_us > (l->base_us * 2) + SRLIM_SLACK_US) {
+		if(now - l->last_backoff_ms >= SRLIM_BACKOFF_MS) {
+			l->limit *= SRLIM_BACKOFF;
+			if(l->limit < l->min) { l->limit = l->min; }
+			l->last_backoff_ms = now;
+		}
+	} else if(l->inflight + 1 >= (unsigned int)(l->limit / 2)) {
+		// Only grow while the limit is actually being used
+		l->limit += 1.0 / l->limit;
+		if(l->limit > l->max) { l->limit = l->max; }
+	}
+	pthread_mutex_unlock(&l->lock);
+}
+
+void searest_limit_get(srlim_t *l, sr_limits_t *s)
+{
+	pthread_mutex_lock(&l->lock);
+	s->limit = (unsigned int)l->limit;
+	s->inflight = l->inflight;
+	s->base_us = l->base_us;
+	s->upload_budget = l->upload_budget;
+	s->upload_inflight = l->upload_inflight;
+	s->shed_inflight = l->shed_inflight;
+	s->shed_upload = l->shed_upload;
+	pthread_mutex_unlock(&l->lock);
+}
@@ -55,3 +55,87 @@ for FILE in *.[ch] *.sh *.exe *.dbg; do
   ./ws_get.dbg -H ${HOST} -P ${PORT} -t "${TOKEN}" -f testwsget/${FILE}
   curl -X GET "http://${HOST}:${PORT}/store/512/${TOKEN}" -o testcurl/${FILE}.z85 2>/dev/null
 done
+
+# /store/mget/: fetch everything posted in one request and compare it with the files
+rm -rf testmget
+mkdir testmget
+for FILE in *.[ch] *.sh; do
+  TOKEN=`./ws_post.dbg -H ${HOST} -P ${PORT} -a 4 -f "${FILE}" | grep 'Token: ' | awk '{print $2}'`
+  echo "${TOKEN}" >> testmget/tokens.txt
+  echo "${FILE} ${TOKEN}" >> testmget/files.txt
+done
+./ws_get.dbg -H ${HOST} -P ${PORT} -b testmget/tokens.txt -d testmget
+while read FILE TOKEN; do
+  cmp "${FILE}" "testmget/${TOKEN}"
+done < testmget/files.txt
+
+# /store/mset/: post every file in one request, read each one back and compare
+rm -rf testmset
+mkdir testmset
+ls *.[ch] *.sh > testmset/files.txt
+./ws_post.dbg -H ${HOST} -P ${PORT} -a 4 -b testmset/files.txt > testmset/out.txt
+grep 'Token: ' testmset/out.txt | awk '{print $2}' > testmset/tokens.txt
+[ `wc -l < testmset/files.txt` -eq `wc -l < testmset/tokens.txt` ]
+paste -d ' ' testmset/files.txt testmset/tokens.txt | while read FILE TOKEN; do
+  ./ws_get.dbg -H ${HOST} -P ${PORT} -t "${TOKEN}" -f "testmset/${FILE}"
+  cmp "${FILE}" "testmset/${FILE}"
+done
+
+# Ranges: slices around the Z85 frame boundaries must match the same bytes of the file
+rm -rf testrange
+mkdir testrange
+for FILE in *.c; do
+  TOKEN=`./ws_post.dbg -H ${HOST} -P ${PORT} -a 4 -f "${FILE}" | grep 'Token: ' | awk '{print $2}'`
+  SIZE=`stat -c %s "${FILE}"`
+  for OFFSET in 0 1 3 4 5 7 $((SIZE / 2)) $((SIZE - 1)); do
+    ./ws_get.dbg -H ${HOST} -P ${PORT} -t "${TOKEN}" -o ${OFFSET} -l 100 -f testrange/slice
+    tail -c +$((OFFSET + 1)) "${FILE}" | head -c 100 > testrange/expected
+    cmp testrange/expected testrange/slice
+  done
+  ./ws_get.dbg -H ${HOST} -P ${PORT} -t "${TOKEN}" -o $((SIZE / 3)) -f testrange/slice
+  tail -c +$((SIZE / 3 + 1)) "${FILE}" > testrange/expected
+  cmp testrange/expected testrange/slice
+done
+
+# Blocking GET: -w waits for a token that is only posted afterwards
+# Needs a server started with MULTITHREAD=1 and WAITMAX, run with WAITMAX=<seconds> to include it
+if [ "${WAITMAX:-0}" -gt 0 ]; then
+  rm -rf testwait
+  mkdir testwait
+  for FILE in *.h; do
+    TOKEN=`head -c 64 /dev/urandom | sha256sum | awk '{print $1}'`
+    ./ws_get.dbg -H ${HOST} -P ${PORT} -t "${TOKEN}" -w ${WAITMAX} -f "testwait/${FILE}" &
+    GETPID=$!
+    sleep 1
+    ./ws_post.dbg -H ${HOST} -P ${PORT} -t "${TOKEN}" -f "${FILE}" > /dev/null
+    wait ${GETPID}
+    cmp "${FILE}" "testwait/${FILE}"
+  done
+fi
+
+# DELETE and /store/mdel/: every message is gone afterwards, a second delete finds nothing
+rm -rf testdel
+mkdir testdel
+for FILE in *.h; do
+  TOKEN=`./ws_post.dbg -H ${HOST} -P ${PORT} -a 4 -f "${FILE}" | grep 'Token: ' | awk '{print $2}'`
+  CODE=`curl -s -o /dev/null -w '%{http_code}' -X DELETE "http://${HOST}:${PORT}/store/256/${TOKEN}"`
+  [ "${CODE}" = "200" ]
+  CODE=`curl -s -o /dev/null -w '%{http_code}' "http://${HOST}:${PORT}/store/256/${TOKEN}"`
+  [ "${CODE}" = "404" ]
+  CODE=`curl -s -o /dev/null -w '%{http_code}' -X DELETE "http://${HOST}:${PORT}/store/256/${TOKEN}"`
+  [ "${CODE}" = "404" ]
+done
+
+for FILE in *.[ch] *.sh; do
+  ./ws_post.dbg -H ${HOST} -P ${PORT} -a 4 -f "${FILE}" | grep 'Token: ' | awk '{print $2}' >> testdel/tokens.txt
+done
+sort -u testdel/tokens.txt > testdel/unique.txt
+curl -s --data-binary @testdel/unique.txt "http://${HOST}:${PORT}/store/mdel/" > testdel/mdel.txt
+[ `wc -l < testdel/unique.txt` -eq `wc -l < testdel/mdel.txt` ]
+awk '$2 != 200 { exit 1 }' testdel/mdel.txt
+while read TOKEN; do
+  CODE=`curl -s -o /dev/null -w '%{http_code}' "http://${HOST}:${PORT}/store/256/${TOKEN}"`
+  [ "${CODE}" = "404" ]
+done < testdel/unique.txt
+curl -s --data-binary @testdel/unique.txt "http://${HOST}:${PORT}/store/mdel/" > testdel/mdel.txt
+awk '$2 != 404 { exit 1 }' testdel/mdel.txt
@@ -16,19 +16,27 @@
 	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 
+#define _GNU_SOURCE	// sched_setaffinity()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
 
 #include "getopts.h"
 #include "webstore_ops.h"
 #include "webstore_log.h"
+#include "webstore_sched.h"
 
 static void parse_args(int argc, char **argv);
 
-int g_redis_error = 0;
 int g_shutdown = 0;
 
 char *g_rsock = NULL;
@@ -37,10 +45,11 @@ unsigned short g_rport = 0;
 
 srv_opts_t g_so;
 char *g_logfile = NULL;
+long g_logage = 0;
+int g_workers = 0;
 
 int shutting_down(void) { return g_shutdown; }
 
-#include <errno.h>
 void handle_redis_error(rai_t *rc)
 {
 	char *etype = NULL;
@@ -68,8 +77,10 @@ void handle_redis_error(rai_t *rc)
 		fprintf(stderr, "%s: %s\n", etype, rc->c->errstr);
 		log_add(WSLOG_ERR, "%s: %s", etype, rc->c->errstr);
 	}
-	g_redis_error = 1;
-	g_shutdown = 1;
+
+	// Requests fail fast with 503 until the scheduler reconnects
+	rai_failed(rc);
+	redis_retry(rc);
 }
 
 #ifdef SRNODECHRONOMETRY
@@ -77,27 +88,32 @@ int g_alarm_stats = 0;
 void print_avg_nodecb_time(void);
 #endif
 
-int g_log_sync_timer = 0;
-static void alarm_handler(int signum)
+// Periodic jobs, these run on the scheduler thread
+static void log_job(void *arg)
 {
-	g_log_sync_timer++;
-	if(g_log_sync_timer >= 4) { log_flush(); g_log_sync_timer = 0; }
+	log_flush();	// wakes the writer so it can check the age of the segment
+}
 
 #ifdef SRNODECHRONOMETRY
+static void stats_job(void *arg)
+{
 	print_avg_nodecb_time();
-#endif
-
-	(void) alarm(1);
 }
+#endif
 
-static void sig_handler(int signum)
+// Everything else is read synchronously from a signalfd in main()
+static void handle_signal(int signum)
 {
 	switch(signum) {
-		case SIGPIPE:
-			fprintf(stderr, "SIGPIPE\n");
-			log_add(WSLOG_ERR, "SIGPIPE");
-			break;
 		case SIGHUP:
+			log_reopen();
+			break;
+		case SIGUSR1:
+			log_more_verbose();
+			break;
+		case SIGUSR2:
+			log_less_verbose();
+			break;
 		case SIGINT:
 		case SIGTERM:
 		case SIGQUIT:
@@ -106,13 +122,49 @@ static void sig_handler(int signum)
 	}
 }
 
-int main(int argc, char *argv[])
+// Sleep until a signal arrives
+static void wait_for_shutdown(int sfd)
 {
-	int z;
+	struct pollfd pfd;
+	struct signalfd_siginfo si;
 
-	memset(&g_so, 0, sizeof(srv_opts_t));
-	g_so.max_post_data_size = (20*1024*1024);
-	parse_args(argc, argv);
+	pfd.fd = sfd;
+	pfd.events = POLLIN;
+
+	while(!g_shutdown) {
+		if(poll(&pfd, 1, -1) < 0) { continue; }
+		if(pfd.revents & POLLIN) {
+			if(read(sfd, &si, sizeof(si)) == sizeof(si)) { handle_signal(si.ssi_signo); }
+		}
+	}
+}
+
+// Block these before any thread is created so that only the signalfd sees them
+static void block_signals(sigset_t *mask)
+{
+	sigemptyset(mask);
+	sigaddset(mask, SIGINT);
+	sigaddset(mask, SIGTERM);
+	sigaddset(mask, SIGQUIT);
+	sigaddset(mask, SIGHUP);
+	sigaddset(mask, SIGUSR1);
+	sigaddset(mask, SIGUSR2);
+	sigprocmask(SIG_BLOCK, mask, NULL);
+}
+
+static int run_server(void)
+{
+	int z, sfd;
+	sigset_t mask;
+
+	block_signals(&mask);
+	sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+	if(sfd < 0) {
+		fprintf(stderr, "signalfd() failed!\n");
+		exit(EXIT_FAILURE);
+	}
+	// A write to a dead socket fails with EPIPE where it happens, nothing to do asynchronously
+	signal(SIGPIPE,	SIG_IGN);
 
 	if(g_logfile) {
 		z = log_open(g_logfile);
@@ -134,25 +186,216 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
-	signal(SIGINT,	sig_handler);
-	signal(SIGTERM, sig_handler);
-	signal(SIGQUIT,	sig_handler);
-	signal(SIGHUP,	sig_handler);
-	signal(SIGPIPE,	sig_handler);
-	signal(SIGALRM, alarm_handler);
-	(void) alarm(1);
-
-	z=0;	// Wait for the sweet release of death
-	while(!g_shutdown && !g_redis_error) {
-		if(z>999) { z=0; }
-		usleep(1000);
-		z++;
+	// Periodic jobs
+	if(g_logfile && (g_logage > 0)) { wsched_add("log", 1000, log_job, NULL); }
+#ifdef SRNODECHRONOMETRY
+	if(g_alarm_stats) { wsched_add("stats", 1000, stats_job, NULL); }
+#endif
+	if(wsched_start()) {
+		fprintf(stderr, "wsched_start() failed!\n");
+		exit(EXIT_FAILURE);
 	}
-	usleep(1000);
+
+	// Wait for the sweet release of death
+	wait_for_shutdown(sfd);
 
 	// Stop Services
+	wsched_stop();
 	webstore_stop();
 	log_close();
+	close(sfd);
+
+	return EXIT_SUCCESS;
+}
+
+// Pin the calling process to the n-th CPU it is allowed to run on
+static void pin_worker(int n)
+{
+	cpu_set_t allowed, mine;
+	int cpu, count, seen = 0;
+
+	if(sched_getaffinity(0, sizeof(allowed), &allowed)) { return; }
+	count = CPU_COUNT(&allowed);
+	if(count < 1) { return; }
+
+	n %= count;
+	for(cpu=0; cpu<CPU_SETSIZE; cpu++) {
+		if(!CPU_ISSET(cpu, &allowed)) { continue; }
+		if(seen++ == n) {
+			CPU_ZERO(&mine);
+			CPU_SET(cpu, &mine);
+			if(sched_setaffinity(0, sizeof(mine), &mine)) {
+				fprintf(stderr, "worker %d: sched_setaffinity(%d) failed: %s\n", n, cpu, strerror(errno));
+			}
+			return;
+		}
+	}
+}
+
+// Each worker is a complete server with its own Redis connection and its own log file
+static int run_worker(int n)
+{
+	char *logfile;
+	size_t len;
+
+	pin_worker(n);
+
+	if(g_logfile) {
+		len = strlen(g_logfile) + 16;
+		logfile = malloc(len);
+		snprintf(logfile, len, "%s.%d", g_logfile, n);
+		free(g_logfile);
+		g_logfile = logfile;
+	}
+
+	return run_server();
+}
+
+// A supervised worker process, pid is 0 while it waits to be (re)started
+typedef struct {
+	pid_t pid;
+	time_t started;
+	time_t retry;
+	int backoff;
+} wsworker_t;
+
+#define WORKER_BACKOFF_MAX 32
+
+static pid_t spawn_worker(int n, int sfd)
+{
+	pid_t pid;
+
+	pid = fork();
+	if(pid < 0) {
+		fprintf(stderr, "fork() failed: %s\n", strerror(errno));
+		return 0;
+	}
+
+	if(pid == 0) {
+		close(sfd);
+		exit(run_worker(n));
+	}
+
+	return pid;
+}
+
+// Try again later, doubling the delay each time up to WORKER_BACKOFF_MAX seconds
+static void worker_backoff(wsworker_t *w)
+{
+	w->backoff = w->backoff ? w->backoff*2 : 1;
+	if(w->backoff > WORKER_BACKOFF_MAX) { w->backoff = WORKER_BACKOFF_MAX; }
+	w->retry = time(NULL) + w->backoff;
+}
+
+static void start_worker(wsworker_t *w, int n, int sfd)
+{
+	w->pid = spawn_worker(n, sfd);
+	w->started = time(NULL);
+	if(w->pid == 0) { worker_backoff(w); }
+}
+
+// Start the workers that are due, returns the poll() timeout until the next one (-1 for none)
+static int start_due_workers(wsworker_t *workers, int sfd)
+{
+	int i, timeout = -1;
+	time_t now = time(NULL);
+
+	for(i=0; i<g_workers; i++) {
+		if(workers[i].pid > 0) { continue; }
+		if(workers[i].retry <= now) { start_worker(&workers[i], i, sfd); }
+		if(workers[i].pid > 0) { continue; }
+		if((timeout < 0) || ((workers[i].retry - now)*1000 < timeout)) { timeout = (workers[i].retry - now)*1000; }
+	}
+
+	return timeout;
+}
+
+// Fork g_workers servers that all bind the same port with SO_REUSEPORT
+// Restart any worker that dies and pass control signals on to all of them
+static int supervise(void)
+{
+	struct signalfd_siginfo si;
+	struct pollfd pfd;
+	sigset_t mask;
+	wsworker_t *workers;
+	pid_t pid;
+	int i, sfd, status, live, timeout;
+
+	block_signals(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+	if(sfd < 0) {
+		fprintf(stderr, "signalfd() failed!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	workers = calloc(g_workers, sizeof(wsworker_t));
+
+	pfd.fd = sfd;
+	pfd.events = POLLIN;
+	live = g_workers;
+	while(!g_shutdown || (live > 0)) {
+		// A worker whose fork() failed or that died at startup is started again once its delay is over
+		timeout = g_shutdown ? -1 : start_due_workers(workers, sfd);
+		if(poll(&pfd, 1, timeout) <= 0) { continue; }
+		if(read(sfd, &si, sizeof(si)) != sizeof(si)) { continue; }
+
+		switch(si.ssi_signo) {
+			case SIGCHLD:
+				while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+					for(i=0; i<g_workers; i++) { if(workers[i].pid == pid) { break; } }
+					if(i == g_workers) { continue; }
+					workers[i].pid = 0;
+					if(g_shutdown) { continue; }
+
+					fprintf(stderr, "worker %d (pid %d) exited with status %d, restarting\n", i, pid, status);
+					// don't spin on a worker that dies at startup
+					if(time(NULL) - workers[i].started < 1) { worker_backoff(&workers[i]); }
+					else { workers[i].backoff = 0; workers[i].retry = 0; }
+				}
+				break;
+			case SIGHUP:
+			case SIGUSR1:
+			case SIGUSR2:
+				for(i=0; i<g_workers; i++) { if(workers[i].pid > 0) { kill(workers[i].pid, si.ssi_signo); } }
+				break;
+			case SIGINT:
+			case SIGTERM:
+			case SIGQUIT:
+				g_shutdown = 1;
+				for(i=0; i<g_workers; i++) { if(workers[i].pid > 0) { kill(workers[i].pid, SIGTERM); } }
+				break;
+		}
+
+		for(i=0, live=0; i<g_workers; i++) { if(workers[i].pid > 0) { live++; } }
+	}
+
+	close(sfd);
+	free(workers);
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+	int z;
+
+	memset(&g_so, 0, sizeof(srv_opts_t));
+	g_so.max_post_data_size = (20*1024*1024);
+	g_so.idle_timeout = 30;
+	g_so.header_timeout = 30;
+	g_so.bulk_workers = 4;
+	g_so.lane_wait = 5000;
+	g_so.rconnect_timeout = 1000;
+	g_so.rcmd_timeout = 2000;
+	parse_args(argc, argv);
+
+	if(g_workers > 1) {
+		g_so.reuse_port = 1;
+		z = supervise();
+	} else {
+		z = run_server();
+	}
 
 	// Unnecessary Clean Up
 	if(g_logfile) { free(g_logfile); }
@@ -161,7 +404,7 @@ int main(int argc, char *argv[])
 	if(g_so.http_ip) { free(g_so.http_ip); }
 	if(g_so.certfile) { free(g_so.certfile); }
 	if(g_so.keyfile) { free(g_so.keyfile); }
-	return 0;
+	return z;
 }
 
 struct options opts[] = 
@@ -178,13 +421,42 @@ struct options opts[] =
 #ifdef SRNODECHRONOMETRY
 	{ 10, "stats",	"Show stats every second",		NULL, 0 },
 #endif
+	{ 11, "logpolicy",	"Full log ring: drop|block",	NULL, 1 },
+	{ 12, "logsize",	"Rotate log after N bytes",		NULL, 1 },
+	{ 13, "logage",		"Rotate log after N seconds",	NULL, 1 },
+	{ 14, "loglevel",	"debug|info|warn|err|crit",		NULL, 1 },
+	{ 15, "sampleget",	"Log 1 in N GETs",				NULL, 1 },
+	{ 16, "samplepost",	"Log 1 in N POSTs",				NULL, 1 },
+	{ 17, "sampleconn",	"Log 1 in N allowed connections",	NULL, 1 },
+	{ 18, "workers",	"Fork N pinned worker processes",	NULL, 1 },
+	{ 19, "backlog",	"Listen backlog",				NULL, 1 },
+	{ 20, "deferaccept",	"TCP_DEFER_ACCEPT seconds",	NULL, 1 },
+	{ 21, "fastopen",	"TCP_FASTOPEN queue length",	NULL, 1 },
+	{ 22, "nodelay",	"Set TCP_NODELAY",				NULL, 0 },
+	{ 23, "rcvbuf",		"SO_RCVBUF bytes",				NULL, 1 },
+	{ 24, "sndbuf",		"SO_SNDBUF bytes",				NULL, 1 },
+	{ 25, "idletimeout",	"Close idle connections after N seconds",		NULL, 1 },
+	{ 26, "headertimeout",	"Seconds allowed to send request headers",		NULL, 1 },
+	{ 27, "bodytimeout",	"Seconds allowed to upload a request body",		NULL, 1 },
+	{ 28, "ipconns",	"Max concurrent connections per client IP",		NULL, 1 },
+	{ 29, "connmem",	"Memory pool bytes per connection",			NULL, 1 },
+	{ 30, "maxinflight",	"Adaptive limit on concurrent requests (max)",		NULL, 1 },
+	{ 31, "uploadbudget",	"Max upload bytes in flight",				NULL, 1 },
+	{ 32, "retryafter",	"Retry-After seconds on 503",				NULL, 1 },
+	{ 33, "bulksize",	"POST bytes that put a request in the bulk lane",	NULL, 1 },
+	{ 34, "fastworkers",	"Concurrent requests in the fast lane",			NULL, 1 },
+	{ 35, "bulkworkers",	"Concurrent requests in the bulk lane",			NULL, 1 },
+	{ 36, "lanewait",	"Max ms to wait for a lane before 503",			NULL, 1 },
+	{ 37, "rconnecttimeout",	"Redis connect timeout in ms",			NULL, 1 },
+	{ 38, "rtimeout",	"Redis command timeout in ms",				NULL, 1 },
+	{ 39, "memwatermark",	"Refuse uploads above this % of redis maxmemory (0 disables)",	NULL, 1 },
 	{ 0, NULL,		NULL,							NULL, 0 }
 };
 
 static void parse_args(int argc, char **argv)
 {
 	char *args, *colon;
-	int c;
+	int c, z;
 
 	while ((c = getopts(argc, argv, opts, &args)) != 0) {
 		switch(c) {
@@ -234,6 +506,98 @@ static void parse_args(int argc, char **argv)
 				g_alarm_stats = 1;
 				break;
 #endif
+			case 11:
+				if(strcmp(args, "drop") == 0) { log_set_policy(WSLOG_POLICY_DROP); }
+				else if(strcmp(args, "block") == 0) { log_set_policy(WSLOG_POLICY_BLOCK); }
+				else { fprintf(stderr, "Unknown log policy: %s (Fix with --logpolicy drop|block)\n", args); exit(EXIT_FAILURE); }
+				break;
+			case 12:
+				log_set_rotation(atol(args), 0);
+				break;
+			case 13:
+				g_logage = atol(args);
+				log_set_rotation(0, g_logage);
+				break;
+			case 14:
+				z = log_level_from_str(args);
+				if(z < 0) { fprintf(stderr, "Unknown log level: %s (Fix with --loglevel)\n", args); exit(EXIT_FAILURE); }
+				log_set_level(z);
+				break;
+			case 15:
+				log_set_sampling(WSLOG_CAT_GET, atol(args));
+				break;
+			case 16:
+				log_set_sampling(WSLOG_CAT_POST, atol(args));
+				break;
+			case 17:
+				log_set_sampling(WSLOG_CAT_CONN, atol(args));
+				break;
+			case 18:
+				g_workers = atoi(args);
+				break;
+			case 19:
+				g_so.backlog = atoi(args);
+				break;
+			case 20:
+				g_so.defer_accept = atoi(args);
+				break;
+			case 21:
+				g_so.fastopen = atoi(args);
+				break;
+			case 22:
+				g_so.nodelay = 1;
+				break;
+			case 23:
+				g_so.rcvbuf = atoi(args);
+				break;
+			case 24:
+				g_so.sndbuf = atoi(args);
+				break;
+			case 25:
+				g_so.idle_timeout = atoi(args);
+				break;
+			case 26:
+				g_so.header_timeout = atoi(args);
+				break;
+			case 27:
+				g_so.body_timeout = atoi(args);
+				break;
+			case 28:
+				g_so.ip_conns = atoi(args);
+				break;
+			case 29:
+				g_so.conn_mem = atol(args);
+				break;
+			case 30:
+				g_so.max_inflight = atoi(args);
+				break;
+			case 31:
+				g_so.upload_budget = atol(args);
+				break;
+			case 32:
+				g_so.retry_after = atoi(args);
+				break;
+			case 33:
+				g_so.bulk_size = atol(args);
+				break;
+			case 34:
+				g_so.fast_workers = atoi(args);
+				break;
+			case 35:
+				g_so.bulk_workers = atoi(args);
+				break;
+			case 36:
+				g_so.lane_wait = atol(args);
+				break;
+			case 37:
+				g_so.rconnect_timeout = atol(args);
+				break;
+			case 38:
+				g_so.rcmd_timeout = atol(args);
+				break;
+			case 39:
+				g_so.mem_watermark = atoi(args);
+				break;
 			default:
 				fprintf(stderr, "Unexpected getopts Error! (%d)\n", c);
 				break;
@@ -0,0 +1,626 @@
+/*
+	webstore is a web-based arbitrary data storage service that accepts z85 encoded data
+	Copyright (C) 2021 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// POST /store/mget/ with a body of tokens (any mix of algorithms, separated by whitespace)
+// answers with one frame per token, in request order:
+//     <token> <status> <length>\n<length bytes of Z85>\n
+// Tokens are fetched BATCH_CHUNK at a time with one pipeline while the response streams out
+//
+// POST /store/mset/ with a body of records in the same framing:
+//     <token> <length>\n<length bytes of Z85>\n
+// answers with one "<token> <status>" line per record, records are written BATCH_CHUNK at a time with one pipeline
+//
+// POST /store/mdel/ with a body of tokens like mget unlinks them all, answering like mset
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "webstore.h"
+#include "webstore_ops.h"
+#include "webstore_log.h"
+
+#define BATCH_MAX	(10000)	// tokens per request
+#define BATCH_CHUNK	(64)	// tokens per redis pipeline
+
+// One record of an mset
+typedef struct {
+	wskey_t k;
+	int code;
+	const unsigned char *data;
+	size_t len;
+	wsbuf_t *packed;	// STORE transcoding
+	int replies;
+	int pack;
+} wsitem_t;
+
+typedef struct {
+	wsrt_t *rt;
+	int count;
+	wskey_t *keys;
+	char *valid;
+
+	int next;					// first token not fetched yet
+	int first;					// tokens [first, first+n) are in vals/codes
+	int n;
+	int i;						// token being sent
+	wsbuf_t *vals[BATCH_CHUNK];
+	int codes[BATCH_CHUNK];
+
+	char hdr[HASHLEN512+32];	// frame header of token i
+	size_t hdrlen;
+	size_t off;					// bytes of frame i already sent
+} wsbatch_t;
+
+static int token_type(int len, int *hashlen)
+{
+	*hashlen = len;
+	switch(len) {
+		case HASHLEN128: return HASHALG128;
+		case HASHLEN160: return HASHALG160;
+		case HASHLEN224: return HASHALG224;
+		case HASHLEN256: return HASHALG256;
+		case HASHLEN384: return HASHALG384;
+		case HASHLEN512: return HASHALG512;
+	}
+	return 0;
+}
+
+// Split the body into keys, returns the number of tokens or -1 if there are too many
+static int batch_parse(wsbatch_t *st, const char *body, size_t len)
+{
+	const char *p = body, *end = body + len, *t;
+	wsreq_t req;
+	int count = 0;
+
+	while(p < end) {
+		while((p < end) && isspace((unsigned char)*p)) { p++; }
+		if(p == end) { break; }
+		t = p;
+		while((p < end) && !isspace((unsigned char)*p)) { p++; }
+
+		if(count == BATCH_MAX) { return -1; }
+		if(st->keys) {
+			req.url = (char *)t;
+			req.urllen = p - t;
+			req.type = token_type(req.urllen, &req.hashlen);
+			st->valid[count] = (req.type && (make_key(st->rt, &req, &st->keys[count]) == 0));
+			if(!st->valid[count]) {
+				// Echo what was sent
+				st->keys[count].hexlen = (req.urllen > HASHLEN512) ? HASHLEN512 : req.urllen;
+				memcpy(st->keys[count].hex, t, st->keys[count].hexlen);
+				st->keys[count].hex[st->keys[count].hexlen] = 0;
+			}
+		}
+		count++;
+	}
+
+	return count;
+}
+
+// Fetch the next chunk of tokens with one pipeline
+static void batch_fetch(wsbatch_t *st)
+{
+	wsrt_t *rt = st->rt;
+	rai_t *rc = &rt->rc;
+	redisReply *r = NULL, *hr = NULL;
+	const wskey_t *k;
+	wskey_t hk;
+	int i, z, err = 0, dels = 0;
+	char queued[BATCH_CHUNK];
+
+	st->first = st->next;
+	st->n = st->count - st->next;
+	if(st->n > BATCH_CHUNK) { st->n = BATCH_CHUNK; }
+	st->next += st->n;
+	st->i = 0;
+	for(i=0; i<st->n; i++) {
+		st->vals[i] = NULL;
+		st->codes[i] = st->valid[st->first+i] ? 404 : 400;
+		queued[i] = 0;
+		if(st->codes[i] == 404) {
+			// Writes still in the write-behind queue are served from it
+			st->vals[i] = wb_get(st->keys[st->first+i].hex);
+			if(st->vals[i]) { st->codes[i] = 200; queued[i] = 1; }
+		}
+	}
+
+	rai_lock(rc);
+	if(!rai_ready(rc)) {
+		rai_unlock(rc);
+		for(i=0; i<st->n; i++) { if(st->codes[i] == 404) { st->codes[i] = 503; } }
+		goto unpack;
+	}
+
+	for(i=0; i<st->n; i++) {
+		if(!st->valid[st->first+i] || queued[i]) { continue; }
+		k = &st->keys[st->first+i];
+		if(rt->packsize) { redisAppendCommand(rc->c, "HGET %s %b", k->bucket, k->field, k->fieldlen); }
+		redisAppendCommand(rc->c, "GET %b", k->key, k->keylen);
+	}
+
+	for(i=0; (i<st->n) && !err; i++) {
+		if(!st->valid[st->first+i] || queued[i]) { continue; }
+		hr = r = NULL;
+		if(rt->packsize && (redisGetReply(rc->c, (void **)&hr) != REDIS_OK)) { err = 1; break; }
+		if(redisGetReply(rc->c, (void **)&r) != REDIS_OK) { err = 1; }
+		else if(hr && (hr->type == REDIS_REPLY_STRING)) { st->vals[i] = wsbuf_new(hr->str, hr->len); }
+		else if(r->type == REDIS_REPLY_STRING) { st->vals[i] = wsbuf_new(r->str, r->len); }
+		if(st->vals[i]) { st->codes[i] = 200; }
+		if(hr) { freeReplyObject(hr); }
+		if(r) { freeReplyObject(r); }
+	}
+
+	// Burn what was read, with a second pipeline
+	if(!err && rt->bar) {
+		for(i=0; i<st->n; i++) {
+			if(!st->vals[i] || queued[i]) { continue; }
+			k = &st->keys[st->first+i];
+			redisAppendCommand(rc->c, "UNLINK %b", k->key, k->keylen);
+			dels++;
+			if(rt->packsize) {
+				redisAppendCommand(rc->c, "HDEL %s %b", k->bucket, k->field, k->fieldlen);
+				dels++;
+			}
+		}
+		while(dels-- && !err) {
+			if(redisGetReply(rc->c, (void **)&r) != REDIS_OK) { err = 1; }
+			else { freeReplyObject(r); }
+		}
+	}
+
+	if(err) {
+		handle_redis_error(rc);
+		for(i=0; i<st->n; i++) { if(st->codes[i] == 404) { st->codes[i] = 503; } }
+	}
+	rai_unlock(rc);
+
+unpack:
+	// Values stored transcoded go back to Z85 outside the lock
+	for(i=0; i<st->n; i++) {
+		if(!st->vals[i]) { continue; }
+		st->vals[i] = codec_unpack(st->vals[i]);
+		if(!st->vals[i]) { st->codes[i] = 500; }
+	}
+
+	// Not migrated yet, these are rare enough to fetch one by one
+	if(rt->binkeys == BINKEYS_MIGRATE) {
+		for(i=0; i<st->n; i++) {
+			if(st->codes[i] != 404) { continue; }
+			hex_key(rt, &st->keys[st->first+i], &hk);
+			z = do_redis_get(rt, &hk, &st->vals[i]);
+			if(z) { st->codes[i] = z; }
+			else if(st->vals[i]) { st->codes[i] = 200; }
+		}
+	}
+}
+
+// MHD_ContentReaderCallback
+static ssize_t batch_read(void *ctx, uint64_t pos, char *buf, size_t max)
+{
+	wsbatch_t *st = ctx;
+	wsbuf_t *v;
+	size_t n = 0, c, vlen;
+
+	while(n < max) {
+		if(st->i >= st->n) {
+			if(st->next >= st->count) { break; }
+			batch_fetch(st);
+		}
+
+		v = st->vals[st->i];
+		vlen = v ? v->len : 0;
+		if(st->off == 0) {
+			st->hdrlen = snprintf(st->hdr, sizeof(st->hdr), "%s %d %lu\n",
+				st->keys[st->first+st->i].hex, st->codes[st->i], (unsigned long)vlen);
+		}
+
+		if(st->off < st->hdrlen) {
+			c = st->hdrlen - st->off;
+			if(c > max - n) { c = max - n; }
+			memcpy(buf + n, st->hdr + st->off, c);
+		} else if(st->off < st->hdrlen + vlen) {
+			c = st->hdrlen + vlen - st->off;
+			if(c > max - n) { c = max - n; }
+			memcpy(buf + n, v->data + (st->off - st->hdrlen), c);
+		} else {
+			buf[n] = '\n';
+			c = 1;
+		}
+		n += c;
+		st->off += c;
+
+		if(st->off == st->hdrlen + vlen + 1) {
+			wsbuf_release(v);
+			st->vals[st->i] = NULL;
+			st->i++;
+			st->off = 0;
+		}
+	}
+
+	if(n == 0) { return MHD_CONTENT_READER_END_OF_STREAM; }
+	return n;
+}
+
+static void batch_free(void *ctx)
+{
+	wsbatch_t *st = ctx;
+	int i;
+
+	for(i=st->i; i<st->n; i++) { wsbuf_release(st->vals[i]); }
+	free(st->keys);
+	free(st->valid);
+	free(st);
+}
+
+char* node_mget(char *url, int urllen, srci_t *ri, void *sri_user_data, void *node_user_data)
+{
+	wsrt_t *rt = sri_user_data;
+	wsbatch_t *st;
+	const char *body;
+	size_t len;
+	int count;
+
+	if(shutting_down()) {
+		srci_set_return_code(ri, MHD_HTTP_SERVICE_UNAVAILABLE);
+		return strdup("service unavailable: shutting down");
+	}
+
+	if(METHOD(ri) != METHOD_POST) {
+		srci_set_return_code(ri, MHD_HTTP_METHOD_NOT_ALLOWED);
+		return strdup("method not allowed");
+	}
+
+	if(urllen != 0) {
+		srci_set_return_code(ri, MHD_HTTP_BAD_REQUEST);
+		return strdup("malformed request - invalid url");
+	}
+
+	st = calloc(1, sizeof(wsbatch_t));
+	if(!st) {
+		srci_set_return_code(ri, MHD_HTTP_INTERNAL_SERVER_ERROR);
+		return strdup("internal server error");
+	}
+	st->rt = rt;
+
+	// Count first, then build the keys
+	body = (const char *)srci_get_post_data_ptr(ri);
+	len = srci_get_post_data_size(ri);
+	count = batch_parse(st, body, len);
+	if(count <= 0) {
+		free(st);
+		srci_set_return_code(ri, MHD_HTTP_BAD_REQUEST);
+		if(count < 0) { return strdup("malformed request - too many tokens"); }
+		return strdup("malformed request - no tokens");
+	}
+
+	st->keys = malloc(count * sizeof(wskey_t));
+	st->valid = malloc(count);
+	if(!st->keys || !st->valid) {
+		batch_free(st);
+		srci_set_return_code(ri, MHD_HTTP_INTERNAL_SERVER_ERROR);
+		return strdup("internal server error");
+	}
+	st->count = batch_parse(st, body, len);
+
+	// The first chunk is fetched here, inside the lane and limiter slot of the request
+	// The rest is fetched by batch_read() as MHD streams the response, after the slot is given back
+	batch_fetch(st);
+
+	if(rt->cors) { srci_set_response_cors(ri); }
+	srci_set_response_content_type(ri, MIMETYPETXTPLAINSTR);
+	srci_set_return_code(ri, MHD_HTTP_OK);
+	srci_set_return_stream(ri, batch_read, batch_free, st);
+	LOG_SAMPLED(WSLOG_CAT_GET, WSLOG_INFO, "%s %d MGET %d tokens", srci_get_client_ip(ri), MHD_HTTP_OK, st->count);
+	return strdup("");
+}
+
+// Split an mset body into items
+// returns the number of records, -1 if the framing is broken or -2 if there are too many
+static int mset_parse(wsrt_t *rt, const char *body, size_t len, wsitem_t **items)
+{
+	const char *p = body, *end = body + len, *nl;
+	char token[HASHLEN512+2], line[HASHLEN512+33], *sp, *e;
+	unsigned long vlen;
+	wsitem_t *it, *all = NULL;
+	wsreq_t req;
+	int i, count = 0;
+
+	while(p < end) {
+		// The body is not NUL terminated, parse a bounded copy of the header line
+		nl = memchr(p, '\n', end - p);
+		if(!nl || (nl - p >= (long)sizeof(line))) { break; }
+		memcpy(line, p, nl - p);
+		line[nl - p] = 0;
+		sp = strchr(line, ' ');
+		if(!sp || (sp == line) || (sp - line > HASHLEN512 + 1)) { break; }
+		*sp++ = 0;
+		if(!isdigit((unsigned char)*sp)) { break; }
+		errno = 0;
+		vlen = strtoul(sp, &e, 10);
+		if(*e || (errno == ERANGE)) { break; }
+		memcpy(token, line, sp - line);
+		p = nl + 1;
+		// The value and its newline must fit, vlen + 1 would wrap at ULONG_MAX
+		if(vlen >= (unsigned long)(end - p)) { break; }
+		if(count == BATCH_MAX) { *items = all; return -2; }
+
+		if((count % BATCH_CHUNK) == 0) {
+			it = realloc(all, (count + BATCH_CHUNK) * sizeof(wsitem_t));
+			if(!it) { break; }
+			all = it;
+		}
+		it = &all[count++];
+		memset(it, 0, sizeof(wsitem_t));
+		it->k.hexlen = strlen(token);
+		if(it->k.hexlen > HASHLEN512) { it->k.hexlen = HASHLEN512; }
+		memcpy(it->k.hex, token, it->k.hexlen);
+		it->data = (const unsigned char *)p;
+		it->len = vlen;
+		p += vlen + 1;
+	}
+	*items = all;
+	if(p < end) { return -1; }
+
+	// wskey_t points into itself, build the keys once the array stops moving
+	for(i=0; i<count; i++) {
+		it = &all[i];
+		memcpy(token, it->k.hex, it->k.hexlen + 1);
+		req.url = token;
+		req.urllen = it->k.hexlen;
+		req.type = token_type(req.urllen, &req.hashlen);
+		if(!req.type || make_key(rt, &req, &it->k)) {
+			memcpy(it->k.hex, token, req.urllen + 1);	// echo what was sent
+			it->code = 400;
+		} else if((it->len < 5) || Z85_validate(it->data, it->len)) { it->code = 400; }
+	}
+
+	return count;
+}
+
+// Write every valid item with one pipeline per BATCH_CHUNK items
+static void mset_write(wsrt_t *rt, wsitem_t *items, int count)
+{
+	rai_t *rc = &rt->rc;
+	redisReply *reply;
+	int i, j, first, last, err = 0;
+
+	// The lock is dropped between pipelines so other requests are not stalled behind a large batch
+	for(first = 0; first < count; first = last) {
+		last = first + BATCH_CHUNK;
+		if(last > count) { last = count; }
+
+		rai_lock(rc);
+		if(err || !rai_ready(rc)) {
+			rai_unlock(rc);
+			for(i=first; i<last; i++) { if(!items[i].code) { items[i].code = 503; } }
+			continue;
+		}
+
+		for(i=first; i<last; i++) {
+			if(items[i].code) { continue; }
+			items[i].replies = post_append(rt, &items[i].k, items[i].data, items[i].len, &items[i].pack);
+		}
+
+		for(i=first; i<last; i++) {
+			if(items[i].code) { continue; }
+			if(err) { items[i].code = 503; continue; }
+			for(j=0; j<items[i].replies; j++) {
+				if(redisGetReply(rc->c, (void **)&reply) != REDIS_OK) { err = 1; break; }
+				if(j == 0) { items[i].code = post_result(rt, reply, items[i].pack); }
+				freeReplyObject(reply);
+			}
+			if(err) { items[i].code = 503; continue; }
+			if(items[i].code == 0) { items[i].code = 200; }
+		}
+		if(err) { handle_redis_error(rc); }
+		rai_unlock(rc);
+	}
+}
+
+char* node_mset(char *url, int urllen, srci_t *ri, void *sri_user_data, void *node_user_data)
+{
+	wsrt_t *rt = sri_user_data;
+	wsitem_t *items = NULL;
+	char *page;
+	size_t len, plen = 0;
+	int i, count, ok = 0;
+
+	if(shutting_down()) {
+		srci_set_return_code(ri, MHD_HTTP_SERVICE_UNAVAILABLE);
+		return strdup("service unavailable: shutting down");
+	}
+
+	if(METHOD(ri) != METHOD_POST) {
+		srci_set_return_code(ri, MHD_HTTP_METHOD_NOT_ALLOWED);
+		return strdup("method not allowed");
+	}
+
+	if(urllen != 0) {
+		srci_set_return_code(ri, MHD_HTTP_BAD_REQUEST);
+		return strdup("malformed request - invalid url");
+	}
+
+	len = srci_get_post_data_size(ri);
+	count = mset_parse(rt, (const char *)srci_get_post_data_ptr(ri), len, &items);
+	if(count <= 0) {
+		free(items);
+		srci_set_return_code(ri, MHD_HTTP_BAD_REQUEST);
+		if(count == -2) { return strdup("malformed request - too many records"); }
+		if(count < 0) { return strdup("malformed request - invalid framing"); }
+		return strdup("malformed request - no records");
+	}
+
+	// Store the decoded bytes instead of the text, when the text allows it
+	if(rt->store) {
+		for(i=0; i<count; i++) {
+			if(items[i].code) { continue; }
+			items[i].packed = codec_pack(rt->store, items[i].data, items[i].len);
+			if(items[i].packed) {
+				items[i].data = (const unsigned char *)items[i].packed->data;
+				items[i].len = items[i].packed->len;
+			}
+		}
+	}
+
+	// Nothing still queued may land on top of these writes
+	for(i=0; i<count; i++) { if(!items[i].code) { wb_drop(items[i].k.hex); } }
+
+	// A large batch writes on the bulk lane's own connection
+	mset_write(lane_rt(rt, ri), items, count);
+
+	page = malloc(count * (HASHLEN512 + 6) + 1);
+	if(page) { page[0] = 0; }
+	for(i=0; i<count; i++) {
+		wsbuf_release(items[i].packed);
+		if(items[i].code == 200) {
+			ok++;
+			if(!rt->immutable) { zc_invalidate(items[i].k.hex); }
+			wait_notify(items[i].k.hex);
+		}
+		if(page) { plen += sprintf(page + plen, "%s %d\n", items[i].k.hex, items[i].code); }
+	}
+	free(items);
+
+	if(!page) {
+		srci_set_return_code(ri, MHD_HTTP_INTERNAL_SERVER_ERROR);
+		return strdup("internal server error");
+	}
+
+	if(rt->cors) { srci_set_response_cors(ri); }
+	srci_set_response_content_type(ri, MIMETYPETXTPLAINSTR);
+	srci_set_return_code(ri, MHD_HTTP_OK);
+	LOG_SAMPLED(WSLOG_CAT_POST, WSLOG_INFO, "%s %d MSET %d/%d records", srci_get_client_ip(ri), MHD_HTTP_OK, ok, count);
+	return page;
+}
+
+// Unlink every valid token with one pipeline per BATCH_CHUNK tokens, codes[i] gets the status of token i
+// codes[i] comes in as 200 if a queued write of token i was dropped, then a missing key is not a 404
+static void mdel_write(wsbatch_t *st, int *codes)
+{
+	rai_t *rc = &st->rt->rc;
+	int i, z, first, last, err = 0, replies[BATCH_CHUNK];
+
+	// The lock is dropped between pipelines, like mset_write()
+	for(first = 0; first < st->count; first = last) {
+		last = first + BATCH_CHUNK;
+		if(last > st->count) { last = st->count; }
+
+		rai_lock(rc);
+		if(err || !rai_ready(rc)) {
+			rai_unlock(rc);
+			for(i=first; i<last; i++) { codes[i] = st->valid[i] ? 503 : 400; }
+			continue;
+		}
+
+		for(i=first; i<last; i++) {
+			if(st->valid[i]) { replies[i-first] = del_append(st->rt, &st->keys[i]); }
+		}
+
+		for(i=first; i<last; i++) {
+			if(!st->valid[i]) { codes[i] = 400; continue; }
+			if(err) { codes[i] = 503; continue; }
+			z = del_replies(st->rt, replies[i-first]);
+			if(z == 503) { err = 1; }
+			if((z == 0) || ((z == 404) && (codes[i] == 200))) { z = 200; }
+			codes[i] = z;
+		}
+		if(err) { handle_redis_error(rc); }
+		rai_unlock(rc);
+	}
+}
+
+char* node_mdel(char *url, int urllen, srci_t *ri, void *sri_user_data, void *node_user_data)
+{
+	wsrt_t *rt = sri_user_data;
+	wsbatch_t *st;
+	const char *body;
+	char *page = NULL;
+	size_t len, plen = 0;
+	int i, count, ok = 0, *codes = NULL;
+
+	if(shutting_down()) {
+		srci_set_return_code(ri, MHD_HTTP_SERVICE_UNAVAILABLE);
+		return strdup("service unavailable: shutting down");
+	}
+
+	if(METHOD(ri) != METHOD_POST) {
+		srci_set_return_code(ri, MHD_HTTP_METHOD_NOT_ALLOWED);
+		return strdup("method not allowed");
+	}
+
+	if(urllen != 0) {
+		srci_set_return_code(ri, MHD_HTTP_BAD_REQUEST);
+		return strdup("malformed request - invalid url");
+	}
+
+	st = calloc(1, sizeof(wsbatch_t));
+	if(!st) {
+		srci_set_return_code(ri, MHD_HTTP_INTERNAL_SERVER_ERROR);
+		return strdup("internal server error");
+	}
+	st->rt = rt;
+
+	// Count first, then build the keys
+	body = (const char *)srci_get_post_data_ptr(ri);
+	len = srci_get_post_data_size(ri);
+	count = batch_parse(st, body, len);
+	if(count <= 0) {
+		free(st);
+		srci_set_return_code(ri, MHD_HTTP_BAD_REQUEST);
+		if(count < 0) { return strdup("malformed request - too many tokens"); }
+		return strdup("malformed request - no tokens");
+	}
+
+	st->keys = malloc(count * sizeof(wskey_t));
+	st->valid = malloc(count);
+	codes = malloc(count * sizeof(int));
+	page = malloc(count * (HASHLEN512 + 6) + 1);
+	if(!st->keys || !st->valid || !codes || !page) {
+		free(codes);
+		free(page);
+		batch_free(st);
+		srci_set_return_code(ri, MHD_HTTP_INTERNAL_SERVER_ERROR);
+		return strdup("internal server error");
+	}
+	st->count = batch_parse(st, body, len);
+
+	// Queued writes are dropped before they reach redis, that counts as deleted
+	for(i=0; i<st->count; i++) { codes[i] = (st->valid[i] && wb_drop(st->keys[i].hex)) ? 200 : 0; }
+
+	mdel_write(st, codes);
+
+	page[0] = 0;
+	for(i=0; i<st->count; i++) {
+		if(codes[i] == 200) {
+			ok++;
+			zc_invalidate(st->keys[i].hex);
+		}
+		plen += sprintf(page + plen, "%s %d\n", st->keys[i].hex, codes[i]);
+	}
+	free(codes);
+	batch_free(st);
+
+	if(rt->cors) { srci_set_response_cors(ri); }
+	srci_set_response_content_type(ri, MIMETYPETXTPLAINSTR);
+	srci_set_return_code(ri, MHD_HTTP_OK);
+	LOG_SAMPLED(WSLOG_CAT_POST, WSLOG_INFO, "%s %d MDEL %d/%d tokens", srci_get_client_ip(ri), MHD_HTTP_OK, ok, count);
+	return page;
+}
@@ -0,0 +1,240 @@
+/*
+	webstore is a web-based arbitrary data storage service that accepts z85 encoded data
+	Copyright (C) 2021 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// At-rest transcoding: keep the bytes behind the Z85 text in redis, optionally deflated
+// Stored layout: 0x00, codec, lead, original length (4 bytes big endian), payload
+// Z85 text never contains 0x00, so values stored as plain text are told apart by their first byte
+// lead is the padding digit of a Z85_encode_with_padding() string (or 0), the text is rebuilt exactly
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "webstore_ops.h"
+#include "z85.h"
+#include "miniz.h"
+
+#define CODEC_BINARY	('B')
+#define CODEC_DEFLATE	('D')
+#define CODEC_MINDEFLATE	(64)	// smaller payloads never shrink enough to pay for the header
+#define CODEC_LEVEL		(1)		// fastest miniz level, most of the gain at a fraction of the cost
+
+static atomic_ulong g_bytes_in;
+static atomic_ulong g_bytes_stored;
+
+static const char z85_digits[] =
+	"0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ.-:+=^!/*?&<>()[]{}@%$#";
+
+static unsigned char z85_value[256];
+
+static void codec_init_table(void)
+{
+	int i;
+
+	memset(z85_value, 0xFF, sizeof(z85_value));
+	for(i=0; i<85; i++) { z85_value[(unsigned char)z85_digits[i]] = i; }
+}
+
+// Decode 5 digit frames to 4 bytes each
+// returns -1 if a frame does not fit in 32 bits, that text would not survive the round trip
+static int z85_frames(const unsigned char *in, size_t len, unsigned char *out)
+{
+	unsigned long long v;
+	size_t i;
+	int j;
+
+	for(i=0; i<len; i+=5) {
+		v = 0;
+		for(j=0; j<5; j++) { v = (v * 85) + z85_value[in[i+j]]; }
+		if(v > 0xFFFFFFFFULL) { return -1; }
+		*out++ = v >> 24;
+		*out++ = v >> 16;
+		*out++ = v >> 8;
+		*out++ = v;
+	}
+	return 0;
+}
+
+// Transcode validated Z85 text for storage
+// returns NULL if the text should be stored as it is
+wsbuf_t* codec_pack(int mode, const unsigned char *text, size_t len)
+{
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	unsigned char lead = 0, *raw, *packed;
+	size_t rawlen, clen = 0;
+	wsbuf_t *b;
+
+	if(mode == STORE_Z85) { return NULL; }
+	pthread_once(&once, codec_init_table);
+
+	if(((len % 5) == 1) && (text[0] >= '1') && (text[0] <= '4')) { lead = *text++; len--; }
+	if((len == 0) || (len % 5)) { return NULL; }
+
+	rawlen = (len / 5) * 4;
+	b = malloc(sizeof(wsbuf_t) + CODEC_HDRLEN + rawlen + 1);
+	if(!b) { return NULL; }
+	atomic_init(&b->refs, 1);
+	packed = (unsigned char *)b->data;
+	raw = packed + CODEC_HDRLEN;
+	if(z85_frames(text, len, raw)) { free(b); return NULL; }
+
+	packed[0] = 0;
+	packed[1] = CODEC_BINARY;
+	packed[2] = lead;
+	packed[3] = rawlen >> 24;
+	packed[4] = rawlen >> 16;
+	packed[5] = rawlen >> 8;
+	packed[6] = rawlen;
+	b->len = CODEC_HDRLEN + rawlen;
+
+	// Keep the deflated form only if it is smaller
+	if((mode == STORE_DEFLATE) && (rawlen >= CODEC_MINDEFLATE)) {
+		unsigned char *tmp = malloc(rawlen);
+		if(tmp) {
+			clen = tdefl_compress_mem_to_mem(tmp, rawlen - 1, raw, rawlen,
+				tdefl_create_comp_flags_from_zip_params(CODEC_LEVEL, -MZ_DEFAULT_WINDOW_BITS, MZ_DEFAULT_STRATEGY));
+			if(clen > 0) {
+				memcpy(raw, tmp, clen);
+				packed[1] = CODEC_DEFLATE;
+				b->len = CODEC_HDRLEN + clen;
+			}
+			free(tmp);
+		}
+	}
+	b->data[b->len] = 0;
+
+	atomic_fetch_add(&g_bytes_in, len + (lead ? 1 : 0));
+	atomic_fetch_add(&g_bytes_stored, b->len);
+	return b;
+}
+
+// Turn a stored value back into the Z85 text that was uploaded
+// Plain text values are handed back as they are, returns NULL on a corrupt value
+wsbuf_t* codec_unpack(wsbuf_t *stored)
+{
+	const unsigned char *p = (const unsigned char *)stored->data;
+	unsigned char *raw = NULL;
+	size_t rawlen, textlen;
+	wsbuf_t *b;
+	char *end;
+
+	if((stored->len == 0) || (p[0] != 0)) { return stored; }
+	if(stored->len < CODEC_HDRLEN) { goto corrupt; }
+
+	rawlen = ((size_t)p[3] << 24) | ((size_t)p[4] << 16) | ((size_t)p[5] << 8) | p[6];
+	if((rawlen == 0) || (rawlen % 4)) { goto corrupt; }
+
+	if(p[1] == CODEC_BINARY) {
+		if(stored->len - CODEC_HDRLEN != rawlen) { goto corrupt; }
+		raw = (unsigned char *)p + CODEC_HDRLEN;
+	} else if(p[1] == CODEC_DEFLATE) {
+		raw = malloc(rawlen);
+		if(!raw) { goto corrupt; }
+		if(tinfl_decompress_mem_to_mem(raw, rawlen, p + CODEC_HDRLEN, stored->len - CODEC_HDRLEN, 0) != rawlen) {
+			free(raw);
+			goto corrupt;
+		}
+	} else {
+		goto corrupt;
+	}
+
+	textlen = (rawlen / 4) * 5 + (p[2] ? 1 : 0);
+	b = malloc(sizeof(wsbuf_t) + textlen + 1);
+	if(b) {
+		atomic_init(&b->refs, 1);
+		b->len = textlen;
+		end = b->data;
+		if(p[2]) { *end++ = p[2]; }
+		end = Z85_encode_unsafe((const char *)raw, (const char *)raw + rawlen, end);
+		*end = 0;
+	}
+	if(raw != p + CODEC_HDRLEN) { free(raw); }
+	wsbuf_release(stored);
+	return b;
+
+corrupt:
+	wsbuf_release(stored);
+	return NULL;
+}
+
+// Length of the Z85 text a stored value stands for, from its first CODEC_HDRLEN bytes
+// returns -1 on a corrupt header
+long codec_text_len(const unsigned char *head, size_t headlen, size_t storedlen)
+{
+	size_t rawlen;
+
+	if((headlen == 0) || (head[0] != 0)) { return storedlen; }
+	if(headlen < CODEC_HDRLEN) { return -1; }
+	rawlen = ((size_t)head[3] << 24) | ((size_t)head[4] << 16) | ((size_t)head[5] << 8) | head[6];
+	if((rawlen == 0) || (rawlen % 4)) { return -1; }
+	return (rawlen / 4) * 5 + (head[2] ? 1 : 0);
+}
+
+// Where text bytes [first, last] of a stored value are, from its first CODEC_HDRLEN bytes
+// CODEC_RANGE_FRAMES sets [*sfirst, *slast] to the stored bytes of the 5 digit frames that cover them
+int codec_range(const unsigned char *head, size_t headlen, long first, long last, long *sfirst, long *slast)
+{
+	long lead, fa, fb;
+
+	if((headlen == 0) || (head[0] != 0)) { return CODEC_RANGE_TEXT; }
+	if((headlen < CODEC_HDRLEN) || (head[1] != CODEC_BINARY)) { return CODEC_RANGE_FULL; }
+
+	lead = head[2] ? 1 : 0;
+	fa = (first > lead) ? (first - lead) / 5 : 0;
+	fb = (last > lead) ? (last - lead) / 5 : 0;
+	*sfirst = CODEC_HDRLEN + fa * 4;
+	*slast = CODEC_HDRLEN + fb * 4 + 3;
+	return CODEC_RANGE_FRAMES;
+}
+
+// Rebuild text bytes [first, last] from the frames codec_range() pointed at
+// returns NULL if the frames are not all there
+wsbuf_t* codec_slice(const unsigned char *head, const unsigned char *frames, size_t len, long first, long last)
+{
+	long lead, fa, fb, n;
+	char *text;
+	wsbuf_t *b;
+
+	lead = head[2] ? 1 : 0;
+	fa = (first > lead) ? (first - lead) / 5 : 0;
+	fb = (last > lead) ? (last - lead) / 5 : 0;
+	n = fb - fa + 1;
+	if(len != (size_t)n * 4) { return NULL; }
+
+	text = malloc(n * 5);
+	if(!text) { return NULL; }
+	Z85_encode_unsafe((const char *)frames, (const char *)frames + len, text);
+
+	b = malloc(sizeof(wsbuf_t) + (last - first + 1) + 1);
+	if(b) {
+		atomic_init(&b->refs, 1);
+		b->len = last - first + 1;
+		if(first < lead) { b->data[0] = head[2]; first++; }
+		memcpy(b->data + (b->len - (last - first + 1)), text + (first - lead - fa * 5), last - first + 1);
+		b->data[b->len] = 0;
+	}
+	free(text);
+	return b;
+}
+
+void codec_get(unsigned long *in, unsigned long *stored)
+{
+	*in = atomic_load(&g_bytes_in);
+	*stored = atomic_load(&g_bytes_stored);
+}
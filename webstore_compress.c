@@ -0,0 +1,337 @@
+/*
+	webstore is a web-based arbitrary data storage service that accepts z85 encoded data
+	Copyright (C) 2021 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Content-Encoding for GET responses, with a bounded LRU cache of compressed bodies
+// Tokens are content hashes so a hot object is compressed once, the cache still checks
+// the length and CRC32 of the body so an overwritten token never serves stale data
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "webstore.h"
+#include "webstore_ops.h"
+#include "miniz.h"
+#include "z85.h"
+
+#define ZC_BUCKETS		(4096)
+#define ZC_SAMPLE		(4096)	// text bytes looked at to predict the gain
+#define ZC_CHUNK		(80)	// text bytes per sample, whole Z85 groups
+#define ZC_MAXRATIO		(0.9)	// Huffman coding only if the decoded sample predicts more than this
+#define ZC_LEVEL		(6)		// compressed once per object, can afford the default level
+#define ZC_OVERHEAD		(sizeof(zcent_t) + 64)
+
+typedef struct zcent {
+	char key[HASHLEN512+1];
+	int enc;
+	size_t len;			// uncompressed length
+	mz_ulong crc;		// of the uncompressed body
+	wsbuf_t *buf;		// NULL: compression did not help
+	size_t cost;
+	struct zcent *hnext;
+	struct zcent *prev;	// LRU, head is the most recent
+	struct zcent *next;
+} zcent_t;
+
+static pthread_mutex_t g_zc_lock = PTHREAD_MUTEX_INITIALIZER;
+static zcent_t *g_zc_table[ZC_BUCKETS];
+static zcent_t *g_zc_head;
+static zcent_t *g_zc_tail;
+static size_t g_zc_bytes;
+static size_t g_zc_limit;
+static size_t g_zc_min;
+
+static atomic_ulong g_zc_hits;
+static atomic_ulong g_zc_misses;
+static atomic_ulong g_zc_huffman;
+
+static unsigned int zc_hash(const char *key, int enc)
+{
+	unsigned int h = 5381 + enc;
+	while(*key) { h = (h * 33) ^ (unsigned char)*key++; }
+	return h % ZC_BUCKETS;
+}
+
+// called with g_zc_lock held
+static void zc_unlink(zcent_t *e)
+{
+	zcent_t **pp;
+
+	for(pp = &g_zc_table[zc_hash(e->key, e->enc)]; *pp; pp = &(*pp)->hnext) {
+		if(*pp == e) { *pp = e->hnext; break; }
+	}
+	if(e->prev) { e->prev->next = e->next; } else { g_zc_head = e->next; }
+	if(e->next) { e->next->prev = e->prev; } else { g_zc_tail = e->prev; }
+	g_zc_bytes -= e->cost;
+	wsbuf_release(e->buf);
+	free(e);
+}
+
+// called with g_zc_lock held
+static void zc_touch(zcent_t *e)
+{
+	if(e == g_zc_head) { return; }
+	if(e->prev) { e->prev->next = e->next; }
+	if(e->next) { e->next->prev = e->prev; } else { g_zc_tail = e->prev; }
+	e->prev = NULL;
+	e->next = g_zc_head;
+	if(g_zc_head) { g_zc_head->prev = e; }
+	g_zc_head = e;
+	if(!g_zc_tail) { g_zc_tail = e; }
+}
+
+// called with g_zc_lock held
+static zcent_t* zc_find(const char *key, int enc)
+{
+	zcent_t *e;
+
+	for(e = g_zc_table[zc_hash(key, enc)]; e; e = e->hnext) {
+		if((e->enc == enc) && (strcmp(e->key, key) == 0)) { return e; }
+	}
+	return NULL;
+}
+
+// called with g_zc_lock held, takes over the reference on buf
+static void zc_insert(const char *key, int enc, size_t len, mz_ulong crc, wsbuf_t *buf)
+{
+	unsigned int b = zc_hash(key, enc);
+	zcent_t *e;
+
+	e = zc_find(key, enc);
+	if(e) { zc_unlink(e); }
+
+	e = calloc(1, sizeof(zcent_t));
+	if(!e) { wsbuf_release(buf); return; }
+	strncpy(e->key, key, sizeof(e->key)-1);
+	e->enc = enc;
+	e->len = len;
+	e->crc = crc;
+	e->buf = buf;
+	e->cost = ZC_OVERHEAD + (buf ? buf->len : 0);
+	if(e->cost > g_zc_limit) { wsbuf_release(buf); free(e); return; }
+
+	e->hnext = g_zc_table[b];
+	g_zc_table[b] = e;
+	e->next = g_zc_head;
+	if(g_zc_head) { g_zc_head->prev = e; }
+	g_zc_head = e;
+	if(!g_zc_tail) { g_zc_tail = e; }
+	g_zc_bytes += e->cost;
+
+	while(g_zc_bytes > g_zc_limit) { zc_unlink(g_zc_tail); }
+}
+
+// Order-0 entropy of the bytes under a sample of the Z85 text, as the ratio LZ could reach on them
+// The text itself never measures above log2(85)/8 = 0.80, so it can't tell random payloads apart
+static double zc_predict(const unsigned char *data, size_t len)
+{
+	unsigned int hist[256] = { 0 };
+	unsigned char raw[ZC_CHUNK/5*4];
+	size_t i, j, c, n = 0, step;
+	double p, bits = 0.0;
+
+	// Skip the padding digit of Z85_encode_with_padding() and any partial group
+	if((len % 5) == 1) { data++; len--; }
+	len -= len % 5;
+	if(len == 0) { return 0.0; }
+
+	step = len / (ZC_SAMPLE / ZC_CHUNK);
+	step -= step % 5;
+	if(step < ZC_CHUNK) { step = ZC_CHUNK; }
+	for(i = 0; i < len; i += step) {
+		c = (len - i < ZC_CHUNK) ? (len - i) : ZC_CHUNK;
+		Z85_decode_unsafe((const char *)data + i, (const char *)data + i + c, (char *)raw);
+		for(j = 0; j < c/5*4; j++) { hist[raw[j]]++; n++; }
+	}
+	for(i = 0; i < 256; i++) {
+		if(!hist[i]) { continue; }
+		p = (double)hist[i] / n;
+		bits -= p * log2(p);
+	}
+	return bits / 8.0;
+}
+
+// strategy is MZ_DEFAULT_STRATEGY or MZ_HUFFMAN_ONLY, returns NULL if the result would not be smaller
+static wsbuf_t* zc_compress(int enc, int strategy, const unsigned char *data, size_t len, mz_ulong crc)
+{
+	size_t n, hdr = 0, trl = 0;
+	unsigned char *out;
+	wsbuf_t *b;
+	int flags;
+
+	flags = tdefl_create_comp_flags_from_zip_params(ZC_LEVEL, -MZ_DEFAULT_WINDOW_BITS, strategy);
+	if(enc == ZENC_DEFLATE) { flags |= TDEFL_WRITE_ZLIB_HEADER; }
+	else { hdr = 10; trl = 8; }
+	if(len <= hdr + trl) { return NULL; }
+
+	b = malloc(sizeof(wsbuf_t) + len);
+	if(!b) { return NULL; }
+	atomic_init(&b->refs, 1);
+	out = (unsigned char *)b->data;
+
+	n = tdefl_compress_mem_to_mem(out + hdr, len - hdr - trl, data, len, flags);
+	if(n == 0) { free(b); return NULL; }
+
+	if(enc == ZENC_GZIP) {
+		static const unsigned char gzhdr[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+		memcpy(out, gzhdr, sizeof(gzhdr));
+		out += hdr + n;
+		out[0] = crc; out[1] = crc >> 8; out[2] = crc >> 16; out[3] = crc >> 24;
+		out[4] = len; out[5] = len >> 8; out[6] = len >> 16; out[7] = len >> 24;
+	}
+	b->len = hdr + n + trl;
+
+	return b;
+}
+
+void zc_configure(size_t min, size_t cache_bytes)
+{
+	g_zc_min = min;
+	g_zc_limit = cache_bytes;
+}
+
+int zc_enabled(void)
+{
+	return (g_zc_min > 0);
+}
+
+// Pick an encoding from an Accept-Encoding header, gzip is preferred over deflate
+int zc_negotiate(const char *ae)
+{
+	int gzip = 0, deflate = 0, *which;
+	const char *p, *q;
+	size_t len;
+
+	if(!ae) { return ZENC_NONE; }
+
+	for(p = ae; *p; p = q) {
+		while((*p == ' ') || (*p == ',')) { p++; }
+		q = p + strcspn(p, ",");
+		len = strcspn(p, ";, ");
+		which = NULL;
+		if((len == 4) && (strncasecmp(p, "gzip", 4) == 0)) { which = &gzip; }
+		if((len == 7) && (strncasecmp(p, "deflate", 7) == 0)) { which = &deflate; }
+		if(which) {
+			// q=0 means not acceptable
+			*which = 1;
+			p = memchr(p, ';', q - p);
+			if(p) { p = strstr(p, "q="); }
+			if(p && (p < q) && (strtod(p + 2, NULL) == 0.0)) { *which = 0; }
+		}
+	}
+
+	if(gzip) { return ZENC_GZIP; }
+	if(deflate) { return ZENC_DEFLATE; }
+	return ZENC_NONE;
+}
+
+// The compressed form of body for token key, NULL if it should go out as it is
+// Pass cache = 0 for bodies that will never be served again
+wsbuf_t* zc_get(const char *key, int enc, wsbuf_t *body, int cache)
+{
+	zcent_t *e;
+	wsbuf_t *b = NULL;
+	mz_ulong crc;
+
+	if((enc == ZENC_NONE) || (body->len < g_zc_min)) { return NULL; }
+
+	crc = mz_crc32(MZ_CRC32_INIT, (const unsigned char *)body->data, body->len);
+	if(cache && g_zc_limit) {
+		pthread_mutex_lock(&g_zc_lock);
+		e = zc_find(key, enc);
+		if(e && (e->len == body->len) && (e->crc == crc)) {
+			zc_touch(e);
+			b = e->buf;
+			if(b) { wsbuf_ref(b); }
+			pthread_mutex_unlock(&g_zc_lock);
+			atomic_fetch_add(&g_zc_hits, 1);
+			return b;
+		}
+		pthread_mutex_unlock(&g_zc_lock);
+	}
+
+	// A random payload (encrypted, already compressed) leaves LZ nothing to find,
+	// Huffman coding alone still wins back the ~19% the Z85 alphabet costs, much faster
+	atomic_fetch_add(&g_zc_misses, 1);
+	if(zc_predict((const unsigned char *)body->data, body->len) > ZC_MAXRATIO) {
+		atomic_fetch_add(&g_zc_huffman, 1);
+		b = zc_compress(enc, MZ_HUFFMAN_ONLY, (const unsigned char *)body->data, body->len, crc);
+	} else {
+		b = zc_compress(enc, MZ_DEFAULT_STRATEGY, (const unsigned char *)body->data, body->len, crc);
+	}
+
+	// Remember incompressible bodies too, so they are not sampled again
+	if(cache && g_zc_limit) {
+		if(b) { wsbuf_ref(b); }
+		pthread_mutex_lock(&g_zc_lock);
+		zc_insert(key, enc, body->len, crc, b);
+		pthread_mutex_unlock(&g_zc_lock);
+	}
+
+	return b;
+}
+
+// Length of the compressed form a GET would send for a body of len bytes, without the body
+// returns 1 and sets *zlen if it is cached, 0 if the body goes out as it is,
+// -1 if only zc_get() on the body can tell
+int zc_peek(const char *key, int enc, size_t len, size_t *zlen)
+{
+	zcent_t *e;
+	int z = -1;
+
+	if((enc == ZENC_NONE) || (len < g_zc_min)) { return 0; }
+	if(!g_zc_limit) { return -1; }
+
+	pthread_mutex_lock(&g_zc_lock);
+	e = zc_find(key, enc);
+	if(e && (e->len == len)) {
+		z = e->buf ? 1 : 0;
+		if(e->buf) { *zlen = e->buf->len; }
+	}
+	pthread_mutex_unlock(&g_zc_lock);
+
+	return z;
+}
+
+// The object behind key changed
+void zc_invalidate(const char *key)
+{
+	zcent_t *e;
+	int enc;
+
+	if(!g_zc_limit) { return; }
+	pthread_mutex_lock(&g_zc_lock);
+	for(enc = ZENC_GZIP; enc <= ZENC_DEFLATE; enc++) {
+		e = zc_find(key, enc);
+		if(e) { zc_unlink(e); }
+	}
+	pthread_mutex_unlock(&g_zc_lock);
+}
+
+void zc_get_stats(unsigned long *hits, unsigned long *misses, unsigned long *huffman, unsigned long *bytes)
+{
+	*hits = atomic_load(&g_zc_hits);
+	*misses = atomic_load(&g_zc_misses);
+	*huffman = atomic_load(&g_zc_huffman);
+	pthread_mutex_lock(&g_zc_lock);
+	*bytes = g_zc_bytes;
+	pthread_mutex_unlock(&g_zc_lock);
+}
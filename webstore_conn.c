@@ -48,15 +48,15 @@ static int check_ip(wsrt_t *lrt, char *ip)
 	if(!reply) { handle_redis_error(rc); return 0; }
 	if(reply->type == REDIS_REPLY_NIL) {
 		// KEY DOES NOT EXIST
-		log_add(WSLOG_INFO, "%s new connection allowed (count: 1)", ip);
+		LOG_SAMPLED(WSLOG_CAT_CONN, WSLOG_INFO, "%s new connection allowed (count: 1)", ip);
 		save_ip(rc, ip, 0, lrt->reqperiod);
 	} else if(reply->type == REDIS_REPLY_STRING) {
 		count = atoi(reply->str);
 		if(count < lrt->reqcount) {
-			log_add(WSLOG_INFO, "%s new connection allowed (count: %d)", ip, count+1);
+			LOG_SAMPLED(WSLOG_CAT_CONN, WSLOG_INFO, "%s new connection allowed (count: %d)", ip, count+1);
 			save_ip(rc, ip, 1, lrt->reqperiod);
 		} else {
-			log_add(WSLOG_INFO, "%s new connection denied (count: %d)", ip, count+1);
+			log_add(WSLOG_WARN, "%s new connection denied (count: %d)", ip, count+1);
 			retval = 0;
 		}
 	} else { retval = 0; }	// THIS SHOULD NEVER HAPPEN
@@ -70,12 +70,13 @@ static int check_ip(wsrt_t *lrt, char *ip)
 // Return 0 if connection is denied
 int allow_ip(wsrt_t *lrt, char *ip)
 {
-	int retval;
+	int retval = 1;
 
-	//LOCK RAI if redis calls are in their own thread, using a shared context
-	if(lrt->multithreaded) { rai_lock(&lrt->rc); }
-	retval = check_ip(lrt, ip);
-	if(lrt->multithreaded) { rai_unlock(&lrt->rc); }
+	//LOCK RAI, the scheduler thread may be reconnecting even without multithreading
+	// While redis is unavailable let the connection in, its request will get a fast 503
+	rai_lock(&lrt->rc);
+	if(rai_ready(&lrt->rc)) { retval = check_ip(lrt, ip); }
+	rai_unlock(&lrt->rc);
 
 	return retval;
 }
@@ -0,0 +1,169 @@
+/*
+	webstore is a web-based arbitrary data storage service that accepts z85 encoded data
+	Copyright (C) 2021 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Singleflight: concurrent requests for the same token share one Redis round trip.
+// The first request in becomes the leader and does the work, everyone who joins
+// while it is in flight waits for its result instead of asking Redis again.
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "webstore.h"
+#include "webstore_ops.h"
+
+#define FLIGHT_BUCKETS (256)
+
+struct wsflight {
+	int kind;
+	char key[HASHLEN512+1];
+	const unsigned char *payload;	// leader's POST data, valid while the flight is in the table
+	size_t payload_len;
+
+	int refs;
+	int done;
+	int code;
+	wsbuf_t *buf;
+	pthread_cond_t cond;
+
+	struct wsflight *next;
+};
+
+static pthread_mutex_t g_flight_lock = PTHREAD_MUTEX_INITIALIZER;
+static wsflight_t *g_flights[FLIGHT_BUCKETS];
+
+static unsigned int flight_hash(int kind, const char *key)
+{
+	unsigned int h = 5381 + kind;
+	while(*key) { h = (h * 33) ^ (unsigned char)*key++; }
+	return h % FLIGHT_BUCKETS;
+}
+
+wsbuf_t* wsbuf_new(const char *data, size_t len)
+{
+	wsbuf_t *b = malloc(sizeof(wsbuf_t) + len + 1);
+	if(!b) { return NULL; }
+	atomic_init(&b->refs, 1);
+	b->len = len;
+	memcpy(b->data, data, len);
+	b->data[len] = 0;
+	return b;
+}
+
+void wsbuf_ref(wsbuf_t *b)
+{
+	atomic_fetch_add(&b->refs, 1);
+}
+
+// Matches the searest release callback signature
+void wsbuf_release(void *arg)
+{
+	wsbuf_t *b = arg;
+	if(!b) { return; }
+	if(atomic_fetch_sub(&b->refs, 1) == 1) { free(b); }
+}
+
+// called with g_flight_lock held
+static void flight_put(wsflight_t *f)
+{
+	if(--f->refs > 0) { return; }
+	wsbuf_release(f->buf);
+	pthread_cond_destroy(&f->cond);
+	free(f);
+}
+
+// Join the flight for kind/key or start a new one (*leader is set)
+// A POST only joins if its payload is identical, otherwise NULL is returned
+wsflight_t* flight_join(int kind, const char *key, const unsigned char *payload, size_t len, int *leader)
+{
+	unsigned int b = flight_hash(kind, key);
+	wsflight_t *f;
+
+	*leader = 0;
+	pthread_mutex_lock(&g_flight_lock);
+	for(f = g_flights[b]; f; f = f->next) {
+		if((f->kind == kind) && (strcmp(f->key, key) == 0)) { break; }
+	}
+
+	if(f) {
+		if((kind == FLIGHT_POST) && ((f->payload_len != len) || memcmp(f->payload, payload, len))) {
+			pthread_mutex_unlock(&g_flight_lock);
+			return NULL;
+		}
+		f->refs++;
+		pthread_mutex_unlock(&g_flight_lock);
+		return f;
+	}
+
+	f = calloc(1, sizeof(wsflight_t));
+	if(!f) {
+		pthread_mutex_unlock(&g_flight_lock);
+		return NULL;
+	}
+	f->kind = kind;
+	strncpy(f->key, key, sizeof(f->key)-1);
+	f->payload = payload;
+	f->payload_len = len;
+	f->refs = 1;
+	pthread_cond_init(&f->cond, NULL);
+	f->next = g_flights[b];
+	g_flights[b] = f;
+	*leader = 1;
+	pthread_mutex_unlock(&g_flight_lock);
+
+	return f;
+}
+
+// Leader: publish the result, take the flight out of the table and wake the followers
+// The flight keeps its own reference on buf
+void flight_finish(wsflight_t *f, int code, wsbuf_t *buf)
+{
+	wsflight_t **pp;
+	unsigned int b = flight_hash(f->kind, f->key);
+
+	pthread_mutex_lock(&g_flight_lock);
+	for(pp = &g_flights[b]; *pp; pp = &(*pp)->next) {
+		if(*pp == f) { *pp = f->next; break; }
+	}
+	f->payload = NULL;
+	f->code = code;
+	if(buf) { wsbuf_ref(buf); }
+	f->buf = buf;
+	f->done = 1;
+	pthread_cond_broadcast(&f->cond);
+	flight_put(f);
+	pthread_mutex_unlock(&g_flight_lock);
+}
+
+// Follower: wait for the leader, returns its code and a reference on its buffer
+int flight_wait(wsflight_t *f, wsbuf_t **buf)
+{
+	int code;
+
+	pthread_mutex_lock(&g_flight_lock);
+	while(!f->done) { pthread_cond_wait(&f->cond, &g_flight_lock); }
+	code = f->code;
+	if(buf) {
+		*buf = f->buf;
+		if(f->buf) { wsbuf_ref(f->buf); }
+	}
+	flight_put(f);
+	pthread_mutex_unlock(&g_flight_lock);
+
+	return code;
+}
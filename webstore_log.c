@@ -1,5 +1,5 @@
 /*
-	webstore is a web-based arbitrary data storage service that accepts z85 encoded data 
+	webstore is a web-based arbitrary data storage service that accepts z85 encoded data
 	Copyright (C) 2021 Brett Kuskie <fullaxx@gmail.com>
 
 	This program is free software; you can redistribute it and/or modify
@@ -16,26 +16,245 @@
 	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 
+// log_add() never takes a lock and never makes a syscall beyond clock_gettime().
+// Each line is formatted straight into a slot of a bounded MPSC ring
+// (Dmitry Vyukov's sequence-numbered queue) and a single writer thread
+// drains the ring in large write() batches.
+// The writer thread also owns rotation: it renames the closed segment
+// and hands it to a low-priority thread that gzips it with miniz.
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 
 #include "webstore_log.h"
+#ifdef MINIZ_COMPRESSION
+#include "compression.h"
+#endif
+
+#define WSLOG_SLOTS		(4096)			// must be a power of 2
+#define WSLOG_LINESIZE	(512)			// longer lines get truncated
+#define WSLOG_BATCHSIZE	(64*1024)		// bytes handed to each write()
+
+typedef struct {
+	atomic_size_t seq;
+	size_t len;
+	char line[WSLOG_LINESIZE];
+} logslot_t;
+
+static logslot_t *g_ring = NULL;
+static atomic_size_t g_enq;		// next slot a producer will claim
+static size_t g_deq;			// next slot the writer will drain (writer only)
+
+static int g_lfd = -1;
+static atomic_int g_log_running;
+static atomic_int g_log_stop;
+static atomic_int g_writer_idle;
+static atomic_ulong g_log_overflows;
+static int g_log_policy = WSLOG_POLICY_BLOCK;
+
+// Lines below g_log_rank are discarded before any formatting happens
+// 1 of every g_sample_every[cat] lines in a sampled category is kept
+#ifdef DEBUG
+static atomic_int g_log_rank = 0;
+#else
+static atomic_int g_log_rank = 1;
+#endif
+static unsigned long g_sample_every[WSLOG_CATS] = { 1, 1, 1 };
+static atomic_ulong g_sample_count[WSLOG_CATS];
+static sem_t g_log_sem;
+static pthread_t g_writer_thr;
+
+// Rotation state, only touched by the writer thread
+static char *g_logpath = NULL;
+static long g_rotate_size = 0;
+static long g_rotate_age = 0;
+static long g_seg_bytes = 0;
+static time_t g_seg_start = 0;
+static atomic_int g_log_reopen;
+
+#ifdef MINIZ_COMPRESSION
+// Closed segments waiting to be compressed
+typedef struct segment {
+	char *path;
+	struct segment *next;
+} segment_t;
+
+static segment_t *g_seg_head = NULL;
+static segment_t *g_seg_tail = NULL;
+static int g_squash_stop = 0;
+static int g_squash_running = 0;
+static pthread_t g_squash_thr;
+static pthread_mutex_t g_seg_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_seg_cond = PTHREAD_COND_INITIALIZER;
+#endif
+
+// Every thread keeps its own copy of the formatted timestamp
+// localtime_r() and strftime() only run when the second rolls over
+// the millisecond field is refreshed at most once per millisecond
+static __thread time_t tl_sec = -1;
+static __thread long tl_ms = -1;
+static __thread char tl_datetime[16];
+static __thread char tl_stamp[48];
+
+static inline const char* log_timestamp(void)
+{
+	struct timespec ts;
+	struct tm lt;
+	long ms;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ms = ts.tv_nsec / 1000000;
+	if((ts.tv_sec == tl_sec) && (ms == tl_ms)) { return tl_stamp; }
+
+	if(ts.tv_sec != tl_sec) {
+		localtime_r(&ts.tv_sec, &lt);
+		strftime(tl_datetime, sizeof(tl_datetime), "%y%m%d %H%M%S", &lt);
+		tl_sec = ts.tv_sec;
+	}
+	snprintf(tl_stamp, sizeof(tl_stamp), "%s %03ld000000", tl_datetime, ms);
+	tl_ms = ms;
+
+	return tl_stamp;
+}
+
+// Severity order of the WSLOG_ levels (DEBUG is numerically last but least severe)
+static inline int level_rank(int level)
+{
+	switch(level) {
+		case WSLOG_DEBUG:	return 0;
+		case WSLOG_INFO:	return 1;
+		case WSLOG_WARN:	return 2;
+		case WSLOG_ERR:		return 3;
+		case WSLOG_CRIT:	return 4;
+	}
+	return -1;
+}
+
+static inline int rank_level(int rank)
+{
+	switch(rank) {
+		case 0:	return WSLOG_DEBUG;
+		case 1:	return WSLOG_INFO;
+		case 2:	return WSLOG_WARN;
+		case 3:	return WSLOG_ERR;
+	}
+	return WSLOG_CRIT;
+}
+
+// return 1 if a line at this level would be written
+int log_enabled(int level)
+{
+	if(!atomic_load_explicit(&g_log_running, memory_order_relaxed)) { return 0; }
+	return (level_rank(level) >= atomic_load_explicit(&g_log_rank, memory_order_relaxed));
+}
 
-pthread_mutex_t g_log_lock = PTHREAD_MUTEX_INITIALIZER;
-FILE *g_lf = NULL;
+// return 1 if this line of a sampled category should be written
+int log_sampled(int cat, int level)
+{
+	unsigned long n;
+
+	if(!log_enabled(level)) { return 0; }
+	if((cat < 0) || (cat >= WSLOG_CATS) || (g_sample_every[cat] <= 1)) { return 1; }
+
+	n = atomic_fetch_add_explicit(&g_sample_count[cat], 1, memory_order_relaxed);
+	return ((n % g_sample_every[cat]) == 0);
+}
+
+void log_set_level(int level)
+{
+	int rank = level_rank(level);
+	if(rank >= 0) { atomic_store(&g_log_rank, rank); }
+}
+
+int log_get_level(void)
+{
+	return rank_level(atomic_load(&g_log_rank));
+}
+
+// These are async-signal-safe so they can be driven by SIGUSR1/SIGUSR2
+void log_more_verbose(void)
+{
+	int rank = atomic_load(&g_log_rank);
+	if(rank > 0) { atomic_store(&g_log_rank, rank-1); }
+}
+
+void log_less_verbose(void)
+{
+	int rank = atomic_load(&g_log_rank);
+	if(rank < 4) { atomic_store(&g_log_rank, rank+1); }
+}
+
+// Keep 1 out of every n lines in category cat (n <= 1 keeps all of them)
+void log_set_sampling(int cat, unsigned long n)
+{
+	if((cat < 0) || (cat >= WSLOG_CATS)) { return; }
+	g_sample_every[cat] = (n > 1) ? n : 1;
+}
+
+// return -1 if str does not name a log level
+int log_level_from_str(const char *str)
+{
+	if(strcasecmp(str, "debug") == 0) { return WSLOG_DEBUG; }
+	if(strcasecmp(str, "info") == 0) { return WSLOG_INFO; }
+	if(strcasecmp(str, "warn") == 0) { return WSLOG_WARN; }
+	if(strcasecmp(str, "err") == 0) { return WSLOG_ERR; }
+	if(strcasecmp(str, "crit") == 0) { return WSLOG_CRIT; }
+	return -1;
+}
+
+static inline void wake_writer(void)
+{
+	if(atomic_exchange(&g_writer_idle, 0)) { sem_post(&g_log_sem); }
+}
+
+// Claim the next free slot in the ring
+// return NULL if the ring is full
+static logslot_t* slot_claim(size_t *claimed)
+{
+	logslot_t *s;
+	size_t pos, seq;
+	intptr_t dif;
+
+	pos = atomic_load_explicit(&g_enq, memory_order_relaxed);
+	for(;;) {
+		s = &g_ring[pos & (WSLOG_SLOTS-1)];
+		seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+		dif = (intptr_t)seq - (intptr_t)pos;
+		if(dif == 0) {
+			if(atomic_compare_exchange_weak_explicit(&g_enq, &pos, pos+1,
+				memory_order_relaxed, memory_order_relaxed)) { *claimed = pos; return s; }
+		} else if(dif < 0) {
+			return NULL;
+		} else {
+			pos = atomic_load_explicit(&g_enq, memory_order_relaxed);
+		}
+	}
+}
 
 void log_add(int level, const char *fmt, ...)
 {
 	char *l_ptr;
-	struct timespec ts;
-	char date[9];
-	char time[7];
-	char timestamp[32];
+	logslot_t *s;
+	size_t pos, len;
+	int z;
 	va_list argptr;
 
-	if(!g_lf) { return; }
+	if(!atomic_load_explicit(&g_log_running, memory_order_relaxed)) { return; }
 
 	switch(level) {
 		case WSLOG_INFO:	l_ptr = WSLOG_INFO_STR;	break;
@@ -47,51 +266,328 @@ void log_add(int level, const char *fmt, ...)
 #endif
 		default: return;
 	}
+	if(level_rank(level) < atomic_load_explicit(&g_log_rank, memory_order_relaxed)) { return; }
 
-	// Calculate Timestamp
-	clock_gettime(CLOCK_REALTIME, &ts);
-	strftime(date, sizeof(date), "%y%m%d", localtime(&ts.tv_sec));
-	strftime(time, sizeof(time), "%H%M%S", localtime(&ts.tv_sec));
-	snprintf(timestamp, sizeof(timestamp), "%s %s %09ld", date, time, ts.tv_nsec);
-
-	// Lock
-	pthread_mutex_lock(&g_log_lock);
+	// Count each line that found the ring full once, however long it then spins
+	s = slot_claim(&pos);
+	if(!s) {
+		atomic_fetch_add_explicit(&g_log_overflows, 1, memory_order_relaxed);
+		if(g_log_policy == WSLOG_POLICY_DROP) { return; }
+		do {
+			wake_writer();
+			sched_yield();
+		} while(!(s = slot_claim(&pos)));
+	}
 
 	// Print Header
-	fprintf(g_lf, "%s %s ", timestamp, l_ptr);
+	z = snprintf(s->line, WSLOG_LINESIZE, "%s %s ", log_timestamp(), l_ptr);
+	len = (z < 0) ? 0 : (size_t)z;
 
 	// Print Log Message
-	va_start(argptr, fmt);
-	vfprintf(g_lf, fmt, argptr);
-	va_end(argptr);
+	if(len < WSLOG_LINESIZE) {
+		va_start(argptr, fmt);
+		z = vsnprintf(s->line + len, WSLOG_LINESIZE - len, fmt, argptr);
+		va_end(argptr);
+		if(z > 0) { len += z; }
+	}
+	if(len > WSLOG_LINESIZE-1) { len = WSLOG_LINESIZE-1; }
+	s->line[len++] = '\n';
+	s->len = len;
 
-	fprintf(g_lf, "\n");
+	// Publish the slot and poke the writer if it went to sleep
+	atomic_store_explicit(&s->seq, pos+1, memory_order_release);
+	atomic_thread_fence(memory_order_seq_cst);
+	if(atomic_load_explicit(&g_writer_idle, memory_order_relaxed)) { wake_writer(); }
+}
+
+static void write_batch(char *buf, size_t len)
+{
+	ssize_t z;
 
-	// Unlock
-	pthread_mutex_unlock(&g_log_lock);
+	while(len > 0) {
+		z = write(g_lfd, buf, len);
+		if(z < 0) {
+			if(errno == EINTR) { continue; }
+			fprintf(stderr, "log write() failed: %s\n", strerror(errno));
+			return;
+		}
+		buf += z;
+		len -= z;
+		g_seg_bytes += z;
+	}
+}
+
+// Copy every published slot into the batch buffer and write it out
+// return the number of lines drained
+static size_t log_drain(char *batch)
+{
+	logslot_t *s;
+	size_t seq, blen = 0, count = 0;
+
+	for(;;) {
+		s = &g_ring[g_deq & (WSLOG_SLOTS-1)];
+		seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+		if(seq != g_deq+1) { break; }
+
+		if(blen + s->len > WSLOG_BATCHSIZE) { write_batch(batch, blen); blen = 0; }
+		memcpy(batch + blen, s->line, s->len);
+		blen += s->len;
+
+		atomic_store_explicit(&s->seq, g_deq+WSLOG_SLOTS, memory_order_release);
+		g_deq++;
+		count++;
+	}
+
+	if(blen > 0) { write_batch(batch, blen); }
+	return count;
+}
+
+static int slot_ready(void)
+{
+	logslot_t *s = &g_ring[g_deq & (WSLOG_SLOTS-1)];
+	return (atomic_load_explicit(&s->seq, memory_order_acquire) == g_deq+1);
+}
+
+#ifdef MINIZ_COMPRESSION
+static void* log_squasher(void *arg)
+{
+	segment_t *seg;
+	char gzpath[4096];
+
+	// Compression must never compete with request threads
+	(void) setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+
+	pthread_mutex_lock(&g_seg_lock);
+	for(;;) {
+		while(!g_seg_head && !g_squash_stop) { pthread_cond_wait(&g_seg_cond, &g_seg_lock); }
+		if(g_squash_stop) { break; }
+		seg = g_seg_head;
+		g_seg_head = seg->next;
+		if(!g_seg_head) { g_seg_tail = NULL; }
+		pthread_mutex_unlock(&g_seg_lock);
+
+		snprintf(gzpath, sizeof(gzpath), "%s.gz", seg->path);
+		if(mza_gzip_file(seg->path, gzpath) == 0) { unlink(seg->path); }
+		else { unlink(gzpath); log_add(WSLOG_ERR, "failed to compress %s", seg->path); }
+		free(seg->path);
+		free(seg);
+
+		pthread_mutex_lock(&g_seg_lock);
+	}
+	pthread_mutex_unlock(&g_seg_lock);
+
+	return NULL;
+}
+
+static void squash_segment(char *path)
+{
+	segment_t *seg;
+
+	if(!g_squash_running) {
+		if(pthread_create(&g_squash_thr, NULL, log_squasher, NULL)) { return; }
+		g_squash_running = 1;
+	}
+
+	seg = calloc(1, sizeof(segment_t));
+	if(!seg) { return; }
+	seg->path = strdup(path);
+
+	pthread_mutex_lock(&g_seg_lock);
+	if(g_seg_tail) { g_seg_tail->next = seg; }
+	else { g_seg_head = seg; }
+	g_seg_tail = seg;
+	pthread_cond_signal(&g_seg_cond);
+	pthread_mutex_unlock(&g_seg_lock);
+}
+#endif
+
+// (Re)open the log file and start a new segment
+static int segment_open(void)
+{
+	struct stat sb;
+	int fd;
+
+	fd = open(g_logpath, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+	if(fd < 0) { return -1; }
+
+	if(g_lfd >= 0) { close(g_lfd); }
+	g_lfd = fd;
+	g_seg_bytes = (fstat(fd, &sb) == 0) ? sb.st_size : 0;
+	g_seg_start = time(NULL);
+	return 0;
+}
+
+// Move the current file aside, start a fresh one and queue the old one for compression
+static void segment_rotate(void)
+{
+	char segpath[4096];
+	char stamp[32];
+	struct tm lt;
+	time_t now;
+	size_t len;
+	int i;
+
+	now = time(NULL);
+	localtime_r(&now, &lt);
+	strftime(stamp, sizeof(stamp), "%y%m%d-%H%M%S", &lt);
+	snprintf(segpath, sizeof(segpath), "%s.%s", g_logpath, stamp);
+	len = strlen(segpath);
+	for(i=1; (access(segpath, F_OK) == 0) && (i < 100); i++) {
+		snprintf(segpath+len, sizeof(segpath)-len, "-%d", i);
+	}
+
+	if(rename(g_logpath, segpath)) {
+		fprintf(stderr, "rename(%s, %s) failed: %s\n", g_logpath, segpath, strerror(errno));
+		g_seg_start = now;
+		return;
+	}
+
+	if(segment_open()) {
+		fprintf(stderr, "Error reopening logfile: %s\n", g_logpath);
+		return;
+	}
+
+#ifdef MINIZ_COMPRESSION
+	squash_segment(segpath);
+#endif
+}
+
+static void segment_check(void)
+{
+	if(atomic_exchange(&g_log_reopen, 0)) {
+		if(segment_open()) { fprintf(stderr, "Error reopening logfile: %s\n", g_logpath); }
+	}
+
+	if((g_rotate_size > 0) && (g_seg_bytes >= g_rotate_size)) { segment_rotate(); }
+	// An empty segment is never rotated on age, an idle server would fill the directory with empty files
+	else if((g_rotate_age > 0) && (g_seg_bytes > 0) && (time(NULL) - g_seg_start >= g_rotate_age)) { segment_rotate(); }
+}
+
+static void* log_writer(void *arg)
+{
+	char *batch = arg;
+
+	for(;;) {
+		segment_check();
+		if(log_drain(batch) > 0) { continue; }
+		if(atomic_load(&g_log_stop)) { break; }
+
+		// Announce that we are going to sleep, then check once more
+		// so that a producer publishing right now cannot be missed
+		atomic_store(&g_writer_idle, 1);
+		if(slot_ready() || atomic_load(&g_log_stop)) { atomic_store(&g_writer_idle, 0); continue; }
+
+		// Age based rotation is driven by log_flush() from the scheduler
+		while((sem_wait(&g_log_sem) == -1) && (errno == EINTR)) { }
+		atomic_store(&g_writer_idle, 0);
+	}
+
+	(void) log_drain(batch);
+	free(batch);
+	return NULL;
+}
+
+// Rotate once the segment reaches maxbytes or maxage seconds (0 disables either)
+void log_set_rotation(long maxbytes, long maxage)
+{
+	if(maxbytes > 0) { g_rotate_size = maxbytes; }
+	if(maxage > 0) { g_rotate_age = maxage; }
+}
+
+// Ask the writer thread to reopen the log file by name
+// This is async-signal-safe so it can be called from a signal handler
+void log_reopen(void)
+{
+	atomic_store(&g_log_reopen, 1);
+	if(atomic_load(&g_log_running)) { sem_post(&g_log_sem); }
+}
+
+void log_set_policy(int policy)
+{
+	if((policy == WSLOG_POLICY_DROP) || (policy == WSLOG_POLICY_BLOCK)) { g_log_policy = policy; }
+}
+
+unsigned long log_get_overflows(void)
+{
+	return atomic_load_explicit(&g_log_overflows, memory_order_relaxed);
 }
 
 int log_open(char *logfile)
 {
-	g_lf = fopen(logfile, "a");
-	if(!g_lf) {
+	char *batch;
+	size_t i;
+
+	g_logpath = strdup(logfile);
+	if(segment_open()) {
 		fprintf(stderr, "Error opening logfile: %s\n", logfile);
 		return -1;
 	}
 
+	g_ring = calloc(WSLOG_SLOTS, sizeof(logslot_t));
+	batch = malloc(WSLOG_BATCHSIZE);
+	if(!g_ring || !batch) {
+		fprintf(stderr, "Error allocating log ring!\n");
+		return -2;
+	}
+	for(i=0; i<WSLOG_SLOTS; i++) { atomic_init(&g_ring[i].seq, i); }
+	atomic_init(&g_enq, 0);
+	g_deq = 0;
+
+	sem_init(&g_log_sem, 0, 0);
+	atomic_store(&g_log_stop, 0);
+	if(pthread_create(&g_writer_thr, NULL, log_writer, batch)) {
+		fprintf(stderr, "Error starting log writer thread!\n");
+		return -3;
+	}
+
+	atomic_store(&g_log_running, 1);
 	return 0;
 }
 
 void log_close(void)
 {
-	pthread_mutex_lock(&g_log_lock);
-	if(g_lf) { fclose(g_lf); }
-	pthread_mutex_unlock(&g_log_lock);
+	unsigned long overflows;
+
+	if(!atomic_load(&g_log_running)) { return; }
+
+	overflows = log_get_overflows();
+	if(overflows > 0) { log_add(WSLOG_WARN, "log ring overflowed %lu times", overflows); }
+
+	atomic_store(&g_log_running, 0);
+	atomic_store(&g_log_stop, 1);
+	sem_post(&g_log_sem);
+	pthread_join(g_writer_thr, NULL);
+
+#ifdef MINIZ_COMPRESSION
+	// Segments still waiting in the queue stay on disk uncompressed
+	if(g_squash_running) {
+		pthread_mutex_lock(&g_seg_lock);
+		g_squash_stop = 1;
+		pthread_cond_signal(&g_seg_cond);
+		pthread_mutex_unlock(&g_seg_lock);
+		pthread_join(g_squash_thr, NULL);
+		g_squash_running = 0;
+	}
+	while(g_seg_head) {
+		segment_t *seg = g_seg_head;
+		g_seg_head = seg->next;
+		free(seg->path);
+		free(seg);
+	}
+	g_seg_tail = NULL;
+#endif
+
+	close(g_lfd);
+	g_lfd = -1;
+	sem_destroy(&g_log_sem);
+	free(g_ring);
+	g_ring = NULL;
+	free(g_logpath);
+	g_logpath = NULL;
 }
 
+// The writer flushes with write() as it drains, so this only nudges it awake
 void log_flush(void)
 {
-	pthread_mutex_lock(&g_log_lock);
-	if(g_lf) { fflush(g_lf); }
-	pthread_mutex_unlock(&g_log_lock);
+	if(atomic_load(&g_log_running)) { wake_writer(); }
 }
@@ -30,9 +30,37 @@
 #define	WSLOG_DEBUG		5
 #define	WSLOG_DEBUG_STR	"DBG"
 
+// Sampled categories of high-volume INFO lines
+#define	WSLOG_CAT_GET	0
+#define	WSLOG_CAT_POST	1
+#define	WSLOG_CAT_CONN	2
+#define	WSLOG_CATS		3
+
+// Only evaluate the arguments and format the line if it will be emitted
+#define LOG_LEVEL(level, ...) \
+	do { if(log_enabled(level)) { log_add((level), __VA_ARGS__); } } while(0)
+#define LOG_SAMPLED(cat, level, ...) \
+	do { if(log_sampled((cat), (level))) { log_add((level), __VA_ARGS__); } } while(0)
+
+// What log_add() does when the ring is full
+#define	WSLOG_POLICY_DROP	1
+#define	WSLOG_POLICY_BLOCK	2
+
 void log_add(int, const char *, ...);
 int log_open(char *);
 void log_close(void);
 void log_flush(void);
+void log_set_policy(int);
+void log_set_rotation(long, long);
+void log_reopen(void);
+int log_enabled(int);
+int log_sampled(int, int);
+void log_set_level(int);
+int log_get_level(void);
+void log_more_verbose(void);
+void log_less_verbose(void);
+void log_set_sampling(int, unsigned long);
+int log_level_from_str(const char *);
+unsigned long log_get_overflows(void);
 
 #endif
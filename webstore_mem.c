@@ -0,0 +1,118 @@
+/*
+	webstore is a web-based arbitrary data storage service that accepts z85 encoded data
+	Copyright (C) 2021 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Watch redis memory and refuse uploads before SETs start failing with OOM
+// INFO memory is sampled on the scheduler thread, requests only read the result
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "webstore_ops.h"
+#include "webstore_log.h"
+
+#define MEM_HYSTERESIS (5)	// percent below the watermark before uploads are allowed again
+
+static int g_watermark = 0;
+static atomic_ulong g_used;
+static atomic_ulong g_max;
+static atomic_int g_pressure;
+static atomic_ulong g_refused;
+
+static unsigned long info_field(const char *info, const char *name)
+{
+	const char *p;
+	size_t len = strlen(name);
+
+	for(p = info; p; p = strchr(p, '\n')) {
+		if(*p == '\n') { p++; }
+		if((strncmp(p, name, len) == 0) && (p[len] == ':')) { return strtoul(p+len+1, NULL, 10); }
+	}
+	return 0;
+}
+
+static void set_pressure(int on)
+{
+	if(atomic_exchange(&g_pressure, on) == on) { return; }
+	if(on) { log_add(WSLOG_WARN, "redis memory above %d%%, refusing uploads", g_watermark); }
+	else { log_add(WSLOG_INFO, "redis memory below %d%%, accepting uploads", g_watermark - MEM_HYSTERESIS); }
+}
+
+void mem_set_watermark(int pct)
+{
+	g_watermark = pct;
+}
+
+// Scheduler job, arg is the webstore runtime
+void mem_job(void *arg)
+{
+	wsrt_t *rt = arg;
+	rai_t *rc = &rt->rc;
+	redisReply *reply;
+	unsigned long used, max;
+
+	rai_lock(rc);
+	if(!rai_ready(rc)) { rai_unlock(rc); return; }
+	reply = redisCommand(rc->c, "INFO memory");
+	if(!reply) {
+		handle_redis_error(rc);
+		rai_unlock(rc);
+		return;
+	}
+	rai_unlock(rc);
+
+	if(reply->type == REDIS_REPLY_STRING) {
+		used = info_field(reply->str, "used_memory");
+		max = info_field(reply->str, "maxmemory");
+		atomic_store(&g_used, used);
+		atomic_store(&g_max, max);
+
+		// Without maxmemory redis never refuses a write, neither do we
+		if(max == 0) { set_pressure(0); }
+		else if(used >= (max / 100) * g_watermark) { set_pressure(1); }
+		else if(used < (max / 100) * (g_watermark - MEM_HYSTERESIS)) { set_pressure(0); }
+	}
+	freeReplyObject(reply);
+}
+
+// A SET failed with OOM, don't wait for the next sample
+void mem_oom_seen(void)
+{
+	if(g_watermark > 0) { set_pressure(1); }
+}
+
+// searest admission callback: uploads are refused while redis is short on memory
+// mget only reads and mdel frees memory, their tokens come in a POST body
+int mem_admit(const char *url, int method, size_t len, void *sri_user_data)
+{
+	if((method != METHOD_POST) && (method != METHOD_PUT)) { return 0; }
+	if(strcmp(url, "/store/mget/") == 0) { return 0; }
+	if(strcmp(url, "/store/mdel/") == 0) { return 0; }
+	if(!atomic_load(&g_pressure)) { return 0; }
+	atomic_fetch_add(&g_refused, 1);
+	return MHD_HTTP_INSUFFICIENT_STORAGE;
+}
+
+void mem_get(unsigned long *used, unsigned long *max, int *pressure, unsigned long *refused)
+{
+	*used = atomic_load(&g_used);
+	*max = atomic_load(&g_max);
+	*pressure = atomic_load(&g_pressure);
+	*refused = atomic_load(&g_refused);
+}
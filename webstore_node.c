@@ -19,6 +19,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 //#include <unistd.h>
 #include <ctype.h>
 
@@ -51,7 +52,7 @@ static int is_Z85_digit(char digit)
 }
 
 // return FALSE if any character in ptr is not a valid z85 digit
-static int Z85_validate(const unsigned char *ptr, size_t len)
+int Z85_validate(const unsigned char *ptr, size_t len)
 {
 	size_t i;
 	for(i=0; i<len; i++) {
@@ -60,46 +61,325 @@ static int Z85_validate(const unsigned char *ptr, size_t len)
 	return 0;	// did not validate properly
 }
 
-// Validate proper hex digits in URL and convert to all lowercase
-// return strdup(newhash) if valid
-// return NULL if NOT VALID
-// this must be free()'d
-static char* convert_hash(char *input, int len)
-{
-	int i,j;
-	char newhash[256];
+// 0x80 marks anything that is not a hex digit
+static const unsigned char hexval[256] = {
+	[0 ... 255] = 0x80,
+	['0'] = 0, ['1'] = 1, ['2'] = 2, ['3'] = 3, ['4'] = 4,
+	['5'] = 5, ['6'] = 6, ['7'] = 7, ['8'] = 8, ['9'] = 9,
+	['a'] = 10, ['b'] = 11, ['c'] = 12, ['d'] = 13, ['e'] = 14, ['f'] = 15,
+	['A'] = 10, ['B'] = 11, ['C'] = 12, ['D'] = 13, ['E'] = 14, ['F'] = 15
+};
 
-	if(len > sizeof(newhash)-1) {
-		fprintf(stderr, "SOMETHING WENT HORRIBLY WRONG!\n");
-		exit(1);
+// Validate the token, lowercase it and decode it to bytes in a single branch-free pass
+// returns 0 if valid, -1 if NOT VALID
+int make_key(wsrt_t *rt, wsreq_t *req, wskey_t *k)
+{
+	static const char digits[] = "0123456789abcdef";
+	const unsigned char *in = (const unsigned char *)req->url;
+	unsigned char *raw = k->bin + 2;
+	unsigned char hi, lo, bad = 0;
+	int i, n = req->urllen / 2;
+
+	if((req->urllen > HASHLEN512) || (req->urllen & 1)) { return -1; }
+
+	for(i=0; i<n; i++) {
+		hi = hexval[in[2*i]];
+		lo = hexval[in[2*i+1]];
+		bad |= hi | lo;
+		raw[i] = (hi << 4) | (lo & 0x0F);
+		k->hex[2*i] = digits[hi & 0x0F];
+		k->hex[2*i+1] = digits[lo & 0x0F];
+	}
+	if(bad & 0x80) { return -1; }
+	k->hexlen = req->urllen;
+	k->hex[k->hexlen] = 0;
+
+	// The node prefix keeps digests of different algorithms apart from each other and from other keys
+	k->bin[0] = 'B';
+	k->bin[1] = '0' + req->type;
+
+	if(rt->binkeys) {
+		k->key = k->bin;
+		k->keylen = 2 + n;
+		k->field = raw;
+		k->fieldlen = n;
+	} else {
+		k->key = k->hex;
+		k->keylen = k->hexlen;
+		k->field = k->hex + rt->packprefix;
+		k->fieldlen = k->hexlen - rt->packprefix;
 	}
 
-	memset(&newhash[0], 0, sizeof(newhash));
-	for(i=0,j=0; i<len; i++,j++) {
-		if(!isxdigit(input[i])) { return NULL; }
-		newhash[j] = tolower(input[i]);
+	// Small objects may live in a hash instead of their own key:
+	// bucket P:<first packprefix hex digits of the token>, field <the token>
+	if(rt->packsize) { snprintf(k->bucket, sizeof(k->bucket), "P:%.*s", rt->packprefix, k->hex); }
+
+	return 0;
+}
+
+// Point k at the layout used before BINKEYS
+void hex_key(wsrt_t *rt, const wskey_t *k, wskey_t *hk)
+{
+	*hk = *k;
+	hk->key = hk->hex;
+	hk->keylen = hk->hexlen;
+	hk->field = hk->hex + rt->packprefix;
+	hk->fieldlen = hk->hexlen - rt->packprefix;
+}
+
+// Read and delete an object in one step, so that two instances never both deliver it with BAR
+// UNLINK frees the value in a background thread of redis, a large value never stalls it
+// KEYS: the string key then the hash bucket, ARGV: the field, 1 if packing is on
+#define BARSCRIPT \
+	"local v " \
+	"if ARGV[2] == '1' then " \
+	"v = redis.call('HGET', KEYS[2], ARGV[1]) " \
+	"if v then redis.call('HDEL', KEYS[2], ARGV[1]) return v end " \
+	"end " \
+	"v = redis.call('GET', KEYS[1]) " \
+	"if v then redis.call('UNLINK', KEYS[1]) end " \
+	"return v"
+
+// Read the replies to n pipelined commands, only the first one is returned
+// returns NULL on a connection error
+redisReply* pipeline_replies(rai_t *rc, int n)
+{
+	redisReply *first = NULL;
+	void *r;
+	int i;
+
+	for(i=0; i<n; i++) {
+		if(redisGetReply(rc->c, &r) != REDIS_OK) {
+			if(first) { freeReplyObject(first); }
+			return NULL;
+		}
+		if(i == 0) { first = r; }
+		else { freeReplyObject(r); }
 	}
-	newhash[len] = 0;
 
-	return strdup(newhash);
+	return first;
 }
 
-static inline void do_redis_del(rai_t *rc, char *hash)
+// Look k up in every layout it may be stored under, call with the lock held
+// returns 503 on a redis error
+static int fetch(wsrt_t *rt, const wskey_t *k, wsbuf_t **buf)
 {
-	redisReply *reply;
-	reply = redisCommand(rc->c, "DEL %s", hash);
+	void *hreply = NULL;
+	redisReply *reply = NULL, *hr;
+	rai_t *rc = &rt->rc;
+
+	if(rt->bar) {
+		reply = redisCommand(rc->c, "EVAL %s 2 %b %s %b %s", BARSCRIPT, k->key, k->keylen,
+			rt->packsize ? k->bucket : "", k->field, k->fieldlen, rt->packsize ? "1" : "0");
+		if(!reply) {
+			handle_redis_error(rc);
+			return 503;
+		}
+		if(reply->type == REDIS_REPLY_STRING) { *buf = wsbuf_new(reply->str, reply->len); }
+		freeReplyObject(reply);
+		return 0;
+	}
+
+	if(rt->packsize) {
+		// The size is unknown here, ask both layouts in one round trip
+		redisAppendCommand(rc->c, "HGET %s %b", k->bucket, k->field, k->fieldlen);
+		redisAppendCommand(rc->c, "GET %b", k->key, k->keylen);
+		if(redisGetReply(rc->c, &hreply) == REDIS_OK) { reply = pipeline_replies(rc, 1); }
+	} else {
+		reply = redisCommand(rc->c, "GET %b", k->key, k->keylen);
+	}
+
+	hr = hreply;
+	if(!reply) {
+		if(hreply) { freeReplyObject(hreply); }
+		handle_redis_error(rc);
+		return 503;
+	}
+
+	if(hr && (hr->type == REDIS_REPLY_STRING)) {
+		*buf = wsbuf_new(hr->str, hr->len);
+	} else if(reply->type == REDIS_REPLY_STRING) {
+		*buf = wsbuf_new(reply->str, reply->len);
+	}
+	if(hreply) { freeReplyObject(hreply); }
 	freeReplyObject(reply);
+
+	return 0;
 }
 
-static char* get(wsreq_t *req, wsrt_t *rt, srci_t *ri)
+// Fetch k into a new buffer, returns 503 on a redis error
+int do_redis_get(wsrt_t *rt, const wskey_t *k, wsbuf_t **buf)
+{
+	int err;
+	wskey_t hk;
+	rai_t *rc = &rt->rc;
+
+	*buf = NULL;
+
+	//LOCK RAI, the scheduler thread may be reconnecting even without multithreading
+	rai_lock(rc);
+	if(!rai_ready(rc)) { rai_unlock(rc); return 503; }
+	err = fetch(rt, k, buf);
+	if(!err && !*buf && (rt->binkeys == BINKEYS_MIGRATE)) {
+		// Not migrated yet
+		hex_key(rt, k, &hk);
+		err = fetch(rt, &hk, buf);
+	}
+	rai_unlock(rc);
+
+	// Values stored transcoded go back to Z85 outside the lock
+	if(*buf) {
+		*buf = codec_unpack(*buf);
+		if(!*buf) { err = 500; }
+	}
+
+	return err;
+}
+
+// Is k stored under any layout, call with the lock held
+// returns 1 if it is, 0 if not, 503 on a redis error
+static int exists(wsrt_t *rt, const wskey_t *k)
 {
-	int err = 0;
-	char *hash;
-	char *page = NULL;
-	char *log_fmt;
-	char log_entry[512];
 	redisReply *reply;
 	rai_t *rc = &rt->rc;
+	int n = 1, found = 0;
+
+	redisAppendCommand(rc->c, "EXISTS %b", k->key, k->keylen);
+	if(rt->packsize) {
+		redisAppendCommand(rc->c, "HEXISTS %s %b", k->bucket, k->field, k->fieldlen);
+		n++;
+	}
+
+	while(n--) {
+		if(redisGetReply(rc->c, (void **)&reply) != REDIS_OK) {
+			handle_redis_error(rc);
+			return 503;
+		}
+		if((reply->type == REDIS_REPLY_INTEGER) && (reply->integer > 0)) { found = 1; }
+		freeReplyObject(reply);
+	}
+
+	return found;
+}
+
+static int do_redis_exists(wsrt_t *rt, const wskey_t *k)
+{
+	int z;
+	wskey_t hk;
+	rai_t *rc = &rt->rc;
+
+	rai_lock(rc);
+	if(!rai_ready(rc)) { rai_unlock(rc); return 503; }
+	z = exists(rt, k);
+	if((z == 0) && (rt->binkeys == BINKEYS_MIGRATE)) {
+		hex_key(rt, k, &hk);
+		z = exists(rt, &hk);
+	}
+	rai_unlock(rc);
+
+	return z;
+}
+
+// Only an immutable object that never expires can be cached by clients forever
+#define CACHEABLE(rt) ((rt)->immutable && !(rt)->expiration && !(rt)->bar)
+#define CACHECONTROL "public, max-age=31536000, immutable"
+
+// The token is the content hash, the encoding is part of the tag because the bytes differ
+static void set_etag(srci_t *ri, const wskey_t *k, int enc)
+{
+	char etag[HASHLEN512+16];
+
+	if(enc == ZENC_GZIP) { snprintf(etag, sizeof(etag), "\"%s-gzip\"", k->hex); }
+	else if(enc == ZENC_DEFLATE) { snprintf(etag, sizeof(etag), "\"%s-deflate\"", k->hex); }
+	else { snprintf(etag, sizeof(etag), "\"%s\"", k->hex); }
+	srci_add_response_header(ri, "ETag", etag);
+	srci_add_response_header(ri, "Cache-Control", CACHECONTROL);
+}
+
+// Which representation of token hex does an If-None-Match or If-Range list name
+// prefers enc when several are listed, returns -1 if none is
+static int etag_match(const char *inm, const char *hex, int hexlen, int enc)
+{
+	const char *p, *s;
+	int v, found = -1;
+
+	if(!inm) { return -1; }
+	if(strchr(inm, '*')) { return enc; }
+	for(p = strchr(inm, '"'); p; p = strchr(p+1, '"')) {
+		if(strncasecmp(p+1, hex, hexlen) != 0) { continue; }
+		s = p + hexlen + 1;
+		if(*s == '"') { v = ZENC_NONE; }
+		else if(strncmp(s, "-gzip\"", 6) == 0) { v = ZENC_GZIP; }
+		else if(strncmp(s, "-deflate\"", 9) == 0) { v = ZENC_DEFLATE; }
+		else { continue; }
+		if(v == enc) { return v; }
+		if(found < 0) { found = v; }
+	}
+	return found;
+}
+
+// Answer a Range request, returns NULL if the whole object should be served instead
+static char* get_range(wsreq_t *req, wsrt_t *rt, srci_t *ri, const wskey_t *k, const char *range)
+{
+	const char *ifrange;
+	char cr[96];
+	long first = 0, last = 0, total = 0;
+	wsbuf_t *buf;
+	int z;
+
+	// Burning the object on a partial read would lose the rest of it
+	if(rt->bar) { return NULL; }
+
+	// Only our own strong validator can vouch that the client holds the same object
+	ifrange = srci_get_request_header(ri, "If-Range");
+	if(ifrange && (!CACHEABLE(rt) || (etag_match(ifrange, k->hex, k->hexlen, ZENC_NONE) != ZENC_NONE))) { return NULL; }
+
+	z = do_redis_getrange(rt, k, range, &buf, &first, &last, &total);
+	switch(z) {
+		case 200:
+			return NULL;
+		case 206:
+			break;
+		case 404:
+			srci_set_return_code(ri, MHD_HTTP_NOT_FOUND);
+			LOG_LEVEL(WSLOG_INFO, "%s %d GET %s", srci_get_client_ip(ri), MHD_HTTP_NOT_FOUND, req->url);
+			return strdup("not found");
+		case 416:
+			snprintf(cr, sizeof(cr), "bytes */%ld", total);
+			srci_add_response_header(ri, "Content-Range", cr);
+			srci_set_return_code(ri, MHD_HTTP_RANGE_NOT_SATISFIABLE);
+			return strdup("range not satisfiable");
+		case 503:
+			srci_set_return_code(ri, MHD_HTTP_SERVICE_UNAVAILABLE);
+			return strdup("service unavailable");
+		default:
+			srci_set_return_code(ri, MHD_HTTP_INTERNAL_SERVER_ERROR);
+			log_add(WSLOG_ERR, "%s %d GET %s undecodable value", srci_get_client_ip(ri), MHD_HTTP_INTERNAL_SERVER_ERROR, req->url);
+			return strdup("internal server error");
+	}
+
+	snprintf(cr, sizeof(cr), "bytes %ld-%ld/%ld", first, last, total);
+	srci_add_response_header(ri, "Content-Range", cr);
+	if(CACHEABLE(rt)) { set_etag(ri, k, ZENC_NONE); }
+
+	srci_set_return_code(ri, MHD_HTTP_PARTIAL_CONTENT);
+	srci_set_return_shared(ri, buf->len, wsbuf_release, buf);
+	LOG_SAMPLED(WSLOG_CAT_GET, WSLOG_INFO, "%s %d GET %s %s", srci_get_client_ip(ri), MHD_HTTP_PARTIAL_CONTENT, req->url, cr);
+	return buf->data;
+}
+
+static char* get(wsreq_t *req, wsrt_t *rt, srci_t *ri)
+{
+	int enc = ZENC_NONE, err = 0, leader = 0, queued = 0, tag;
+	wskey_t k;
+	wsbuf_t *buf = NULL, *zbuf;
+	wsflight_t *f = NULL;
+	const char *range;
+	char *page;
+	void *w = NULL;
+	long until = 0;
+
+	if(rt->cors) { srci_set_response_cors(ri); }
 
 	// Check the URL length
 	if(req->urllen != req->hashlen) {
@@ -107,91 +387,379 @@ static char* get(wsreq_t *req, wsrt_t *rt, srci_t *ri)
 		return strdup("malformed request");
 	}
 
-	hash = convert_hash(req->url, req->urllen);
-	if(!hash) {
+	if(make_key(rt, req, &k)) {
 		srci_set_return_code(ri, MHD_HTTP_BAD_REQUEST);
 		return strdup("malformed request");
 	}
 
-	//LOCK RAI if redis calls are in their own thread, using a shared context
-	if(rt->multithreaded) { rai_lock(rc); }
-	reply = redisCommand(rc->c, "GET %s", hash);
-	if(!reply) {
-		err = 503;
-		handle_redis_error(rc);
-	} else {
-		if(reply->type == REDIS_REPLY_STRING) { page = strdup(reply->str); }
-		if(page && rt->bar) { do_redis_del(rc, hash); }
-		freeReplyObject(reply);
+	// Writes still in the write-behind queue are served from it
+	buf = wb_get(k.hex);
+	if(buf) {
+		queued = 1;
+		buf = codec_unpack(buf);
+		if(!buf) { err = 500; }
+	}
+
+	// The representation depends on Accept-Encoding, every answer that names one says Vary
+	// (added where the answer is made, a parked request runs this again)
+	if(zc_enabled()) { enc = zc_negotiate(srci_get_request_header(ri, HDRAESTR)); }
+
+	// A client that already holds the object only needs to know it is still there
+	// The 304 carries the tag of the representation the client holds
+	tag = CACHEABLE(rt) ? etag_match(srci_get_request_header(ri, "If-None-Match"), k.hex, k.hexlen, enc) : -1;
+	if(tag >= 0) {
+		err = queued ? (buf ? 1 : 500) : do_redis_exists(rt, &k);
+		if(err == 503) {
+			srci_set_return_code(ri, MHD_HTTP_SERVICE_UNAVAILABLE);
+			return strdup("service unavailable");
+		}
+		if(err == 1) {
+			if(zc_enabled()) { srci_add_response_header(ri, "Vary", HDRAESTR); }
+			set_etag(ri, &k, tag);
+			srci_set_return_code(ri, MHD_HTTP_NOT_MODIFIED);
+			LOG_LEVEL(WSLOG_INFO, "%s %d GET %s", srci_get_client_ip(ri), MHD_HTTP_NOT_MODIFIED, req->url);
+			wsbuf_release(buf);
+			return strdup("");
+		}
+	}
+
+	// A queued value is not in redis yet, it is served whole
+	range = srci_get_request_header(ri, "Range");
+	if(range && !queued) {
+		page = get_range(req, rt, ri, &k, range);
+		if(page) { return page; }
+	}
+
+	if(!queued) {
+		// The client may rather wait for the token than hear it is not there, see webstore_wait.c
+		w = wait_begin(ri, k.hex, &until);
+
+		// Concurrent GETs for the same token share one fetch and one buffer
+		// unless every read has to burn the object
+		if(rt->multithreaded && !rt->bar) { f = flight_join(FLIGHT_GET, k.hex, NULL, 0, &leader); }
+		if(f && !leader) {
+			err = flight_wait(f, &buf);
+		} else {
+			err = do_redis_get(rt, &k, &buf);
+			if(f) { flight_finish(f, err, buf); }
+		}
+
+		if(w && !buf && !err) {
+			srci_park(ri, until, w);
+			return NULL;
+		}
+		wait_cancel(w);
 	}
-	if(rt->multithreaded) { rai_unlock(rc); }
-	free(hash);
 
 	if(err == 503) {
 		srci_set_return_code(ri, MHD_HTTP_SERVICE_UNAVAILABLE);
 		return strdup("service unavailable");
 	}
 
-	if(!page) {
+	if(err == 500) {
+		srci_set_return_code(ri, MHD_HTTP_INTERNAL_SERVER_ERROR);
+		log_add(WSLOG_ERR, "%s %d GET %s undecodable value", srci_get_client_ip(ri), MHD_HTTP_INTERNAL_SERVER_ERROR, req->url);
+		return strdup("internal server error");
+	}
+
+	if(!buf) {
 		srci_set_return_code(ri, MHD_HTTP_NOT_FOUND);
-		log_add(WSLOG_INFO, "%s %d GET %s", srci_get_client_ip(ri), MHD_HTTP_NOT_FOUND, req->url);
+		LOG_LEVEL(WSLOG_INFO, "%s %d GET %s", srci_get_client_ip(ri), MHD_HTTP_NOT_FOUND, req->url);
 		return strdup("not found");
 	}
 
+	// Large bodies go out compressed when the client takes it, burnt objects are not worth caching
+	if(zc_enabled()) { srci_add_response_header(ri, "Vary", HDRAESTR); }
+	if(enc != ZENC_NONE) {
+		zbuf = zc_get(k.hex, enc, buf, !rt->bar);
+		if(zbuf) {
+			wsbuf_release(buf);
+			buf = zbuf;
+			srci_add_response_header(ri, "Content-Encoding", (enc == ZENC_GZIP) ? "gzip" : "deflate");
+		} else {
+			enc = ZENC_NONE;
+		}
+	}
+	if(CACHEABLE(rt)) { set_etag(ri, &k, enc); }
+	if(!rt->bar) { srci_add_response_header(ri, "Accept-Ranges", "bytes"); }
+
 	srci_set_return_code(ri, MHD_HTTP_OK);
-	if(rt->bar) { log_fmt = "%s %d GET %s BURNT"; }
-	else { log_fmt = "%s %d GET %s"; }
-	snprintf(log_entry, sizeof(log_entry), log_fmt, srci_get_client_ip(ri), MHD_HTTP_OK, req->url);
-	log_add(WSLOG_INFO, "%s", log_entry);
-	return page;
+	srci_set_return_shared(ri, buf->len, wsbuf_release, buf);
+	LOG_SAMPLED(WSLOG_CAT_GET, WSLOG_INFO, "%s %d GET %s%s", srci_get_client_ip(ri), MHD_HTTP_OK, req->url, (rt->bar ? " BURNT" : ""));
+	return buf->data;
 }
 
-static int do_redis_post(wsrt_t *rt, const char *hash, const unsigned char *dataptr, size_t datalen)
+// Length and TTL of k without reading the value (a packed value is never larger than PACKSIZE)
+// call with the lock held, returns 1 if found, 0 if not, 503 on a redis error
+static int stat_key(wsrt_t *rt, const wskey_t *k, long *len, long *ttl)
 {
-	int err = 500;
-	char *datastr;
-	redisReply *reply;
+	redisReply *r[4] = { NULL };
+	rai_t *rc = &rt->rc;
+	int i, n = 3, found = 0;
+
+	redisAppendCommand(rc->c, "GETRANGE %b 0 %d", k->key, k->keylen, CODEC_HDRLEN-1);
+	redisAppendCommand(rc->c, "STRLEN %b", k->key, k->keylen);
+	redisAppendCommand(rc->c, "TTL %b", k->key, k->keylen);
+	if(rt->packsize) {
+		redisAppendCommand(rc->c, "HGET %s %b", k->bucket, k->field, k->fieldlen);
+		n++;
+	}
+
+	for(i=0; i<n; i++) {
+		if(redisGetReply(rc->c, (void **)&r[i]) != REDIS_OK) {
+			while(i--) { freeReplyObject(r[i]); }
+			handle_redis_error(rc);
+			return 503;
+		}
+	}
+
+	if(r[3] && (r[3]->type == REDIS_REPLY_STRING)) {
+		*len = codec_text_len((unsigned char *)r[3]->str, r[3]->len, r[3]->len);
+		*ttl = -1;
+		found = 1;
+	} else if((r[0]->type == REDIS_REPLY_STRING) && (r[1]->type == REDIS_REPLY_INTEGER) && (r[1]->integer > 0)) {
+		*len = codec_text_len((unsigned char *)r[0]->str, r[0]->len, r[1]->integer);
+		*ttl = (r[2]->type == REDIS_REPLY_INTEGER) ? r[2]->integer : -1;
+		found = 1;
+	}
+
+	for(i=0; i<n; i++) { freeReplyObject(r[i]); }
+	return found;
+}
+
+// HEAD: Content-Length and TTL of the object, the value itself is never read
+static char* head(wsreq_t *req, wsrt_t *rt, srci_t *ri)
+{
+	int z, enc = ZENC_NONE;
+	size_t zlen = 0;
+	long len = 0, ttl = -1;
+	char ttlstr[32];
+	wskey_t k, hk;
+	wsbuf_t *buf;
 	rai_t *rc = &rt->rc;
 
-	//Turn our uploaded data into a string with a finalizing NULL
-	datastr = calloc(1, datalen+1);
-	memcpy(datastr, dataptr, datalen);
+	if(rt->cors) { srci_set_response_cors(ri); }
+
+	// Check the URL length
+	if(req->urllen != req->hashlen) {
+		srci_set_return_code(ri, MHD_HTTP_BAD_REQUEST);
+		return strdup("malformed request");
+	}
+
+	if(make_key(rt, req, &k)) {
+		srci_set_return_code(ri, MHD_HTTP_BAD_REQUEST);
+		return strdup("malformed request");
+	}
+
+	// A queued write gets the full EXPIRATION once it reaches redis
+	buf = wb_get(k.hex);
+	if(buf) {
+		len = codec_text_len((unsigned char *)buf->data, buf->len, buf->len);
+		if(rt->expiration) { ttl = rt->expiration; }
+		wsbuf_release(buf);
+		z = 1;
+	} else {
+		rai_lock(rc);
+		if(!rai_ready(rc)) { rai_unlock(rc); z = 503; }
+		else {
+			z = stat_key(rt, &k, &len, &ttl);
+			if((z == 0) && (rt->binkeys == BINKEYS_MIGRATE)) {
+				hex_key(rt, &k, &hk);
+				z = stat_key(rt, &hk, &len, &ttl);
+			}
+			rai_unlock(rc);
+		}
+	}
+
+	if(z == 503) {
+		srci_set_return_code(ri, MHD_HTTP_SERVICE_UNAVAILABLE);
+		return strdup("service unavailable");
+	}
+
+	if(z == 0) {
+		srci_set_return_code(ri, MHD_HTTP_NOT_FOUND);
+		return strdup("not found");
+	}
+
+	if(len < 0) {
+		srci_set_return_code(ri, MHD_HTTP_INTERNAL_SERVER_ERROR);
+		log_add(WSLOG_ERR, "%s %d HEAD %s undecodable value", srci_get_client_ip(ri), MHD_HTTP_INTERNAL_SERVER_ERROR, req->url);
+		return strdup("internal server error");
+	}
+
+	// The same representation headers a GET would send, when the compressed length is cached
+	// Otherwise the identity representation is described, finding out would mean reading the value
+	if(zc_enabled()) {
+		srci_add_response_header(ri, "Vary", HDRAESTR);
+		enc = zc_negotiate(srci_get_request_header(ri, HDRAESTR));
+		if(zc_peek(k.hex, enc, len, &zlen) == 1) {
+			srci_add_response_header(ri, "Content-Encoding", (enc == ZENC_GZIP) ? "gzip" : "deflate");
+			len = zlen;
+		} else {
+			enc = ZENC_NONE;
+		}
+	}
 
-	//LOCK RAI if redis calls are in their own thread, using a shared context
-	if(rt->multithreaded) { rai_lock(rc); }
-	if((rt->expiration) && (rt->immutable)) {
-		reply = redisCommand(rc->c, "SET %s %s EX %ld NX", hash, datastr, rt->expiration);
+	// -1: the object never expires
+	snprintf(ttlstr, sizeof(ttlstr), "%ld", ttl);
+	srci_add_response_header(ri, "X-TTL", ttlstr);
+	if(CACHEABLE(rt)) { set_etag(ri, &k, enc); }
+	if(!rt->bar) { srci_add_response_header(ri, "Accept-Ranges", "bytes"); }
+
+	srci_set_return_code(ri, MHD_HTTP_OK);
+	srci_set_return_head(ri, len);
+	return strdup("");
+}
+
+// Store an immutable object only if no layout holds it yet, answers 1 when written and 0 when it exists
+// KEYS: the string key then the hash bucket of each layout (binary first, hex while migrating)
+// ARGV: the value, H to pack it or the expiration in seconds (0 for none), 1 if packing is on, the field of each layout
+#define NXSCRIPT \
+	"local j = 3 " \
+	"for i = 1, #KEYS, 2 do " \
+	"j = j + 1 " \
+	"if redis.call('EXISTS', KEYS[i]) == 1 then return 0 end " \
+	"if ARGV[3] == '1' and redis.call('HEXISTS', KEYS[i+1], ARGV[j]) == 1 then return 0 end " \
+	"end " \
+	"if ARGV[2] == 'H' then redis.call('HSET', KEYS[2], ARGV[4], ARGV[1]) " \
+	"elseif ARGV[2] == '0' then redis.call('SET', KEYS[1], ARGV[1]) " \
+	"else redis.call('SET', KEYS[1], ARGV[1], 'EX', ARGV[2]) end " \
+	"return 1"
+
+// Queue the commands that store one object, call with the lock held
+// returns the number of replies to read, the first one is the one that matters
+int post_append(wsrt_t *rt, const wskey_t *k, const unsigned char *dataptr, size_t datalen, int *pack)
+{
+	int n = 1;
+	wskey_t hk;
+	char mode[24];
+	const char *bucket = rt->packsize ? k->bucket : "";
+	const char *packing = rt->packsize ? "1" : "0";
+	rai_t *rc = &rt->rc;
+
+	*pack = 0;
+	if(rt->immutable && (rt->packsize || (rt->binkeys == BINKEYS_MIGRATE))) {
+		// The object may already be under another layout, HSETNX or SET NX alone would store it twice
+		*pack = rt->packsize && (datalen < rt->packsize);
+		if(*pack) { snprintf(mode, sizeof(mode), "H"); }
+		else { snprintf(mode, sizeof(mode), "%ld", rt->expiration); }
+		if(rt->binkeys == BINKEYS_MIGRATE) {
+			hex_key(rt, k, &hk);
+			redisAppendCommand(rc->c, "EVAL %s 4 %b %s %b %s %b %s %s %b %b", NXSCRIPT, k->key, k->keylen, bucket,
+				hk.key, hk.keylen, bucket, dataptr, datalen, mode, packing, k->field, k->fieldlen, hk.field, hk.fieldlen);
+		} else {
+			redisAppendCommand(rc->c, "EVAL %s 2 %b %s %b %s %s %b", NXSCRIPT, k->key, k->keylen, bucket,
+				dataptr, datalen, mode, packing, k->field, k->fieldlen);
+		}
+	} else if(rt->packsize && (datalen < rt->packsize)) {
+		// Pack it, and drop any copy stored under the other layout
+		*pack = 1;
+		redisAppendCommand(rc->c, "HSET %s %b %b", k->bucket, k->field, k->fieldlen, dataptr, datalen);
+		redisAppendCommand(rc->c, "DEL %b", k->key, k->keylen);
+		n++;
+	} else if(rt->packsize) {
+		redisAppendCommand(rc->c, "SET %b %b", k->key, k->keylen, dataptr, datalen);
+		redisAppendCommand(rc->c, "HDEL %s %b", k->bucket, k->field, k->fieldlen);
+		n++;
+	} else if((rt->expiration) && (rt->immutable)) {
+		redisAppendCommand(rc->c, "SET %b %b EX %ld NX", k->key, k->keylen, dataptr, datalen, rt->expiration);
 	} else if(rt->expiration) {
-		reply = redisCommand(rc->c, "SET %s %s EX %ld", hash, datastr, rt->expiration);
+		redisAppendCommand(rc->c, "SET %b %b EX %ld", k->key, k->keylen, dataptr, datalen, rt->expiration);
 	} else if(rt->immutable) {
-		reply = redisCommand(rc->c, "SET %s %s NX", hash, datastr);
+		redisAppendCommand(rc->c, "SET %b %b NX", k->key, k->keylen, dataptr, datalen);
 	} else {
-		reply = redisCommand(rc->c, "SET %s %s", hash, datastr);
+		redisAppendCommand(rc->c, "SET %b %b", k->key, k->keylen, dataptr, datalen);
 	}
 
+	// While migrating, the new write replaces the copy under the old hex layout
+	if((rt->binkeys == BINKEYS_MIGRATE) && !rt->immutable) {
+		hex_key(rt, k, &hk);
+		redisAppendCommand(rc->c, "DEL %b", hk.key, hk.keylen);
+		n++;
+		if(rt->packsize) {
+			redisAppendCommand(rc->c, "HDEL %s %b", hk.bucket, hk.field, hk.fieldlen);
+			n++;
+		}
+	}
+
+	return n;
+}
+
+// Map the first reply of post_append() to 0 or an HTTP error
+int post_result(wsrt_t *rt, redisReply *reply, int pack)
+{
+	int err = 500;
+
+	if(reply->type == REDIS_REPLY_ERROR) {
+		err = 417;
+		if(strncmp("OOM", reply->str, 3) == 0) { err = 507; mem_oom_seen(); }
+	}
+	if(reply->type == REDIS_REPLY_NIL) { err = 304; }
+	if((pack || rt->immutable) && (reply->type == REDIS_REPLY_INTEGER)) {
+		// NXSCRIPT answers 0 when the object exists, HSET when the field was overwritten
+		if(rt->immutable && (reply->integer == 0)) { err = 304; }
+		else { err = 0; }
+	}
+	if(reply->type == REDIS_REPLY_STATUS) {
+		if(strncmp("OK", reply->str, 2) == 0) { err = 0; }
+	}
+
+	return err;
+}
+
+static int do_redis_post(wsrt_t *rt, const wskey_t *k, const unsigned char *dataptr, size_t datalen)
+{
+	int err, n, pack;
+	redisReply *reply;
+	rai_t *rc = &rt->rc;
+
+	//LOCK RAI, the scheduler thread may be reconnecting even without multithreading
+	rai_lock(rc);
+	if(!rai_ready(rc)) { rai_unlock(rc); return 503; }
+
+	n = post_append(rt, k, dataptr, datalen, &pack);
+	reply = pipeline_replies(rc, n);
 	if(!reply) {
 		err = 503;
 		handle_redis_error(rc);
 	} else {
-		if(reply->type == REDIS_REPLY_ERROR) { err = 417; }
-		if(reply->type == REDIS_REPLY_NIL) { err = 304; }
-		if(reply->type == REDIS_REPLY_STATUS) {
-			if(strncmp("OK", reply->str, 2) == 0) { err = 0; }
-		}
+		err = post_result(rt, reply, pack);
 		freeReplyObject(reply);
 	}
-	if(rt->multithreaded) { rai_unlock(rc); }
+	rai_unlock(rc);
 
-	free(datastr);
 	return err;
 }
 
+// Identical concurrent POSTs for the same token wait for the first write instead of repeating it
+static int post_shared(wsrt_t *rt, const wskey_t *k, const unsigned char *dataptr, size_t datalen)
+{
+	int z, leader = 0;
+	wsflight_t *f = NULL;
+
+	if(rt->multithreaded) { f = flight_join(FLIGHT_POST, k->hex, dataptr, datalen, &leader); }
+	if(!f) { return do_redis_post(rt, k, dataptr, datalen); }
+
+	if(leader) {
+		z = do_redis_post(rt, k, dataptr, datalen);
+		flight_finish(f, z, NULL);
+		return z;
+	}
+
+	z = flight_wait(f, NULL);
+	if(rt->immutable && (z == 0)) { z = 304; }	// the leader's SET NX won, ours would have been refused
+	return z;
+}
+
 static char* post(wsreq_t *req, wsrt_t *rt, srci_t *ri)
 {
-	int z;
+	int z, code = MHD_HTTP_OK;
 	const unsigned char *dataptr;
 	size_t datalen;
-	char *hash;
+	wskey_t k;
+	wsbuf_t *packed = NULL, *qbuf;
+
+	if(rt->cors) { srci_set_response_cors(ri); }
 
 	// Check the URL length
 	if(req->urllen != req->hashlen) {
@@ -218,24 +786,44 @@ static char* post(wsreq_t *req, wsrt_t *rt, srci_t *ri)
 	//printf("%lu) %s\n", datalen, dataptr);
 #endif
 
-	hash = convert_hash(req->url, req->urllen);
-	if(!hash) {
+	if(make_key(rt, req, &k)) {
 		srci_set_return_code(ri, MHD_HTTP_BAD_REQUEST);
 		return strdup("malformed request - invalid token");
 	}
 
-	z = do_redis_post(rt, hash, dataptr, datalen);
-	free(hash);
+	// Large uploads write on the bulk lane's own connection
+	rt = lane_rt(rt, ri);
+
+	// Store the decoded bytes instead of the text, when the text allows it
+	if(rt->store) { packed = codec_pack(rt->store, dataptr, datalen); }
+	if(packed) {
+		dataptr = (const unsigned char *)packed->data;
+		datalen = packed->len;
+	}
+
+	// Write-behind: answer as soon as the value is queued, see webstore_wb.c
+	z = -1;
+	if(wb_enabled()) {
+		qbuf = packed ? packed : wsbuf_new((const char *)dataptr, datalen);
+		if(qbuf) { z = wb_put(&k, req->type, qbuf); }
+		if(qbuf != packed) { wsbuf_release(qbuf); }
+		if(z == 0) { code = MHD_HTTP_ACCEPTED; }
+	}
+	if(z == -1) { z = post_shared(rt, &k, dataptr, datalen); }
+	wsbuf_release(packed);
 	if(z) {
 		srci_set_return_code(ri, z);
 		switch(z) {
 			case 304:
-				log_add(WSLOG_INFO, "%s %d POST %s NOTMOD", srci_get_client_ip(ri), z, req->url);
+				LOG_LEVEL(WSLOG_INFO, "%s %d POST %s NOTMOD", srci_get_client_ip(ri), z, req->url);
 				return strdup("object immutable - not modified");
 				break;
 			case 417:
 				return strdup("redis reply error");
 				break;
+			case 507:
+				return strdup("insufficient storage");
+				break;
 			case 503:
 				return strdup("service unavailable");
 				break;
@@ -244,8 +832,131 @@ static char* post(wsreq_t *req, wsrt_t *rt, srci_t *ri)
 		}
 	}
 
+	if(!rt->immutable) { zc_invalidate(k.hex); }
+	wait_notify(k.hex);
+	srci_set_return_code(ri, code);
+	LOG_SAMPLED(WSLOG_CAT_POST, WSLOG_INFO, "%s %d POST %s", srci_get_client_ip(ri), code, req->url);
+	return strdup((code == MHD_HTTP_ACCEPTED) ? "accepted" : "ok");
+}
+
+// CORS preflight, browsers may reuse the answer for cors_maxage seconds
+static char* options(wsreq_t *req, wsrt_t *rt, srci_t *ri)
+{
+	char maxage[32];
+	const char *hdrs;
+
+	srci_set_response_allow(ri, "GET, HEAD, POST, DELETE, OPTIONS");
+	if(rt->cors) {
+		srci_set_response_cors(ri);
+		srci_add_response_header(ri, "Access-Control-Allow-Methods", "GET, HEAD, POST, DELETE, OPTIONS");
+		hdrs = srci_get_request_header(ri, "Access-Control-Request-Headers");
+		if(hdrs) { srci_add_response_header(ri, "Access-Control-Allow-Headers", hdrs); }
+		snprintf(maxage, sizeof(maxage), "%ld", rt->cors_maxage);
+		srci_add_response_header(ri, "Access-Control-Max-Age", maxage);
+	}
+	srci_set_return_code(ri, MHD_HTTP_NO_CONTENT);
+	return strdup("");
+}
+
+// Queue the commands that drop k from every layout, call with the lock held
+// returns the number of replies to read with del_replies()
+int del_append(wsrt_t *rt, const wskey_t *k)
+{
+	int n = 1;
+	wskey_t hk;
+	rai_t *rc = &rt->rc;
+
+	redisAppendCommand(rc->c, "UNLINK %b", k->key, k->keylen);
+	if(rt->packsize) {
+		redisAppendCommand(rc->c, "HDEL %s %b", k->bucket, k->field, k->fieldlen);
+		n++;
+	}
+
+	if(rt->binkeys == BINKEYS_MIGRATE) {
+		hex_key(rt, k, &hk);
+		redisAppendCommand(rc->c, "UNLINK %b", hk.key, hk.keylen);
+		n++;
+		if(rt->packsize) {
+			redisAppendCommand(rc->c, "HDEL %s %b", hk.bucket, hk.field, hk.fieldlen);
+			n++;
+		}
+	}
+
+	return n;
+}
+
+// Read the n replies of del_append()
+// returns 0 if something was deleted, 404 if nothing was there, 417 on a reply error, 503 on a connection error
+int del_replies(wsrt_t *rt, int n)
+{
+	int i, err = 404;
+	redisReply *reply;
+	rai_t *rc = &rt->rc;
+
+	for(i=0; i<n; i++) {
+		if(redisGetReply(rc->c, (void **)&reply) != REDIS_OK) { return 503; }
+		if(reply->type == REDIS_REPLY_ERROR) { err = 417; }
+		if((err == 404) && (reply->type == REDIS_REPLY_INTEGER) && (reply->integer > 0)) { err = 0; }
+		freeReplyObject(reply);
+	}
+
+	return err;
+}
+
+static int do_redis_delete(wsrt_t *rt, const wskey_t *k)
+{
+	int err;
+	rai_t *rc = &rt->rc;
+
+	//LOCK RAI, the scheduler thread may be reconnecting even without multithreading
+	rai_lock(rc);
+	if(!rai_ready(rc)) { rai_unlock(rc); return 503; }
+	err = del_replies(rt, del_append(rt, k));
+	if(err == 503) { handle_redis_error(rc); }
+	rai_unlock(rc);
+
+	return err;
+}
+
+static char* del(wsreq_t *req, wsrt_t *rt, srci_t *ri)
+{
+	int z, dropped;
+	wskey_t k;
+
+	if(rt->cors) { srci_set_response_cors(ri); }
+
+	// Check the URL length
+	if(req->urllen != req->hashlen) {
+		srci_set_return_code(ri, MHD_HTTP_BAD_REQUEST);
+		return strdup("malformed request - invalid url");
+	}
+
+	if(make_key(rt, req, &k)) {
+		srci_set_return_code(ri, MHD_HTTP_BAD_REQUEST);
+		return strdup("malformed request - invalid token");
+	}
+
+	dropped = wb_drop(k.hex);
+	z = do_redis_delete(rt, &k);
+	if((z == 404) && dropped) { z = 0; }
+	switch(z) {
+		case 0:
+			break;
+		case 404:
+			srci_set_return_code(ri, MHD_HTTP_NOT_FOUND);
+			LOG_LEVEL(WSLOG_INFO, "%s %d DELETE %s", srci_get_client_ip(ri), MHD_HTTP_NOT_FOUND, req->url);
+			return strdup("not found");
+		case 417:
+			srci_set_return_code(ri, z);
+			return strdup("redis reply error");
+		default:
+			srci_set_return_code(ri, MHD_HTTP_SERVICE_UNAVAILABLE);
+			return strdup("service unavailable");
+	}
+
+	zc_invalidate(k.hex);
 	srci_set_return_code(ri, MHD_HTTP_OK);
-	log_add(WSLOG_INFO, "%s %d POST %s", srci_get_client_ip(ri), MHD_HTTP_OK, req->url);
+	LOG_SAMPLED(WSLOG_CAT_POST, WSLOG_INFO, "%s %d DELETE %s", srci_get_client_ip(ri), MHD_HTTP_OK, req->url);
 	return strdup("ok");
 }
 
@@ -276,8 +987,15 @@ char* node128(char *url, int urllen, srci_t *ri, void *sri_user_data, void *node
 		case METHOD_POST:
 			page = post(&req, rt, ri);
 			break;
-		/*case METHOD_DEL:
-			break;*/
+		case METHOD_HEAD:
+			page = head(&req, rt, ri);
+			break;
+		case METHOD_OPT:
+			page = options(&req, rt, ri);
+			break;
+		case METHOD_DEL:
+			page = del(&req, rt, ri);
+			break;
 		default:
 			srci_set_return_code(ri, MHD_HTTP_METHOD_NOT_ALLOWED);
 			log_add(WSLOG_WARN, "%s %d METHOD_NOT_ALLOWED", srci_get_client_ip(ri), ri->return_code);
@@ -309,8 +1027,15 @@ char* node160(char *url, int urllen, srci_t *ri, void *sri_user_data, void *node
 		case METHOD_POST:
 			page = post(&req, rt, ri);
 			break;
-		/*case METHOD_DEL:
-			break;*/
+		case METHOD_HEAD:
+			page = head(&req, rt, ri);
+			break;
+		case METHOD_OPT:
+			page = options(&req, rt, ri);
+			break;
+		case METHOD_DEL:
+			page = del(&req, rt, ri);
+			break;
 		default:
 			srci_set_return_code(ri, MHD_HTTP_METHOD_NOT_ALLOWED);
 			log_add(WSLOG_WARN, "%s %d METHOD_NOT_ALLOWED", srci_get_client_ip(ri), ri->return_code);
@@ -342,8 +1067,15 @@ char* node224(char *url, int urllen, srci_t *ri, void *sri_user_data, void *node
 		case METHOD_POST:
 			page = post(&req, rt, ri);
 			break;
-		/*case METHOD_DEL:
-			break;*/
+		case METHOD_HEAD:
+			page = head(&req, rt, ri);
+			break;
+		case METHOD_OPT:
+			page = options(&req, rt, ri);
+			break;
+		case METHOD_DEL:
+			page = del(&req, rt, ri);
+			break;
 		default:
 			srci_set_return_code(ri, MHD_HTTP_METHOD_NOT_ALLOWED);
 			log_add(WSLOG_WARN, "%s %d METHOD_NOT_ALLOWED", srci_get_client_ip(ri), ri->return_code);
@@ -375,8 +1107,15 @@ char* node256(char *url, int urllen, srci_t *ri, void *sri_user_data, void *node
 		case METHOD_POST:
 			page = post(&req, rt, ri);
 			break;
-		/*case METHOD_DEL:
-			break;*/
+		case METHOD_HEAD:
+			page = head(&req, rt, ri);
+			break;
+		case METHOD_OPT:
+			page = options(&req, rt, ri);
+			break;
+		case METHOD_DEL:
+			page = del(&req, rt, ri);
+			break;
 		default:
 			srci_set_return_code(ri, MHD_HTTP_METHOD_NOT_ALLOWED);
 			log_add(WSLOG_WARN, "%s %d METHOD_NOT_ALLOWED", srci_get_client_ip(ri), ri->return_code);
@@ -408,8 +1147,15 @@ char* node384(char *url, int urllen, srci_t *ri, void *sri_user_data, void *node
 		case METHOD_POST:
 			page = post(&req, rt, ri);
 			break;
-		/*case METHOD_DEL:
-			break;*/
+		case METHOD_HEAD:
+			page = head(&req, rt, ri);
+			break;
+		case METHOD_OPT:
+			page = options(&req, rt, ri);
+			break;
+		case METHOD_DEL:
+			page = del(&req, rt, ri);
+			break;
 		default:
 			srci_set_return_code(ri, MHD_HTTP_METHOD_NOT_ALLOWED);
 			log_add(WSLOG_WARN, "%s %d METHOD_NOT_ALLOWED", srci_get_client_ip(ri), ri->return_code);
@@ -441,8 +1187,15 @@ char* node512(char *url, int urllen, srci_t *ri, void *sri_user_data, void *node
 		case METHOD_POST:
 			page = post(&req, rt, ri);
 			break;
-		/*case METHOD_DEL:
-			break;*/
+		case METHOD_HEAD:
+			page = head(&req, rt, ri);
+			break;
+		case METHOD_OPT:
+			page = options(&req, rt, ri);
+			break;
+		case METHOD_DEL:
+			page = del(&req, rt, ri);
+			break;
 		default:
 			srci_set_return_code(ri, MHD_HTTP_METHOD_NOT_ALLOWED);
 			log_add(WSLOG_WARN, "%s %d METHOD_NOT_ALLOWED", srci_get_client_ip(ri), ri->return_code);
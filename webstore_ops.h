@@ -19,6 +19,9 @@
 #ifndef __WEBSTORE_OPERATIONS_H__
 #define __WEBSTORE_OPERATIONS_H__
 
+#include <stdatomic.h>
+
+#include "webstore.h"
 #include "searest.h"
 #include "rai.h"
 
@@ -26,12 +29,34 @@ typedef struct {
 	char *http_ip;
 	unsigned short http_port;
 	int use_threads;
+	int reuse_port;
+	int backlog;
+	int defer_accept;
+	int fastopen;
+	int nodelay;
+	int rcvbuf;
+	int sndbuf;
+	int idle_timeout;
+	int header_timeout;
+	int body_timeout;
+	unsigned int ip_conns;
+	long conn_mem;
+	unsigned int max_inflight;
+	long upload_budget;
+	int retry_after;
+	long bulk_size;
+	unsigned int fast_workers;
+	unsigned int bulk_workers;
+	long lane_wait;
 	long max_post_data_size;
 	char *certfile;
 	char *keyfile;
 
 	char *rdest;			// Redis Dest
 	unsigned short rport;	// Redis Port
+	long rconnect_timeout;	// ms
+	long rcmd_timeout;		// ms
+	int mem_watermark;		// percent of maxmemory
 } srv_opts_t;
 
 // WebStore Runtime data
@@ -43,8 +68,22 @@ typedef struct {
 	long expiration;
 	int immutable;
 	int bar;
+	size_t packsize;	// objects smaller than this are packed into hashes
+	int packprefix;		// token digits that pick the hash
+	int binkeys;		// BINKEYS_*
+	int store;			// STORE_*
+	int cors;			// allow browsers on other origins
+	long cors_maxage;	// seconds a preflight answer may be reused
 } wsrt_t;
 
+#define BINKEYS_OFF		(0)
+#define BINKEYS_ON		(1)
+#define BINKEYS_MIGRATE	(2)	// also read (and replace on write) keys stored as hex
+
+#define STORE_Z85		(0)
+#define STORE_BINARY	(1)	// the decoded bytes
+#define STORE_DEFLATE	(2)	// the decoded bytes, deflated when that makes them smaller
+
 // WebStore Request Info
 typedef struct {
 	int type;
@@ -53,6 +92,26 @@ typedef struct {
 	int urllen;
 } wsreq_t;
 
+// Everything redis needs to know about one token, built on the stack
+// key and field point into the struct itself, don't copy it
+typedef struct {
+	char hex[HASHLEN512+1];					// lowercase token
+	int hexlen;
+	unsigned char bin[2+(HASHLEN512/2)];	// node prefix + digest bytes
+	const void *key;						// what redis sees, hex or bin
+	size_t keylen;
+	char bucket[16];						// packed layout
+	const void *field;
+	size_t fieldlen;
+} wskey_t;
+
+// Reference counted buffer shared between requests, see webstore_flight.c
+typedef struct {
+	atomic_int refs;
+	size_t len;
+	char data[];
+} wsbuf_t;
+
 // Found in webstore.c
 int shutting_down(void);
 void handle_redis_error(rai_t *);
@@ -63,8 +122,19 @@ int allow_ip(wsrt_t *, char *);
 // Found in webstore_uhd.c
 void webstore_start(srv_opts_t *);
 void webstore_stop(void);
+void redis_retry(rai_t *);
+wsrt_t* lane_rt(wsrt_t *, srci_t *);
 
 // Found in webstore_node.c
+int make_key(wsrt_t *, wsreq_t *, wskey_t *);
+void hex_key(wsrt_t *, const wskey_t *, wskey_t *);
+int Z85_validate(const unsigned char *, size_t);
+redisReply* pipeline_replies(rai_t *, int);
+int do_redis_get(wsrt_t *, const wskey_t *, wsbuf_t **);
+int post_append(wsrt_t *, const wskey_t *, const unsigned char *, size_t, int *);
+int post_result(wsrt_t *, redisReply *, int);
+int del_append(wsrt_t *, const wskey_t *);
+int del_replies(wsrt_t *, int);
 char* node128(char *, int, srci_t *, void *, void *);
 char* node160(char *, int, srci_t *, void *, void *);
 char* node224(char *, int, srci_t *, void *, void *);
@@ -72,4 +142,75 @@ char* node256(char *, int, srci_t *, void *, void *);
 char* node384(char *, int, srci_t *, void *, void *);
 char* node512(char *, int, srci_t *, void *, void *);
 
+// Found in webstore_batch.c
+char* node_mget(char *, int, srci_t *, void *, void *);
+char* node_mset(char *, int, srci_t *, void *, void *);
+char* node_mdel(char *, int, srci_t *, void *, void *);
+
+// Found in webstore_flight.c
+#define FLIGHT_GET	(1)
+#define FLIGHT_POST	(2)
+typedef struct wsflight wsflight_t;
+wsbuf_t* wsbuf_new(const char *, size_t);
+void wsbuf_ref(wsbuf_t *);
+void wsbuf_release(void *);
+wsflight_t* flight_join(int, const char *, const unsigned char *, size_t, int *);
+void flight_finish(wsflight_t *, int, wsbuf_t *);
+int flight_wait(wsflight_t *, wsbuf_t **);
+
+// Found in webstore_wait.c
+int wait_configure(long, char *, unsigned short);
+void* wait_begin(srci_t *, const char *, long *);
+void wait_cancel(void *);
+void wait_park(void *, long, void *);
+void wait_notify(const char *);
+void wait_stop(void);
+void wait_get_stats(unsigned long *, unsigned long *, unsigned long *);
+
+// Found in webstore_wb.c
+int wb_configure(wsrt_t *, size_t, int, char *, unsigned short, long, long);
+int wb_enabled(void);
+int wb_put(const wskey_t *, int, wsbuf_t *);
+wsbuf_t* wb_get(const char *);
+int wb_drop(const char *);
+void wb_stop(void);
+void wb_get_stats(unsigned long *, unsigned long *, unsigned long *, unsigned long *, unsigned long *, unsigned long *);
+
+// Found in webstore_range.c
+int do_redis_getrange(wsrt_t *, const wskey_t *, const char *, wsbuf_t **, long *, long *, long *);
+
+// Found in webstore_codec.c
+#define CODEC_HDRLEN	(7)	// header in front of a transcoded value
+wsbuf_t* codec_pack(int, const unsigned char *, size_t);
+wsbuf_t* codec_unpack(wsbuf_t *);
+long codec_text_len(const unsigned char *, size_t, size_t);
+#define CODEC_RANGE_TEXT	(0)	// stored as the text, same offsets
+#define CODEC_RANGE_FRAMES	(1)	// stored as bytes, fetch the frames and re-encode
+#define CODEC_RANGE_FULL	(2)	// deflated, only the whole value can be decoded
+int codec_range(const unsigned char *, size_t, long, long, long *, long *);
+wsbuf_t* codec_slice(const unsigned char *, const unsigned char *, size_t, long, long);
+void codec_get(unsigned long *, unsigned long *);
+
+// Found in webstore_compress.c
+#define ZENC_NONE		(0)
+#define ZENC_GZIP		(1)
+#define ZENC_DEFLATE	(2)
+void zc_configure(size_t, size_t);
+int zc_enabled(void);
+int zc_negotiate(const char *);
+wsbuf_t* zc_get(const char *, int, wsbuf_t *, int);
+int zc_peek(const char *, int, size_t, size_t *);
+void zc_invalidate(const char *);
+void zc_get_stats(unsigned long *, unsigned long *, unsigned long *, unsigned long *);
+
+// Found in webstore_mem.c
+void mem_set_watermark(int);
+void mem_job(void *);
+void mem_oom_seen(void);
+int mem_admit(const char *, int, size_t, void *);
+void mem_get(unsigned long *, unsigned long *, int *, unsigned long *);
+
+// Found in webstore_stats.c
+char* node_stats(char *, int, srci_t *, void *, void *);
+
 #endif
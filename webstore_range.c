@@ -0,0 +1,194 @@
+/*
+	webstore is a web-based arbitrary data storage service that accepts z85 encoded data
+	Copyright (C) 2021 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Byte ranges of the Z85 text with GETRANGE, the value is never read whole unless it is deflated
+// Ranges address the text a GET returns, a client wanting bytes of the message asks for the
+// 5 digit frames that cover them (frame n of a padded message starts at 1 + 5n)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "webstore.h"
+#include "webstore_ops.h"
+
+// Resolve a "bytes=" header against a value of total bytes
+// returns 206 with [*first, *last] set, 200 to ignore the header, 416 if it can not be satisfied
+static int range_parse(const char *hdr, long total, long *first, long *last)
+{
+	char *end;
+	long a, b;
+
+	if(strncmp(hdr, "bytes=", 6) != 0) { return 200; }
+	hdr += 6;
+	if(strchr(hdr, ',')) { return 200; }	// multipart/byteranges is not worth it here
+
+	while(*hdr == ' ') { hdr++; }
+	if(*hdr == '-') {
+		// The last b bytes
+		if(!isdigit((unsigned char)hdr[1])) { return 200; }
+		b = strtol(hdr + 1, &end, 10);
+		if(*end && (*end != ' ')) { return 200; }
+		if(b == 0) { return 416; }
+		*first = (b >= total) ? 0 : (total - b);
+		*last = total - 1;
+		return 206;
+	}
+
+	if(!isdigit((unsigned char)*hdr)) { return 200; }
+	a = strtol(hdr, &end, 10);
+	if(*end != '-') { return 200; }
+	hdr = end + 1;
+	b = total - 1;
+	if(isdigit((unsigned char)*hdr)) {
+		b = strtol(hdr, &end, 10);
+		if(*end && (*end != ' ')) { return 200; }
+		if(b < a) { return 200; }
+	} else if(*hdr && (*hdr != ' ')) {
+		return 200;
+	}
+
+	if(a >= total) { return 416; }
+	*first = a;
+	*last = (b >= total) ? (total - 1) : b;
+	return 206;
+}
+
+// Text bytes [first, last] of a whole stored value
+static wsbuf_t* whole_slice(wsbuf_t *stored, long first, long last)
+{
+	wsbuf_t *b;
+
+	b = wsbuf_new(stored->data + first, last - first + 1);
+	wsbuf_release(stored);
+	return b;
+}
+
+// The range of k in whichever layout holds it, call with the lock held
+// returns 206, 200 to serve the whole object, 404, 416, 500 on a corrupt value or 503 on a redis error
+static int fetch_range(wsrt_t *rt, const wskey_t *k, const char *hdr, wsbuf_t **buf, long *first, long *last, long *total)
+{
+	redisReply *r[3] = { NULL }, *reply = NULL;
+	rai_t *rc = &rt->rc;
+	wsbuf_t *whole = NULL;
+	unsigned char head[CODEC_HDRLEN];
+	size_t headlen = 0;
+	long sfirst, slast;
+	int i, n = 2, code = 404;
+
+	redisAppendCommand(rc->c, "GETRANGE %b 0 %d", k->key, k->keylen, CODEC_HDRLEN-1);
+	redisAppendCommand(rc->c, "STRLEN %b", k->key, k->keylen);
+	if(rt->packsize) {
+		// Packed values are small, they are sliced in memory
+		redisAppendCommand(rc->c, "HGET %s %b", k->bucket, k->field, k->fieldlen);
+		n++;
+	}
+
+	for(i=0; i<n; i++) {
+		if(redisGetReply(rc->c, (void **)&r[i]) != REDIS_OK) {
+			while(i--) { freeReplyObject(r[i]); }
+			handle_redis_error(rc);
+			return 503;
+		}
+	}
+
+	if(r[2] && (r[2]->type == REDIS_REPLY_STRING)) {
+		whole = wsbuf_new(r[2]->str, r[2]->len);
+		code = whole ? 0 : 500;
+	} else if((r[0]->type == REDIS_REPLY_STRING) && (r[1]->type == REDIS_REPLY_INTEGER) && (r[1]->integer > 0)) {
+		headlen = r[0]->len;
+		memcpy(head, r[0]->str, headlen);
+		*total = codec_text_len(head, headlen, r[1]->integer);
+		code = (*total < 0) ? 500 : 0;
+	}
+	for(i=0; i<n; i++) { freeReplyObject(r[i]); }
+	if(code) { return code; }
+
+	if(whole) {
+		whole = codec_unpack(whole);
+		if(!whole) { return 500; }
+		*total = whole->len;
+		code = range_parse(hdr, *total, first, last);
+		if(code == 206) { *buf = whole_slice(whole, *first, *last); }
+		else { wsbuf_release(whole); }
+		return (code == 206 && !*buf) ? 500 : code;
+	}
+
+	code = range_parse(hdr, *total, first, last);
+	if(code != 206) { return code; }
+
+	switch(codec_range(head, headlen, *first, *last, &sfirst, &slast)) {
+		case CODEC_RANGE_TEXT:
+			reply = redisCommand(rc->c, "GETRANGE %b %ld %ld", k->key, k->keylen, *first, *last);
+			break;
+		case CODEC_RANGE_FRAMES:
+			reply = redisCommand(rc->c, "GETRANGE %b %ld %ld", k->key, k->keylen, sfirst, slast);
+			break;
+		default:
+			reply = redisCommand(rc->c, "GET %b", k->key, k->keylen);
+	}
+	if(!reply) { handle_redis_error(rc); return 503; }
+
+	code = 500;
+	if(reply->type == REDIS_REPLY_STRING) {
+		switch(codec_range(head, headlen, *first, *last, &sfirst, &slast)) {
+			case CODEC_RANGE_TEXT:
+				if(reply->len == (size_t)(*last - *first + 1)) { *buf = wsbuf_new(reply->str, reply->len); }
+				break;
+			case CODEC_RANGE_FRAMES:
+				*buf = codec_slice(head, (unsigned char *)reply->str, reply->len, *first, *last);
+				break;
+			default:
+				whole = codec_unpack(wsbuf_new(reply->str, reply->len));
+				if(whole && (whole->len == (size_t)*total)) { *buf = whole_slice(whole, *first, *last); }
+				else if(whole) { wsbuf_release(whole); }
+		}
+		if(*buf) { code = 206; }
+	} else if(reply->type == REDIS_REPLY_NIL) {
+		code = 404;	// gone between the two round trips
+	}
+	freeReplyObject(reply);
+
+	return code;
+}
+
+// Fetch bytes [first, last] of k's text as asked for by a Range header
+// returns 206 with *buf set, 200 if the whole object should be served instead,
+// 404, 416 (*total is set), 500 on a corrupt value or 503 on a redis error
+int do_redis_getrange(wsrt_t *rt, const wskey_t *k, const char *hdr, wsbuf_t **buf, long *first, long *last, long *total)
+{
+	int code;
+	wskey_t hk;
+	rai_t *rc = &rt->rc;
+
+	*buf = NULL;
+
+	//LOCK RAI, the scheduler thread may be reconnecting even without multithreading
+	rai_lock(rc);
+	if(!rai_ready(rc)) { rai_unlock(rc); return 503; }
+	code = fetch_range(rt, k, hdr, buf, first, last, total);
+	if((code == 404) && (rt->binkeys == BINKEYS_MIGRATE)) {
+		// Not migrated yet
+		hex_key(rt, k, &hk);
+		code = fetch_range(rt, &hk, hdr, buf, first, last, total);
+	}
+	rai_unlock(rc);
+
+	return code;
+}
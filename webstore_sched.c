@@ -0,0 +1,180 @@
+/*
+	webstore is a web-based arbitrary data storage service that accepts z85 encoded data
+	Copyright (C) 2021 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// A single thread runs every periodic job (log maintenance, stats, health checks)
+// Each job gets its own timerfd and the thread sleeps in epoll_wait() between them
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+
+#include "webstore_sched.h"
+#include "webstore_log.h"
+
+typedef struct {
+	char *name;
+	int tfd;
+	wsjob_cb_t cb;
+	void *arg;
+} wsjob_t;
+
+static wsjob_t g_jobs[WSCHED_MAXJOBS];
+static int g_njobs = 0;
+static int g_epfd = -1;
+static int g_stopfd = -1;
+static int g_running = 0;
+static pthread_t g_sched_thr;
+
+static int sched_init(void)
+{
+	struct epoll_event ev;
+
+	if(g_epfd >= 0) { return 0; }
+
+	g_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if(g_epfd < 0) { return -1; }
+
+	g_stopfd = eventfd(0, EFD_CLOEXEC);
+	if(g_stopfd < 0) { return -2; }
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = WSCHED_MAXJOBS;
+	if(epoll_ctl(g_epfd, EPOLL_CTL_ADD, g_stopfd, &ev)) { return -3; }
+
+	return 0;
+}
+
+// Run cb(arg) every interval_ms milliseconds on the scheduler thread
+// An interval of 0 adds a one-shot job that only runs after wsched_arm()
+// return 0 on success
+int wsched_add(const char *name, long interval_ms, wsjob_cb_t cb, void *arg)
+{
+	struct itimerspec its;
+	struct epoll_event ev;
+	wsjob_t *j;
+
+	if(!cb || (interval_ms < 0)) { return 1; }
+	if(g_njobs >= WSCHED_MAXJOBS) { return 2; }
+	if(sched_init()) { return 3; }
+
+	j = &g_jobs[g_njobs];
+	j->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if(j->tfd < 0) { return 4; }
+
+	memset(&its, 0, sizeof(its));
+	its.it_interval.tv_sec = interval_ms / 1000;
+	its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000;
+	its.it_value = its.it_interval;
+	if(timerfd_settime(j->tfd, 0, &its, NULL)) { close(j->tfd); return 5; }
+
+	j->name = strdup(name);
+	j->cb = cb;
+	j->arg = arg;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = g_njobs;
+	if(epoll_ctl(g_epfd, EPOLL_CTL_ADD, j->tfd, &ev)) { close(j->tfd); free(j->name); return 6; }
+
+	g_njobs++;
+	return 0;
+}
+
+// Run a one-shot job once, delay_ms from now; arming it again before it ran moves the deadline
+// Safe to call from any thread, jobs are only added before wsched_start()
+// return 0 on success
+int wsched_arm(const char *name, long delay_ms)
+{
+	struct itimerspec its;
+	int i;
+
+	for(i=0; i<g_njobs; i++) { if(strcmp(g_jobs[i].name, name) == 0) { break; } }
+	if(i == g_njobs) { return 1; }
+
+	// A zero it_value would disarm the timer
+	if(delay_ms < 1) { delay_ms = 1; }
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = delay_ms / 1000;
+	its.it_value.tv_nsec = (delay_ms % 1000) * 1000000;
+	if(timerfd_settime(g_jobs[i].tfd, 0, &its, NULL)) { return 2; }
+
+	return 0;
+}
+
+static void* sched_loop(void *arg)
+{
+	struct epoll_event evs[WSCHED_MAXJOBS+1];
+	uint64_t expirations;
+	wsjob_t *j;
+	int i, n;
+
+	for(;;) {
+		n = epoll_wait(g_epfd, evs, WSCHED_MAXJOBS+1, -1);
+		for(i=0; i<n; i++) {
+			if(evs[i].data.u32 == WSCHED_MAXJOBS) { return NULL; }
+
+			j = &g_jobs[evs[i].data.u32];
+			if(read(j->tfd, &expirations, sizeof(expirations)) != sizeof(expirations)) { continue; }
+			if(expirations > 1) { LOG_LEVEL(WSLOG_WARN, "scheduler: %s overran %lu intervals", j->name, (unsigned long)expirations-1); }
+			j->cb(j->arg);
+		}
+	}
+
+	return NULL;
+}
+
+int wsched_start(void)
+{
+	if(g_running) { return 0; }
+	if(sched_init()) { return 1; }
+
+	if(pthread_create(&g_sched_thr, NULL, sched_loop, NULL)) {
+		log_add(WSLOG_ERR, "failed to start the scheduler thread");
+		return 2;
+	}
+
+	g_running = 1;
+	return 0;
+}
+
+void wsched_stop(void)
+{
+	uint64_t one = 1;
+	int i;
+
+	if(g_running) {
+		if(write(g_stopfd, &one, sizeof(one)) != sizeof(one)) { fprintf(stderr, "wsched_stop() failed!\n"); }
+		pthread_join(g_sched_thr, NULL);
+		g_running = 0;
+	}
+
+	for(i=0; i<g_njobs; i++) {
+		close(g_jobs[i].tfd);
+		free(g_jobs[i].name);
+	}
+	g_njobs = 0;
+	if(g_stopfd >= 0) { close(g_stopfd); g_stopfd = -1; }
+	if(g_epfd >= 0) { close(g_epfd); g_epfd = -1; }
+}
@@ -0,0 +1,145 @@
+/*
+	webstore is a web-based arbitrary data storage service that accepts z85 encoded data
+	Copyright (C) 2021 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// GET /stats/ returns one "name value" pair per line
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "webstore.h"
+#include "webstore_ops.h"
+#include "webstore_log.h"
+
+#define STATSPAGELEN (4096)
+
+static void stat_line(char *page, size_t *len, const char *name, unsigned long value)
+{
+	int n;
+
+	if(*len >= STATSPAGELEN) { return; }
+	n = snprintf(page + *len, STATSPAGELEN - *len, "%s %lu\n", name, value);
+	if(n > 0) { *len += n; }
+}
+
+char* node_stats(char *url, int urllen, srci_t *ri, void *sri_user_data, void *node_user_data)
+{
+	sri_t *srv = node_user_data;
+	wsrt_t *rt = sri_user_data;
+	rai_t *rc = &rt->rc;
+	sr_evictions_t e;
+	sr_limits_t l;
+	sr_lane_t lane;
+	unsigned long used, max, refused, in, stored;
+	unsigned long zhits, zmisses, zhuffman, zbytes;
+	unsigned long parked, woken, timeouts;
+	unsigned long wqueued, wflushed, wfailed, wfull, wpending, wbytes;
+	int pressure;
+	char *page;
+	size_t len = 0;
+
+	if(METHOD(ri) != METHOD_GET) {
+		srci_set_return_code(ri, MHD_HTTP_METHOD_NOT_ALLOWED);
+		return strdup("method not allowed");
+	}
+
+	page = malloc(STATSPAGELEN);
+	if(!page) {
+		srci_set_return_code(ri, MHD_HTTP_INTERNAL_SERVER_ERROR);
+		return strdup("internal server error");
+	}
+	page[0] = 0;
+
+	if(searest_get_limits(srv, &l) == 0) {
+		stat_line(page, &len, "limit_inflight", l.limit);
+		stat_line(page, &len, "inflight", l.inflight);
+		stat_line(page, &len, "latency_base_us", l.base_us);
+		stat_line(page, &len, "limit_upload_bytes", l.upload_budget);
+		stat_line(page, &len, "upload_bytes", l.upload_inflight);
+		stat_line(page, &len, "shed_inflight", l.shed_inflight);
+		stat_line(page, &len, "shed_upload", l.shed_upload);
+	}
+
+	if(searest_get_lane(srv, SR_LANE_FAST, &lane) == 0) {
+		stat_line(page, &len, "lane_fast_budget", lane.budget);
+		stat_line(page, &len, "lane_fast_active", lane.active);
+		stat_line(page, &len, "lane_fast_queued", lane.waiting);
+		stat_line(page, &len, "lane_fast_served", lane.served);
+		stat_line(page, &len, "lane_fast_timedout", lane.timedout);
+		stat_line(page, &len, "lane_fast_wait_us_total", lane.wait_us_total);
+		stat_line(page, &len, "lane_fast_wait_us_max", lane.wait_us_max);
+	}
+	if(searest_get_lane(srv, SR_LANE_BULK, &lane) == 0) {
+		stat_line(page, &len, "lane_bulk_budget", lane.budget);
+		stat_line(page, &len, "lane_bulk_active", lane.active);
+		stat_line(page, &len, "lane_bulk_queued", lane.waiting);
+		stat_line(page, &len, "lane_bulk_served", lane.served);
+		stat_line(page, &len, "lane_bulk_timedout", lane.timedout);
+		stat_line(page, &len, "lane_bulk_wait_us_total", lane.wait_us_total);
+		stat_line(page, &len, "lane_bulk_wait_us_max", lane.wait_us_max);
+	}
+
+	searest_get_evictions(srv, &e);
+	stat_line(page, &len, "evict_idle", e.idle);
+	stat_line(page, &len, "evict_header", e.header);
+	stat_line(page, &len, "evict_body", e.body);
+	stat_line(page, &len, "evict_ipcap", e.ipcap);
+
+	mem_get(&used, &max, &pressure, &refused);
+	stat_line(page, &len, "redis_used_memory", used);
+	stat_line(page, &len, "redis_maxmemory", max);
+	stat_line(page, &len, "redis_headroom_bytes", (max > used) ? (max - used) : 0);
+	stat_line(page, &len, "redis_mem_pressure", pressure);
+	stat_line(page, &len, "refused_mem", refused);
+
+	rai_lock(rc);
+	stat_line(page, &len, "redis_connected", rc->connected);
+	stat_line(page, &len, "redis_breaker", rc->breaker);
+	stat_line(page, &len, "redis_trips", rc->trips);
+	stat_line(page, &len, "redis_fastfails", rc->fastfails);
+	rai_unlock(rc);
+
+	codec_get(&in, &stored);
+	stat_line(page, &len, "store_bytes_in", in);
+	stat_line(page, &len, "store_bytes_stored", stored);
+
+	zc_get_stats(&zhits, &zmisses, &zhuffman, &zbytes);
+	stat_line(page, &len, "compress_cache_hits", zhits);
+	stat_line(page, &len, "compress_cache_misses", zmisses);
+	stat_line(page, &len, "compress_huffman_only", zhuffman);
+	stat_line(page, &len, "compress_cache_bytes", zbytes);
+
+	wait_get_stats(&parked, &woken, &timeouts);
+	stat_line(page, &len, "wait_parked", parked);
+	stat_line(page, &len, "wait_woken", woken);
+	stat_line(page, &len, "wait_timeouts", timeouts);
+
+	wb_get_stats(&wqueued, &wflushed, &wfailed, &wfull, &wpending, &wbytes);
+	stat_line(page, &len, "writebehind_queued", wqueued);
+	stat_line(page, &len, "writebehind_flushed", wflushed);
+	stat_line(page, &len, "writebehind_failed", wfailed);
+	stat_line(page, &len, "writebehind_full", wfull);
+	stat_line(page, &len, "writebehind_pending", wpending);
+	stat_line(page, &len, "writebehind_bytes", wbytes);
+
+	stat_line(page, &len, "log_overflows", log_get_overflows());
+
+	srci_set_response_content_type(ri, MIMETYPETXTPLAINSTR);
+	srci_set_return_code(ri, MHD_HTTP_OK);
+	return page;
+}
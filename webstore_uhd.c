@@ -23,11 +23,16 @@
 #include "webstore.h"
 #include "webstore_ops.h"
 #include "webstore_log.h"
+#include "webstore_sched.h"
 #include "futils.h"
 
 sri_t *g_srv = NULL;
 wsrt_t g_rt;
 
+// The bulk lane writes on its own redis connection, see bulk_connect()
+static wsrt_t g_bulk_rt;
+static int g_bulk_on = 0;
+
 #ifdef SRNODECHRONOMETRY
 #include "chronometry.h"
 void print_avg_nodecb_time(void)
@@ -65,6 +70,7 @@ static int ws_addr_check(char *inc_ip, void *sri_user_data)
 
 	// Blindly accept w/o logging localhost
 	if(strcmp(inc_ip, "127.0.0.1") == 0) { return SR_IP_ACCEPT; }
+	if(strcmp(inc_ip, "::1") == 0) { return SR_IP_ACCEPT; }
 
 	z = allow_ip(lrt, inc_ip);
 	if(z == 0) { return SR_IP_DENY; }
@@ -86,32 +92,159 @@ static void activate_https(srv_opts_t *so)
 	free(key);
 }
 
+// Bring redis back after a failure, requests fail fast with 503 until then
+// Only armed while the breaker is open, a healthy server never wakes up for it
+static void redis_job(void *arg)
+{
+	rai_t *rc = arg;
+	int z;
+
+	z = rai_reconnect(rc);
+	if(z > 0) { log_add(WSLOG_WARN, "redis reconnected, probing"); }
+	if(z < 0) { log_add(WSLOG_DEBUG, "redis reconnect failed, next attempt in ~%ldms", rc->retry_ms); }
+
+	rai_lock(rc);
+	if(!rai_is_connected(rc)) { redis_retry(rc); }
+	rai_unlock(rc);
+}
+
+// Schedule redis_job for the next reconnect attempt, call with the lock held after rai_failed()
+// The write-behind threads reconnect their own connections
+void redis_retry(rai_t *rc)
+{
+	if(rc == &g_rt.rc) { wsched_arm("redis", rai_retry_in(rc)); }
+	if(g_bulk_on && (rc == &g_bulk_rt.rc)) { wsched_arm("redisbulk", rai_retry_in(rc)); }
+}
+
+// Requests in the bulk lane use this instead of rt
+// A large SET then never holds the lock that fast lane commands wait for
+wsrt_t* lane_rt(wsrt_t *rt, srci_t *ri)
+{
+	if(g_bulk_on && (srci_get_lane(ri) == SR_LANE_BULK)) { return &g_bulk_rt; }
+	return rt;
+}
+
+// Give the bulk lane a copy of the runtime with its own connection, call once g_rt is configured
+static void bulk_connect(srv_opts_t *so)
+{
+	g_bulk_rt = g_rt;
+	memset(&g_bulk_rt.rc, 0, sizeof(rai_t));
+	rai_set_timeouts(&g_bulk_rt.rc, so->rconnect_timeout, so->rcmd_timeout);
+	if(rai_connect(&g_bulk_rt.rc, so->rdest, so->rport)) {
+		fprintf(stderr, "Failed to connect the bulk lane to redis, sharing the main connection\n");
+		return;
+	}
+
+	wsched_add("redisbulk", 0, redis_job, &g_bulk_rt.rc);
+	g_bulk_on = 1;
+}
+
+// Report connections that were cut off since the last run
+static void evict_job(void *arg)
+{
+	static sr_evictions_t last;
+	sr_evictions_t e;
+
+	searest_get_evictions(g_srv, &e);
+	if(memcmp(&e, &last, sizeof(e)) == 0) { return; }
+	log_add(WSLOG_INFO, "evicted idle:%lu header:%lu body:%lu ipcap:%lu",
+		e.idle - last.idle, e.header - last.header, e.body - last.body, e.ipcap - last.ipcap);
+	last = e;
+}
+
+// Report requests that were shed since the last run
+static void shed_job(void *arg)
+{
+	static unsigned long last_inflight, last_upload;
+	sr_limits_t l;
+
+	if(searest_get_limits(g_srv, &l)) { return; }
+	if((l.shed_inflight == last_inflight) && (l.shed_upload == last_upload)) { return; }
+	log_add(WSLOG_WARN, "shed inflight:%lu upload:%lu (limit %u, base latency %ldus)",
+		l.shed_inflight - last_inflight, l.shed_upload - last_upload, l.limit, l.base_us);
+	last_inflight = l.shed_inflight;
+	last_upload = l.shed_upload;
+}
+
 void webstore_start(srv_opts_t *so)
 {
 	int z;
+	long zc_size, zc_cache, wait_max, wb_size;
+	int wb_threads;
 
 	// Connect to Redis
 	memset(&g_rt, 0, sizeof(wsrt_t));
 	g_rt.multithreaded = so->use_threads;
+	rai_set_timeouts(&g_rt.rc, so->rconnect_timeout, so->rcmd_timeout);
 	z = rai_connect(&g_rt.rc, so->rdest, so->rport);
 	if(z) {
 		if(so->rport) { fprintf(stderr, "Failed to connect to %s:%u!\n", so->rdest, so->rport); }
 		else { fprintf(stderr, "Failed to connect to %s!\n", so->rdest); }
 		exit(EXIT_FAILURE);
 	}
+	wsched_add("redis", 0, redis_job, &g_rt.rc);
 
 	// Initialize the server
-	g_srv = searest_new(32+11, 128+11, so->max_post_data_size);
+	// /stats/ is much shorter than any store URL, only relax the minimum when it is enabled
+	if(getenv("STATSNODE")) { g_srv = searest_new(strlen("/stats/"), 128+11, so->max_post_data_size); }
+	else { g_srv = searest_new(strlen("/store/mget/"), 128+11, so->max_post_data_size); }
 	searest_node_add(g_srv, "/store/128/",	&node128, NULL);
 	searest_node_add(g_srv, "/store/160/",	&node160, NULL);
 	searest_node_add(g_srv, "/store/224/",	&node224, NULL);
 	searest_node_add(g_srv, "/store/256/",	&node256, NULL);
 	searest_node_add(g_srv, "/store/384/",	&node384, NULL);
 	searest_node_add(g_srv, "/store/512/",	&node512, NULL);
+	searest_node_add(g_srv, "/store/mget/",	&node_mget, NULL);
+	searest_node_add(g_srv, "/store/mset/",	&node_mset, NULL);
+	searest_node_add(g_srv, "/store/mdel/",	&node_mdel, NULL);
+	if(getenv("STATSNODE")) { searest_node_add(g_srv, "/stats/", &node_stats, g_srv); }
 
 	// Configure Multithread
 	if(so->use_threads == 0) { searest_set_internal_select(g_srv); }
 
+	// Configure the listening socket
+	// SO_REUSEPORT lets every worker process bind the same port
+	if(so->reuse_port) { searest_set_reuseport(g_srv); }
+	if(so->backlog > 0) { searest_set_listen_backlog(g_srv, so->backlog); }
+	if(so->defer_accept > 0) { searest_set_defer_accept(g_srv, so->defer_accept); }
+	if(so->fastopen > 0) { searest_set_fastopen(g_srv, so->fastopen); }
+	if(so->nodelay) { searest_set_nodelay(g_srv); }
+	searest_set_sockbufs(g_srv, so->rcvbuf, so->sndbuf);
+
+	// Configure the connection lifecycle
+	if(so->idle_timeout > 0) { searest_set_inactivity_timeout(g_srv, so->idle_timeout); }
+	searest_set_request_timeouts(g_srv, so->header_timeout, so->body_timeout);
+	if(so->ip_conns > 0) { searest_set_per_ip_limit(g_srv, so->ip_conns); }
+	if(so->conn_mem > 0) { searest_set_conn_memory_limit(g_srv, so->conn_mem); }
+	// Nothing is ever evicted without a timeout or a per ip cap
+	if((so->idle_timeout > 0) || (so->header_timeout > 0) || (so->body_timeout > 0) || (so->ip_conns > 0)) {
+		wsched_add("evict", 60*1000, evict_job, NULL);
+	}
+
+	// Configure load shedding, the limit adapts between 1/8 of the max and the max
+	if(so->max_inflight > 0) {
+		searest_set_adaptive_limit(g_srv, (so->max_inflight+7)/8, so->max_inflight);
+		if(so->upload_budget > 0) { searest_set_upload_budget(g_srv, so->upload_budget); }
+		if(so->retry_after > 0) { searest_set_retry_after(g_srv, so->retry_after); }
+		wsched_add("shed", 60*1000, shed_job, NULL);
+	}
+
+	// Refuse uploads while redis is close to maxmemory
+	if(so->mem_watermark > 0) {
+		mem_set_watermark(so->mem_watermark);
+		searest_set_admit_cb(g_srv, &mem_admit);
+		wsched_add("memory", 1000, mem_job, &g_rt);
+	}
+
+	// Configure request lanes, large uploads get their own worker budget
+	if(so->bulk_size > 0) {
+		if(so->use_threads) {
+			searest_set_lanes(g_srv, so->bulk_size, so->fast_workers, so->bulk_workers, so->lane_wait);
+		} else {
+			fprintf(stderr, "Request lanes need multithreading, ignoring --bulksize\n");
+		}
+	}
+
 	// Configure Connection Limiting
 	if(getenv("REQPERIOD")) { g_rt.reqperiod = atoi(getenv("REQPERIOD")); }
 	if(getenv("REQCOUNT")) { g_rt.reqcount = atol(getenv("REQCOUNT")); }
@@ -129,9 +262,77 @@ void webstore_start(srv_opts_t *so)
 	// Configure [B]urn [A]fter [R]eading (DELETE after GET)
 	if(getenv("BAR")) { g_rt.bar = 1; }
 
+	// Configure binary keys: the digest bytes instead of their hex text
+	if(getenv("BINKEYS")) {
+		if(strcmp(getenv("BINKEYS"), "migrate") == 0) { g_rt.binkeys = BINKEYS_MIGRATE; }
+		else { g_rt.binkeys = BINKEYS_ON; }
+	}
+
+	// Configure CORS for browser clients on other origins
+	if(getenv("CORS")) { g_rt.cors = 1; }
+	g_rt.cors_maxage = 86400;
+	if(getenv("CORSMAXAGE")) { g_rt.cors_maxage = atol(getenv("CORSMAXAGE")); }
+
+	// Configure at-rest transcoding, values already stored as text keep working either way
+	if(getenv("STORE")) {
+		if(strcmp(getenv("STORE"), "binary") == 0) { g_rt.store = STORE_BINARY; }
+		else if(strcmp(getenv("STORE"), "deflate") == 0) { g_rt.store = STORE_DEFLATE; }
+		else { fprintf(stderr, "STORE must be binary or deflate, storing Z85 text\n"); }
+	}
+
+	// Configure response compression: bodies of at least COMPRESS bytes, COMPRESSCACHE bytes of cache
+	if(getenv("COMPRESS")) {
+		zc_size = atol(getenv("COMPRESS"));
+		if(zc_size < 1) { zc_size = 1024; }
+		zc_cache = 16*1024*1024;
+		if(getenv("COMPRESSCACHE")) { zc_cache = atol(getenv("COMPRESSCACHE")); }
+		if(zc_cache < 0) { zc_cache = 0; }
+		zc_configure(zc_size, zc_cache);
+	}
+
+	// Configure small object packing, hash fields can't expire on their own
+	if(getenv("PACKSIZE")) { g_rt.packsize = atol(getenv("PACKSIZE")); }
+	g_rt.packprefix = 4;
+	if(getenv("PACKPREFIX")) { g_rt.packprefix = atoi(getenv("PACKPREFIX")); }
+	if((g_rt.packprefix < 1) || (g_rt.packprefix > 8)) { g_rt.packprefix = 4; }
+	if(g_rt.packsize && g_rt.expiration) {
+		fprintf(stderr, "PACKSIZE can't be used with EXPIRATION, packing disabled\n");
+		g_rt.packsize = 0;
+	}
+
+	// Configure write-behind: POSTs are answered 202 once queued, WRITEBEHIND bytes of queue
+	if(getenv("WRITEBEHIND")) {
+		wb_size = atol(getenv("WRITEBEHIND"));
+		wb_threads = 2;
+		if(getenv("WRITEBEHINDTHREADS")) { wb_threads = atoi(getenv("WRITEBEHINDTHREADS")); }
+		if(g_rt.bar) {
+			fprintf(stderr, "WRITEBEHIND can't be used with BAR, writing synchronously\n");
+		} else if(g_rt.immutable) {
+			fprintf(stderr, "WRITEBEHIND can't be used with IMMUTABLE, writing synchronously\n");
+		} else if(wb_size > 0) {
+			z = wb_configure(&g_rt, wb_size, wb_threads, so->rdest, so->rport, so->rconnect_timeout, so->rcmd_timeout);
+			if(z) { fprintf(stderr, "Failed to start the write-behind threads!\n"); }
+		}
+	}
+
+	// Configure blocking GETs, each parked request keeps its connection thread
+	if(getenv("WAITMAX")) {
+		wait_max = atol(getenv("WAITMAX"));
+		if(!so->use_threads) {
+			fprintf(stderr, "Blocking GETs need multithreading, ignoring WAITMAX\n");
+		} else if(wait_max > 0) {
+			z = getenv("WAITNOTIFY") ? wait_configure(wait_max*1000, so->rdest, so->rport) : wait_configure(wait_max*1000, NULL, 0);
+			if(z) { fprintf(stderr, "Failed to start the keyspace notification thread!\n"); }
+			searest_set_park_cb(g_srv, &wait_park);
+		}
+	}
+
 	// Configure HTTPS
 	if(so->certfile && so->keyfile) { activate_https(so); }
 
+	// Connect the bulk lane last, its copy of g_rt has to see every setting above
+	if((so->bulk_size > 0) && so->use_threads) { bulk_connect(so); }
+
 	// Start the server
 	z = searest_start(g_srv, so->http_ip, so->http_port, &g_rt);
 	if(z) {
@@ -148,9 +349,12 @@ void webstore_start(srv_opts_t *so)
 void webstore_stop(void)
 {
 	if(g_srv) {
+		wait_stop();
 		searest_stop(g_srv);
+		wb_stop();
 		searest_del(g_srv);
 		log_add(WSLOG_INFO, "webstore shutdown");
 		rai_disconnect(&g_rt.rc);
+		if(g_bulk_on) { rai_disconnect(&g_bulk_rt.rc); }
 	}
 }
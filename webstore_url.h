@@ -46,4 +46,16 @@ static char* create_url(char *host, unsigned short port, char *token, int secure
 	return strdup(url);
 }
 
+// Create the URL of a batch node (mget)
+static inline char* create_batch_url(char *host, unsigned short port, char *node, int secure)
+{
+	char *proto;
+	char url[2048];
+
+	if(secure) { proto = "https"; }
+	else { proto = "http"; }
+	snprintf(&url[0], sizeof(url), "%s://%s:%u/store/%s/", proto, host, port, node);
+	return strdup(url);
+}
+
 #endif
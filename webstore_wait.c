@@ -0,0 +1,343 @@
+/*
+	webstore is a web-based arbitrary data storage service that accepts z85 encoded data
+	Copyright (C) 2021 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Blocking GET: a request for a missing token parks until the token is written or its wait runs out
+// The waiter is registered before redis is asked, so a POST landing in between is never missed
+// POSTs to this process wake waiters directly, with WAITNOTIFY the keyspace notifications
+// of the redis server also wake them for tokens written through other webstore instances
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+
+#include "webstore.h"
+#include "webstore_ops.h"
+#include "webstore_log.h"
+
+#define WAIT_BUCKETS	(256)
+#define WAIT_PATTERN	"__keyspace@*__:*"
+
+typedef struct wswait {
+	char key[HASHLEN512+1];
+	int fired;
+	pthread_cond_t cond;
+	struct wswait *next;
+} wswait_t;
+
+static pthread_mutex_t g_wait_lock = PTHREAD_MUTEX_INITIALIZER;
+static wswait_t *g_waits[WAIT_BUCKETS];
+static long g_wait_max;		// ms, 0: waiting is disabled
+static int g_wait_stop;
+
+static atomic_ulong g_wait_parked;
+static atomic_ulong g_wait_woken;
+static atomic_ulong g_wait_timeouts;
+
+// Keyspace notifications
+static rai_t g_sub;
+static pthread_t g_sub_thread;
+static int g_sub_running;
+
+static long wait_now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000L) + (ts.tv_nsec / 1000000);
+}
+
+static unsigned int wait_hash(const char *key)
+{
+	unsigned int h = 5381;
+	while(*key) { h = (h * 33) ^ (unsigned char)*key++; }
+	return h % WAIT_BUCKETS;
+}
+
+// called with g_wait_lock held
+static void wait_unlink(wswait_t *w)
+{
+	wswait_t **pp;
+
+	for(pp = &g_waits[wait_hash(w->key)]; *pp; pp = &(*pp)->next) {
+		if(*pp == w) { *pp = w->next; break; }
+	}
+}
+
+// called with g_wait_lock held
+static void wait_fire(wswait_t *w)
+{
+	w->fired = 1;
+	pthread_cond_signal(&w->cond);
+}
+
+static void wait_free(wswait_t *w)
+{
+	pthread_cond_destroy(&w->cond);
+	free(w);
+}
+
+// Register interest in key before looking it up
+// The wait comes from an X-Wait header or a wait= query argument (seconds, capped by WAITMAX)
+// returns NULL if the request does not wait, *until is the deadline to park with
+void* wait_begin(srci_t *ri, const char *key, long *until)
+{
+	pthread_condattr_t attr;
+	const char *v;
+	wswait_t *w;
+	long s, now;
+
+	if(!g_wait_max) { return NULL; }
+
+	now = wait_now_ms();
+	*until = srci_get_park_until(ri);
+	if(!*until) {
+		v = srci_get_request_header(ri, "X-Wait");
+		if(!v) { v = srci_get_query_arg(ri, "wait"); }
+		if(!v) { return NULL; }
+		s = atol(v) * 1000L;
+		if(s <= 0) { return NULL; }
+		if(s > g_wait_max) { s = g_wait_max; }
+		*until = now + s;
+	}
+	if(now >= *until) { return NULL; }
+
+	w = calloc(1, sizeof(wswait_t));
+	if(!w) { return NULL; }
+	strncpy(w->key, key, sizeof(w->key)-1);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&w->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	pthread_mutex_lock(&g_wait_lock);
+	if(g_wait_stop) {
+		pthread_mutex_unlock(&g_wait_lock);
+		wait_free(w);
+		return NULL;
+	}
+	w->next = g_waits[wait_hash(w->key)];
+	g_waits[wait_hash(w->key)] = w;
+	pthread_mutex_unlock(&g_wait_lock);
+
+	return w;
+}
+
+// The token was found after all (or the request failed), drop the waiter
+void wait_cancel(void *arg)
+{
+	wswait_t *w = arg;
+
+	if(!w) { return; }
+	pthread_mutex_lock(&g_wait_lock);
+	if(!w->fired) { wait_unlink(w); }
+	pthread_mutex_unlock(&g_wait_lock);
+	wait_free(w);
+}
+
+// searest park callback: sleep until the token is written, the deadline passes or we shut down
+void wait_park(void *arg, long until, void *sri_user_data)
+{
+	wswait_t *w = arg;
+	struct timespec ts;
+
+	atomic_fetch_add(&g_wait_parked, 1);
+	ts.tv_sec = until / 1000;
+	ts.tv_nsec = (until % 1000) * 1000000;
+
+	pthread_mutex_lock(&g_wait_lock);
+	while(!w->fired && !g_wait_stop) {
+		if(pthread_cond_timedwait(&w->cond, &g_wait_lock, &ts) != 0) { break; }
+	}
+	if(!w->fired) { wait_unlink(w); }
+	pthread_mutex_unlock(&g_wait_lock);
+
+	if(w->fired) { atomic_fetch_add(&g_wait_woken, 1); }
+	else { atomic_fetch_add(&g_wait_timeouts, 1); }
+	wait_free(w);
+}
+
+// key was written, wake everyone waiting for it
+void wait_notify(const char *key)
+{
+	wswait_t **pp, *w;
+
+	if(!g_wait_max) { return; }
+	pthread_mutex_lock(&g_wait_lock);
+	for(pp = &g_waits[wait_hash(key)]; (w = *pp); ) {
+		if(strcmp(w->key, key) == 0) {
+			*pp = w->next;
+			wait_fire(w);
+		} else {
+			pp = &w->next;
+		}
+	}
+	pthread_mutex_unlock(&g_wait_lock);
+}
+
+// A packed bucket changed, the field is not in the event so every token under the prefix looks again
+static void wait_notify_prefix(const char *prefix, size_t len)
+{
+	wswait_t **pp, *w;
+	int b;
+
+	pthread_mutex_lock(&g_wait_lock);
+	for(b=0; b<WAIT_BUCKETS; b++) {
+		for(pp = &g_waits[b]; (w = *pp); ) {
+			if(strncmp(w->key, prefix, len) == 0) {
+				*pp = w->next;
+				wait_fire(w);
+			} else {
+				pp = &w->next;
+			}
+		}
+	}
+	pthread_mutex_unlock(&g_wait_lock);
+}
+
+// Map a redis key from a keyspace event back to the token it holds
+static void wait_keyspace(const char *key, size_t len)
+{
+	static const char digits[] = "0123456789abcdef";
+	char hex[HASHLEN512+1];
+	size_t i;
+
+	if((len > 2) && (key[0] == 'P') && (key[1] == ':')) {
+		wait_notify_prefix(key + 2, len - 2);
+		return;
+	}
+
+	if((len > 2) && (key[0] == 'B') && (key[1] >= '1') && (key[1] <= '6')) {
+		// BINKEYS: node prefix and the digest bytes
+		if((len - 2) * 2 > HASHLEN512) { return; }
+		for(i=2; i<len; i++) {
+			hex[2*(i-2)] = digits[(unsigned char)key[i] >> 4];
+			hex[2*(i-2)+1] = digits[key[i] & 0x0F];
+		}
+		hex[(len - 2) * 2] = 0;
+		wait_notify(hex);
+		return;
+	}
+
+	if((len > HASHLEN512) || (strspn(key, "0123456789abcdef") < len)) { return; }
+	memcpy(hex, key, len);
+	hex[len] = 0;
+	wait_notify(hex);
+}
+
+// called with the subscriber lock held
+static int wait_subscribe(rai_t *rc)
+{
+	redisReply *reply;
+
+	reply = redisCommand(rc->c, "PSUBSCRIBE %s", WAIT_PATTERN);
+	if(!reply) { return -1; }
+	freeReplyObject(reply);
+	return 0;
+}
+
+// Follow set/hset events on their own connection, the server needs notify-keyspace-events K$h
+static void* wait_listen(void *arg)
+{
+	rai_t *rc = &g_sub;
+	redisReply *reply, *event;
+	const char *key;
+	int z;
+
+	while(!g_wait_stop) {
+		if(!rai_is_connected(rc)) {
+			z = rai_reconnect(rc);
+			if(z <= 0) { usleep(100*1000); continue; }
+			rai_lock(rc);
+			z = wait_subscribe(rc);
+			if(z) { rai_failed(rc); }
+			rai_unlock(rc);
+			if(!z) { log_add(WSLOG_INFO, "keyspace notifications resubscribed"); }
+			continue;
+		}
+
+		if(redisGetReply(rc->c, (void **)&reply) != REDIS_OK) {
+			rai_lock(rc);
+			rai_failed(rc);
+			rai_unlock(rc);
+			if(!g_wait_stop) { log_add(WSLOG_WARN, "keyspace notifications lost, reconnecting"); }
+			continue;
+		}
+
+		// pmessage, pattern, __keyspace@<db>__:<key>, event
+		if((reply->type == REDIS_REPLY_ARRAY) && (reply->elements == 4)) {
+			event = reply->element[3];
+			key = memchr(reply->element[2]->str, ':', reply->element[2]->len);
+			if(key && (event->type == REDIS_REPLY_STRING) &&
+				((strcmp(event->str, "set") == 0) || (strcmp(event->str, "hset") == 0))) {
+				key++;
+				wait_keyspace(key, reply->element[2]->len - (key - reply->element[2]->str));
+			}
+		}
+		freeReplyObject(reply);
+	}
+
+	return NULL;
+}
+
+// max_ms caps every wait, dest/port enable keyspace notifications (NULL: this process only)
+int wait_configure(long max_ms, char *dest, unsigned short port)
+{
+	g_wait_max = max_ms;
+	if(!dest) { return 0; }
+
+	// Commands never time out on this connection, it sits in a blocking read
+	rai_connect(&g_sub, dest, port);
+	if(g_sub.connected && wait_subscribe(&g_sub)) { rai_failed(&g_sub); }
+	if(pthread_create(&g_sub_thread, NULL, wait_listen, NULL)) { return -1; }
+	g_sub_running = 1;
+	return 0;
+}
+
+// Wake every parked request (they answer 503) and stop the subscriber, before MHD joins its threads
+void wait_stop(void)
+{
+	int b;
+	wswait_t *w;
+
+	pthread_mutex_lock(&g_wait_lock);
+	g_wait_stop = 1;
+	for(b=0; b<WAIT_BUCKETS; b++) {
+		for(w = g_waits[b]; w; w = w->next) { pthread_cond_signal(&w->cond); }
+	}
+	pthread_mutex_unlock(&g_wait_lock);
+
+	if(g_sub_running) {
+		rai_lock(&g_sub);
+		if(g_sub.c) { shutdown(g_sub.c->fd, SHUT_RDWR); }
+		rai_unlock(&g_sub);
+		pthread_join(g_sub_thread, NULL);
+		rai_disconnect(&g_sub);
+		g_sub_running = 0;
+	}
+}
+
+void wait_get_stats(unsigned long *parked, unsigned long *woken, unsigned long *timeouts)
+{
+	*parked = atomic_load(&g_wait_parked);
+	*woken = atomic_load(&g_wait_woken);
+	*timeouts = atomic_load(&g_wait_timeouts);
+}
@@ -0,0 +1,454 @@
+/*
+	webstore is a web-based arbitrary data storage service that accepts z85 encoded data
+	Copyright (C) 2021 Brett Kuskie <fullaxx@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; version 2 of the License.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+// Write-behind: a POST is answered 202 once its value is queued, flusher threads write it later
+// The queue is bounded in bytes, a POST that does not fit is written synchronously instead
+// Queued values stay visible to GET until redis has them, including while they are being flushed
+// Each flusher has its own redis connection and writes WB_BATCH values per pipeline
+// Only one write of a token is ever in flight, so a later POST can not be overtaken by an earlier one
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "webstore.h"
+#include "webstore_ops.h"
+#include "webstore_log.h"
+
+#define WB_BUCKETS		(4096)
+#define WB_BATCH		(64)	// values per pipeline
+#define WB_MAXTHREADS	(16)
+#define WB_BACKOFF_MS	(100)
+#define WB_DRAIN_TRIES	(50)	// failed flushes during shutdown before the rest is given up
+#define WB_OVERHEAD		(sizeof(wbent_t) + 64)
+
+typedef struct wbent {
+	char hex[HASHLEN512+1];
+	int type;				// HASHALG*, to rebuild the key
+	wsbuf_t *buf;			// what goes to redis, transcoded if STORE says so
+	size_t cost;
+	int flushing;			// taken by a flusher, still served to GETs
+	struct wbent *hnext;
+	struct wbent *prev;		// FIFO of the values not taken yet, head is the oldest
+	struct wbent *next;
+} wbent_t;
+
+static pthread_mutex_t g_wb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_wb_ready = PTHREAD_COND_INITIALIZER;	// something was queued
+static pthread_cond_t g_wb_done = PTHREAD_COND_INITIALIZER;		// a flush finished
+static wbent_t *g_wb_table[WB_BUCKETS];
+static wbent_t *g_wb_head;
+static wbent_t *g_wb_tail;
+static size_t g_wb_bytes;
+static size_t g_wb_limit;		// 0: write-behind is disabled
+static unsigned long g_wb_count;
+static int g_wb_stop;
+
+static wsrt_t g_wb_rt[WB_MAXTHREADS];	// a copy of the runtime with its own connection per flusher
+static pthread_t g_wb_threads[WB_MAXTHREADS];
+static int g_wb_nthreads;
+
+static atomic_ulong g_wb_queued;
+static atomic_ulong g_wb_flushed;
+static atomic_ulong g_wb_failed;
+static atomic_ulong g_wb_full;
+
+static unsigned int wb_hash(const char *key)
+{
+	unsigned int h = 5381;
+	while(*key) { h = (h * 33) ^ (unsigned char)*key++; }
+	return h % WB_BUCKETS;
+}
+
+// called with g_wb_lock held
+static void fifo_unlink(wbent_t *e)
+{
+	if(e->prev) { e->prev->next = e->next; } else { g_wb_head = e->next; }
+	if(e->next) { e->next->prev = e->prev; } else { g_wb_tail = e->prev; }
+	e->prev = e->next = NULL;
+}
+
+// called with g_wb_lock held
+static void fifo_push(wbent_t *e)
+{
+	e->next = NULL;
+	e->prev = g_wb_tail;
+	if(g_wb_tail) { g_wb_tail->next = e; } else { g_wb_head = e; }
+	g_wb_tail = e;
+}
+
+// called with g_wb_lock held
+static void fifo_push_head(wbent_t *e)
+{
+	e->prev = NULL;
+	e->next = g_wb_head;
+	if(g_wb_head) { g_wb_head->prev = e; } else { g_wb_tail = e; }
+	g_wb_head = e;
+}
+
+// called with g_wb_lock held, the caller releases the buffer and frees e
+static void wb_unlink(wbent_t *e)
+{
+	wbent_t **pp;
+
+	for(pp = &g_wb_table[wb_hash(e->hex)]; *pp; pp = &(*pp)->hnext) {
+		if(*pp == e) { *pp = e->hnext; break; }
+	}
+	if(!e->flushing) { fifo_unlink(e); }
+	g_wb_bytes -= e->cost;
+	g_wb_count--;
+}
+
+// called with g_wb_lock held
+// *pending is the queued value of key, *flushing the one being written (either may be NULL)
+static void wb_find(const char *key, wbent_t **pending, wbent_t **flushing)
+{
+	wbent_t *e;
+
+	*pending = *flushing = NULL;
+	for(e = g_wb_table[wb_hash(key)]; e; e = e->hnext) {
+		if(strcmp(e->hex, key) != 0) { continue; }
+		if(e->flushing) { *flushing = e; }
+		else { *pending = e; }
+	}
+}
+
+static void wb_free(wbent_t *e)
+{
+	wsbuf_release(e->buf);
+	free(e);
+}
+
+int wb_enabled(void)
+{
+	return (g_wb_limit > 0);
+}
+
+// Queue buf as the new value of k, takes a reference on buf
+// returns 0 if it was queued, -1 if there is no room and it should be written synchronously,
+// 503 if there is no room and an older write is still queued
+// Never used with IMMUTABLE, the 304 of a refused write would only reach the flusher
+int wb_put(const wskey_t *k, int type, wsbuf_t *buf)
+{
+	wbent_t *pending, *flushing, *e;
+	size_t cost = WB_OVERHEAD + buf->len;
+
+	pthread_mutex_lock(&g_wb_lock);
+	wb_find(k->hex, &pending, &flushing);
+
+	// A queued value that was not taken yet is simply replaced
+	if(pending) {
+		if(g_wb_bytes - pending->cost + cost > g_wb_limit) {
+			pthread_mutex_unlock(&g_wb_lock);
+			atomic_fetch_add(&g_wb_full, 1);
+			return 503;
+		}
+		wsbuf_ref(buf);
+		wsbuf_release(pending->buf);
+		pending->buf = buf;
+		g_wb_bytes = g_wb_bytes - pending->cost + cost;
+		pending->cost = cost;
+		pthread_mutex_unlock(&g_wb_lock);
+		atomic_fetch_add(&g_wb_queued, 1);
+		return 0;
+	}
+
+	if((g_wb_bytes + cost > g_wb_limit) || g_wb_stop) {
+		pthread_mutex_unlock(&g_wb_lock);
+		atomic_fetch_add(&g_wb_full, 1);
+		return flushing ? 503 : -1;
+	}
+
+	e = calloc(1, sizeof(wbent_t));
+	if(!e) {
+		pthread_mutex_unlock(&g_wb_lock);
+		return flushing ? 503 : -1;
+	}
+	memcpy(e->hex, k->hex, k->hexlen + 1);
+	e->type = type;
+	wsbuf_ref(buf);
+	e->buf = buf;
+	e->cost = cost;
+	e->hnext = g_wb_table[wb_hash(e->hex)];
+	g_wb_table[wb_hash(e->hex)] = e;
+	fifo_push(e);
+	g_wb_bytes += cost;
+	g_wb_count++;
+	pthread_cond_signal(&g_wb_ready);
+	pthread_mutex_unlock(&g_wb_lock);
+
+	atomic_fetch_add(&g_wb_queued, 1);
+	return 0;
+}
+
+// The stored form of key if it has not reached redis yet, NULL if it is not queued
+wsbuf_t* wb_get(const char *key)
+{
+	wbent_t *pending, *flushing;
+	wsbuf_t *b = NULL;
+
+	if(!g_wb_limit) { return NULL; }
+
+	pthread_mutex_lock(&g_wb_lock);
+	wb_find(key, &pending, &flushing);
+	if(pending) { b = pending->buf; }
+	else if(flushing) { b = flushing->buf; }
+	if(b) { wsbuf_ref(b); }
+	pthread_mutex_unlock(&g_wb_lock);
+
+	return b;
+}
+
+// Forget the queued value of key before it is written or deleted some other way
+// A write already in flight is waited for, so it can not land afterwards
+// returns 1 if a queued value was dropped
+int wb_drop(const char *key)
+{
+	wbent_t *pending, *flushing;
+	int dropped = 0;
+
+	if(!g_wb_limit) { return 0; }
+
+	pthread_mutex_lock(&g_wb_lock);
+	for(;;) {
+		wb_find(key, &pending, &flushing);
+		if(pending) {
+			wb_unlink(pending);
+			wb_free(pending);
+			dropped = 1;
+		}
+		if(!flushing) { break; }
+		pthread_cond_wait(&g_wb_done, &g_wb_lock);
+	}
+	pthread_mutex_unlock(&g_wb_lock);
+
+	return dropped;
+}
+
+// called with g_wb_lock held
+// Take up to WB_BATCH values off the queue, skipping tokens that already have a write in flight
+static int wb_take(wbent_t **batch)
+{
+	wbent_t *e, *next, *pending, *flushing;
+	int n = 0;
+
+	for(e = g_wb_head; e && (n < WB_BATCH); e = next) {
+		next = e->next;
+		wb_find(e->hex, &pending, &flushing);
+		if(flushing) { continue; }
+		fifo_unlink(e);
+		e->flushing = 1;
+		batch[n++] = e;
+	}
+
+	return n;
+}
+
+// Write a batch with one pipeline on the flusher's own connection
+// codes[i] gets 0, 304 or the HTTP error of value i
+static void wb_write(wsrt_t *rt, wbent_t **batch, int n, int *codes)
+{
+	rai_t *rc = &rt->rc;
+	redisReply *reply;
+	wskey_t keys[WB_BATCH];
+	wsreq_t req;
+	int i, j, err = 0, replies[WB_BATCH], pack[WB_BATCH];
+
+	rai_lock(rc);
+	if(!rai_ready(rc)) {
+		rai_unlock(rc);
+		for(i=0; i<n; i++) { codes[i] = 503; }
+		return;
+	}
+
+	for(i=0; i<n; i++) {
+		req.type = batch[i]->type;
+		req.url = batch[i]->hex;
+		req.urllen = req.hashlen = strlen(batch[i]->hex);
+		make_key(rt, &req, &keys[i]);
+		replies[i] = post_append(rt, &keys[i], (const unsigned char *)batch[i]->buf->data, batch[i]->buf->len, &pack[i]);
+	}
+
+	for(i=0; i<n; i++) {
+		codes[i] = 503;
+		if(err) { continue; }
+		for(j=0; j<replies[i]; j++) {
+			if(redisGetReply(rc->c, (void **)&reply) != REDIS_OK) { err = 1; break; }
+			if(j == 0) { codes[i] = post_result(rt, reply, pack[i]); }
+			freeReplyObject(reply);
+		}
+		if(err) { codes[i] = 503; }
+	}
+	if(err) { handle_redis_error(rc); }
+	rai_unlock(rc);
+}
+
+// Give up on everything still queued, shutdown could not reach redis
+static void wb_discard(void)
+{
+	wbent_t *e;
+	unsigned long lost = 0;
+
+	pthread_mutex_lock(&g_wb_lock);
+	while((e = g_wb_head)) {
+		wb_unlink(e);
+		wb_free(e);
+		lost++;
+	}
+	pthread_cond_broadcast(&g_wb_done);
+	pthread_mutex_unlock(&g_wb_lock);
+
+	if(lost) {
+		atomic_fetch_add(&g_wb_failed, lost);
+		log_add(WSLOG_ERR, "write-behind: redis unreachable at shutdown, %lu queued writes lost", lost);
+	}
+}
+
+static void* wb_flush(void *arg)
+{
+	wsrt_t *rt = arg;
+	wbent_t *batch[WB_BATCH], *pending, *flushing;
+	int i, n, retry, fails = 0, codes[WB_BATCH];
+
+	for(;;) {
+		if(!rai_is_connected(&rt->rc)) { rai_reconnect(&rt->rc); }
+
+		pthread_mutex_lock(&g_wb_lock);
+		while(!g_wb_head && !g_wb_stop) { pthread_cond_wait(&g_wb_ready, &g_wb_lock); }
+		if(!g_wb_head) {
+			pthread_mutex_unlock(&g_wb_lock);
+			break;
+		}
+		n = wb_take(batch);
+		if(n == 0) {
+			// Everything queued waits behind writes of the same tokens
+			pthread_cond_wait(&g_wb_done, &g_wb_lock);
+			pthread_mutex_unlock(&g_wb_lock);
+			continue;
+		}
+		pthread_mutex_unlock(&g_wb_lock);
+
+		wb_write(rt, batch, n, codes);
+
+		// Keep the values redis could not take (no connection, out of memory) in order at the head
+		// unless a newer POST of the same token was queued meanwhile, that one supersedes it
+		retry = 0;
+		pthread_mutex_lock(&g_wb_lock);
+		for(i=n-1; i>=0; i--) {
+			if((codes[i] == 503) || (codes[i] == 507)) {
+				wb_find(batch[i]->hex, &pending, &flushing);
+				if(pending) {
+					codes[i] = -1;
+					wb_unlink(batch[i]);
+					continue;
+				}
+				batch[i]->flushing = 0;
+				fifo_push_head(batch[i]);
+				retry++;
+			} else {
+				wb_unlink(batch[i]);
+			}
+		}
+		pthread_cond_broadcast(&g_wb_done);
+		pthread_mutex_unlock(&g_wb_lock);
+
+		for(i=0; i<n; i++) {
+			if((codes[i] == 503) || (codes[i] == 507)) { continue; }
+			if((codes[i] > 0) && (codes[i] != 304)) {
+				atomic_fetch_add(&g_wb_failed, 1);
+				log_add(WSLOG_ERR, "write-behind: %s dropped, redis answered %d", batch[i]->hex, codes[i]);
+			} else if(codes[i] >= 0) {
+				atomic_fetch_add(&g_wb_flushed, 1);
+			}
+			wb_free(batch[i]);
+		}
+
+		if(!retry) { fails = 0; continue; }
+		if(g_wb_stop && (++fails >= WB_DRAIN_TRIES)) { wb_discard(); continue; }
+		usleep(WB_BACKOFF_MS*1000);
+	}
+
+	return NULL;
+}
+
+// Queue up to max_bytes of writes, flushed by nthreads threads with their own connections to dest
+// call once the runtime is configured, rt is copied
+int wb_configure(wsrt_t *rt, size_t max_bytes, int nthreads, char *dest, unsigned short port, long connect_ms, long cmd_ms)
+{
+	wsrt_t *frt;
+	int i;
+
+	if(nthreads < 1) { nthreads = 1; }
+	if(nthreads > WB_MAXTHREADS) { nthreads = WB_MAXTHREADS; }
+	g_wb_limit = max_bytes;
+
+	for(i=0; i<nthreads; i++) {
+		frt = &g_wb_rt[i];
+		*frt = *rt;
+		memset(&frt->rc, 0, sizeof(rai_t));
+		rai_set_timeouts(&frt->rc, connect_ms, cmd_ms);
+		if(rai_connect(&frt->rc, dest, port)) {
+			// rai_reconnect() takes it from here
+			rai_lock(&frt->rc);
+			rai_failed(&frt->rc);
+			rai_unlock(&frt->rc);
+		}
+		if(pthread_create(&g_wb_threads[i], NULL, wb_flush, frt)) { break; }
+		g_wb_nthreads++;
+	}
+
+	return (g_wb_nthreads == nthreads) ? 0 : -1;
+}
+
+// Flush everything still queued and stop the flushers, call once no more requests come in
+void wb_stop(void)
+{
+	unsigned long left;
+	int i;
+
+	if(!g_wb_nthreads) { return; }
+
+	pthread_mutex_lock(&g_wb_lock);
+	left = g_wb_count;
+	g_wb_stop = 1;
+	pthread_cond_broadcast(&g_wb_ready);
+	pthread_mutex_unlock(&g_wb_lock);
+	if(left) { log_add(WSLOG_INFO, "write-behind: draining %lu queued writes", left); }
+
+	for(i=0; i<g_wb_nthreads; i++) {
+		pthread_join(g_wb_threads[i], NULL);
+		rai_disconnect(&g_wb_rt[i].rc);
+	}
+	g_wb_nthreads = 0;
+}
+
+void wb_get_stats(unsigned long *queued, unsigned long *flushed, unsigned long *failed, unsigned long *full, unsigned long *pending, unsigned long *bytes)
+{
+	*queued = atomic_load(&g_wb_queued);
+	*flushed = atomic_load(&g_wb_flushed);
+	*failed = atomic_load(&g_wb_failed);
+	*full = atomic_load(&g_wb_full);
+	pthread_mutex_lock(&g_wb_lock);
+	*pending = g_wb_count;
+	*bytes = g_wb_bytes;
+	pthread_mutex_unlock(&g_wb_lock);
+}
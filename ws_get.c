@@ -34,6 +34,11 @@ unsigned short g_port = 0;
 char *g_token = NULL;
 char *g_filename = NULL;
 int g_secure = 0;
+char *g_batch = NULL;
+char *g_dir = NULL;
+long g_offset = -1;
+long g_length = 0;
+int g_wait = 0;
 
 #ifdef MINIZ_COMPRESSION
 #include "compression.h"
@@ -82,34 +87,247 @@ char *decode_msg(char *msg, size_t len, size_t *bytes)
 	return dec;
 }
 
-// Take the decoded response and save it to file or print to stdout
-static void handle_page(curlresp_t *r)
+// Decode a message and save it to file or print to stdout
+// returns 0 on success
+static int save_msg(char *msg, size_t len, char *filename)
 {
 	FILE *f;
 	char *data;
 	size_t bytes = 0;
 
-	data = decode_msg(r->page, r->bytecount, &bytes);
-	if(!data) { return; }
+	data = decode_msg(msg, len, &bytes);
+	if(!data) { return 1; }
 
 #ifdef MINIZ_COMPRESSION
 	if((bytes > 6) && (data[0] == 0x78) && (data[1] == 0x01)) {
 		data = inflate_msg((unsigned char *)data, &bytes);
-		if(!data) { return; }
+		if(!data) { return 1; }
 	}
 #endif
 
-	if(g_filename) {
-		f = fopen(g_filename, "w");
+	if(filename) {
+		f = fopen(filename, "w");
 		if(f) {
 			fwrite(data, bytes, 1, f);
 			fclose(f);
-		} else { fprintf(stderr, "fopen(%s, w) failed!\n", g_filename); }
+		} else {
+			fprintf(stderr, "fopen(%s, w) failed!\n", filename);
+			free(data);
+			return 1;
+		}
 	} else {
 		printf("%s", data);
 	}
 
 	free(data);
+	return 0;
+}
+
+// Take the decoded response and save it to file or print to stdout
+static void handle_page(curlresp_t *r)
+{
+	save_msg(r->page, r->bytecount, g_filename);
+}
+
+// Save the bytes of a ranged request to file or print to stdout
+static int save_slice(char *data, size_t len, char *filename)
+{
+	FILE *f = stdout;
+
+	if(filename) {
+		f = fopen(filename, "w");
+		if(!f) {
+			fprintf(stderr, "fopen(%s, w) failed!\n", filename);
+			return 1;
+		}
+	}
+	fwrite(data, len, 1, f);
+	if(f != stdout) { fclose(f); }
+	return 0;
+}
+
+// Clamp [g_offset, g_offset+g_length) to a message of msglen bytes, returns the end
+static long slice_end(long msglen)
+{
+	if(g_offset >= msglen) {
+		fprintf(stderr, "Offset %ld is beyond the end of the message (%ld bytes)\n", g_offset, msglen);
+		return -1;
+	}
+	if(g_length && (g_offset + g_length < msglen)) { return g_offset + g_length; }
+	return msglen;
+}
+
+// The server may answer a Range request with the whole message, slice it here
+static int save_whole_slice(curlresp_t *r)
+{
+	char *data;
+	size_t bytes = 0;
+	long end;
+	int z;
+
+	data = decode_msg(r->page, r->bytecount, &bytes);
+	if(!data) { return 1; }
+	end = slice_end(bytes);
+	z = (end < 0) ? 1 : save_slice(data + g_offset, end - g_offset, g_filename);
+	free(data);
+	return z;
+}
+
+// Fetch message bytes [g_offset, g_offset+g_length) without downloading the rest
+// The first request reads the padding digit and the length of the text,
+// the second asks for the 5 digit frames that cover the slice (frame n starts at 1 + 5n)
+static int range_get(char *url)
+{
+	curlresp_t resp;
+	char range[64];
+	char *data;
+	long total, msglen, end, fa, fb;
+	int lead, z, retval = 1;
+
+	memset(&resp, 0, sizeof(curlresp_t));
+	z = ws_curl_get_range(url, &resp, "0-0");
+	if(z) { fprintf(stderr, "ws_curl_get_range() failed!\n"); return 1; }
+	if(resp.http_code == 200) {
+		retval = save_whole_slice(&resp);
+		free(resp.page);
+		return retval;
+	}
+	if((resp.http_code != 206) || (resp.bytecount != 1)) {
+		fprintf(stderr, "HTTP Error %ld: %s\n", resp.http_code, resp.page);
+		if(resp.page) { free(resp.page); }
+		return 1;
+	}
+
+	lead = resp.page[0] - '0';
+	total = resp.range_total;
+	free(resp.page);
+	if((lead < 1) || (lead > 4) || (total < 6) || ((total - 1) % 5)) {
+		fprintf(stderr, "Object is not a padded Z85 message!\n");
+		return 1;
+	}
+
+	msglen = ((total - 1) / 5) * 4 - 4 + lead;
+	end = slice_end(msglen);
+	if(end < 0) { return 1; }
+
+	fa = g_offset / 4;
+	fb = (end - 1) / 4;
+	snprintf(range, sizeof(range), "%ld-%ld", 1 + fa * 5, 1 + fb * 5 + 4);
+
+	memset(&resp, 0, sizeof(curlresp_t));
+	z = ws_curl_get_range(url, &resp, range);
+	if(z) { fprintf(stderr, "ws_curl_get_range() failed!\n"); return 1; }
+	if(resp.http_code == 200) {
+		retval = save_whole_slice(&resp);
+	} else if((resp.http_code != 206) || (resp.bytecount != (fb - fa + 1) * 5)) {
+		fprintf(stderr, "HTTP Error %ld: %s\n", resp.http_code, resp.page);
+	} else {
+		data = malloc((fb - fa + 1) * 4);
+		if(data) {
+			Z85_decode_unsafe(resp.page, resp.page + resp.bytecount, data);
+			retval = save_slice(data + (g_offset - fa * 4), end - g_offset, g_filename);
+			free(data);
+		}
+	}
+
+	if(resp.page) { free(resp.page); }
+	return retval;
+}
+
+// Read whitespace separated tokens from a file (- is stdin)
+// This must be free()'d
+static char* read_tokens(char *filename, long *len)
+{
+	FILE *f;
+	char *buf = NULL;
+	size_t n;
+	char chunk[4096];
+
+	*len = 0;
+	if(strcmp(filename, "-") == 0) { f = stdin; }
+	else { f = fopen(filename, "r"); }
+	if(!f) {
+		fprintf(stderr, "fopen(%s, r) failed!\n", filename);
+		return NULL;
+	}
+
+	while((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+		buf = realloc(buf, *len + n + 1);
+		memcpy(buf + *len, chunk, n);
+		*len += n;
+		buf[*len] = 0;
+	}
+	if(f != stdin) { fclose(f); }
+	return buf;
+}
+
+// Split a /store/mget/ response into its frames: <token> <status> <length>\n<data>\n
+// Every message is saved to <dir>/<token>, returns the number of tokens that failed
+static int handle_batch(curlresp_t *r)
+{
+	char *p = r->page, *end = r->page + r->bytecount;
+	char token[256], path[4096];
+	int status, failed = 0;
+	unsigned long len;
+	char *nl;
+
+	while(p < end) {
+		nl = memchr(p, '\n', end - p);
+		if(!nl) { break; }
+		*nl = 0;
+		if(sscanf(p, "%255s %d %lu", token, &status, &len) != 3) {
+			fprintf(stderr, "Malformed batch response!\n");
+			return failed + 1;
+		}
+		p = nl + 1;
+		// len + 1 would wrap at ULONG_MAX
+		if(len >= (unsigned long)(end - p)) {
+			fprintf(stderr, "Truncated batch response!\n");
+			return failed + 1;
+		}
+
+		if(status == 200) {
+			snprintf(path, sizeof(path), "%s/%s", (g_dir ? g_dir : "."), token);
+			if(save_msg(p, len, path)) { failed++; }
+		} else {
+			fprintf(stderr, "%s: HTTP Error %d\n", token, status);
+			failed++;
+		}
+		p += len + 1;
+	}
+
+	return failed;
+}
+
+static int batch_get(void)
+{
+	int z, retval = 0;
+	curlresp_t resp;
+	curlpost_t post;
+	char *url;
+	long len;
+
+	memset(&resp, 0, sizeof(curlresp_t));
+	post.data = (unsigned char *)read_tokens(g_batch, &len);
+	post.size = len;
+	if(!post.data) { return 1; }
+
+	url = create_batch_url(g_host, g_port, "mget", g_secure);
+	z = ws_curl_post(url, &resp, &post);
+	if(z) {
+		fprintf(stderr, "ws_curl_post() failed!\n");
+		retval = 1;
+	} else if(resp.http_code != 200) {
+		fprintf(stderr, "HTTP Error %ld: %s\n", resp.http_code, resp.page);
+		retval = 1;
+	} else if(handle_batch(&resp)) {
+		retval = 1;
+	}
+
+	free(url);
+	free(post.data);
+	if(resp.page) { free(resp.page); }
+	return retval;
 }
 
 int main(int argc, char *argv[])
@@ -121,12 +339,35 @@ int main(int argc, char *argv[])
 	memset(&resp, 0, sizeof(curlresp_t));
 	parse_args(argc, argv);
 
+	if(g_batch) {
+		retval = batch_get();
+		if(g_host) { free(g_host); }
+		if(g_batch) { free(g_batch); }
+		if(g_dir) { free(g_dir); }
+		return retval;
+	}
+
 	url = create_url(g_host, g_port, g_token, g_secure);
 	if(!url) {
 		fprintf(stderr, "create_url() failed!\n");
 		return 1;
 	}
 
+	// Let the server hold the request until the token is written (capped by its WAITMAX)
+	if(g_wait > 0) {
+		url = realloc(url, strlen(url) + 32);
+		sprintf(url + strlen(url), "?wait=%d", g_wait);
+	}
+
+	if(g_offset >= 0) {
+		retval = range_get(url);
+		free(url);
+		if(g_host) { free(g_host); }
+		if(g_token) { free(g_token); }
+		if(g_filename) { free(g_filename); }
+		return retval;
+	}
+
 	z = ws_curl_get(url, &resp);
 	if(z) {
 		fprintf(stderr, "ws_curl_get() failed!\n");
@@ -155,6 +396,11 @@ struct options opts[] =
 	{ 3, "token",	"Hash Token to request",	"t", 1 },
 	{ 4, "file",	"Save data to file",		"f", 1 },
 	{ 5, "https",	"Use HTTPS",				"s", 0 },
+	{ 6, "batch",	"Fetch the tokens listed in file (- for stdin)",	"b", 1 },
+	{ 7, "dir",		"Save batch messages to dir/<token>",	"d", 1 },
+	{ 8, "offset",	"Fetch only from this byte of the message",	"o", 1 },
+	{ 9, "length",	"Fetch at most this many bytes (with -o)",	"l", 1 },
+	{ 10, "wait",	"Wait up to this many seconds for the token to appear",	"w", 1 },
 	{ 0, NULL,		NULL,						NULL, 0 }
 };
 
@@ -189,6 +435,21 @@ static void parse_args(int argc, char **argv)
 			case 5:
 				g_secure = 1;
 				break;
+			case 6:
+				g_batch = strdup(args);
+				break;
+			case 7:
+				g_dir = strdup(args);
+				break;
+			case 8:
+				g_offset = atol(args);
+				break;
+			case 9:
+				g_length = atol(args);
+				break;
+			case 10:
+				g_wait = atoi(args);
+				break;
 			default:
 				fprintf(stderr, "Unexpected getopts Error! (%d)\n", c);
 				break;
@@ -208,8 +469,22 @@ static void parse_args(int argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 
-	if(!g_token) {
-		fprintf(stderr, "I need a token to retrieve! (Fix with -t)\n");
+	if(!g_token && !g_batch) {
+		fprintf(stderr, "I need a token to retrieve! (Fix with -t or -b)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if(g_length && (g_offset < 0)) { g_offset = 0; }
+	if((g_offset >= 0) && g_batch) {
+		fprintf(stderr, "A byte range applies to a single token (Drop -o/-l or -b)\n");
+		exit(EXIT_FAILURE);
+	}
+	if((g_wait > 0) && ((g_offset >= 0) || g_batch)) {
+		fprintf(stderr, "Only a single whole message can be waited for (Drop -w or -o/-l/-b)\n");
+		exit(EXIT_FAILURE);
+	}
+	if(g_length < 0) {
+		fprintf(stderr, "Length must not be negative!\n");
 		exit(EXIT_FAILURE);
 	}
 }
@@ -48,6 +48,7 @@ char *g_token = NULL;
 int g_verbosity = 1;
 long g_msglen = 0;
 int g_secure = 0;
+char *g_batch = NULL;
 
 static int post_msg(char *url, char *z85block)
 {
@@ -67,7 +68,8 @@ static int post_msg(char *url, char *z85block)
 	if(curlerr) {
 		fprintf(stderr, "ws_curl_get() failed!\n");
 	} else {
-		if(resp.http_code != 200) {
+		// 202: queued by a write-behind server
+		if((resp.http_code != 200) && (resp.http_code != 202)) {
 			httperr = 1;
 			if((resp.http_code == 304) && (!resp.page)) {
 				// I'm not sure why this doesnt come through properly
@@ -152,6 +154,99 @@ static char* encode_msg_and_post(char *host, unsigned short port, int alg, char
 	return token;
 }
 
+// Add one <token> <length>\n<z85>\n record to the /store/mset/ body
+static int batch_add(curlpost_t *post, char *filename)
+{
+	char *msg, *z85block, *token;
+	char hdr[HASHLEN512+32];
+	long len;
+	int n;
+
+	len = file_size(filename, 1);
+	if(len == 0) { fprintf(stderr, "%s is empty!\n", filename); }
+	if(len <= 0) { return 1; }
+	msg = get_file(filename);
+	if(!msg) { return 1; }
+
+	z85block = encode_msg(msg, len);
+	token = create_token(g_alg, msg, len);
+	free(msg);
+	if(!z85block || !token) {
+		fprintf(stderr, "Unable to encode %s!\n", filename);
+		if(z85block) { free(z85block); }
+		if(token) { free(token); }
+		return 1;
+	}
+
+	n = snprintf(hdr, sizeof(hdr), "%s %zu\n", token, strlen(z85block));
+	post->data = realloc(post->data, post->size + n + strlen(z85block) + 1);
+	memcpy(post->data + post->size, hdr, n);
+	post->size += n;
+	memcpy(post->data + post->size, z85block, strlen(z85block));
+	post->size += strlen(z85block);
+	post->data[post->size++] = '\n';
+
+	free(z85block);
+	free(token);
+	return 0;
+}
+
+// Post every file listed in g_batch (one per line, - is stdin) in a single request
+static int batch_post(void)
+{
+	int z, code, retval = 0;
+	char line[4096], token[HASHLEN512+1];
+	char *url, *p, *end;
+	curlresp_t resp;
+	curlpost_t post;
+	FILE *f;
+
+	if(strcmp(g_batch, "-") == 0) { f = stdin; }
+	else { f = fopen(g_batch, "r"); }
+	if(!f) {
+		fprintf(stderr, "fopen(%s, r) failed!\n", g_batch);
+		return 1;
+	}
+
+	memset(&post, 0, sizeof(curlpost_t));
+	while(fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\r\n")] = 0;
+		if(!line[0]) { continue; }
+		if(batch_add(&post, line)) { retval = 1; }
+	}
+	if(f != stdin) { fclose(f); }
+	if(!post.data) { fprintf(stderr, "Nothing to post!\n"); return 1; }
+
+	if(g_verbosity >= 2) { printf("Uploading: %ld bytes\n", post.size); }
+
+	memset(&resp, 0, sizeof(curlresp_t));
+	url = create_batch_url(g_host, g_port, "mset", g_secure);
+	z = ws_curl_post(url, &resp, &post);
+	if(z) {
+		fprintf(stderr, "ws_curl_post() failed!\n");
+		retval = 1;
+	} else if(resp.http_code != 200) {
+		fprintf(stderr, "HTTP Error %ld: %s\n", resp.http_code, resp.page);
+		retval = 1;
+	} else if(resp.page) {
+		// One <token> <status> line per record
+		for(p = resp.page; (end = strchr(p, '\n')); p = end + 1) {
+			if(sscanf(p, "%128s %d", token, &code) != 2) { break; }
+			if(code == 200) {
+				if(g_verbosity >= 1) { printf("Token: %s\n", token); }
+			} else {
+				fprintf(stderr, "HTTP Error %d: %s\n", code, token);
+				retval = 1;
+			}
+		}
+	}
+
+	free(url);
+	free(post.data);
+	if(resp.page) { free(resp.page); }
+	return retval;
+}
+
 int main(int argc, char *argv[])
 {
 	int z, retval = 0;
@@ -161,6 +256,13 @@ int main(int argc, char *argv[])
 	if(z != 0) { return 1; }
 	parse_args(argc, argv);
 
+	if(g_batch) {
+		retval = batch_post();
+		free(g_batch);
+		free(g_host);
+		return retval;
+	}
+
 	token = encode_msg_and_post(g_host, g_port, g_alg, g_message, g_msglen);
 	if(token) {
 		if(g_verbosity >= 1) { printf("Token: %s\n", token); }
@@ -199,6 +301,7 @@ struct options opts[] =
 	{  5, "msg",		"Message to encode and post",	"m", 1 },
 	{  6, "token",		"Use this token when posting",	"t", 1 },
 	{  7, "https",		"Use HTTPS",					"s", 0 },
+	{  9, "batch",		"Post the files listed in file (- for stdin)",	"b", 1 },
 #ifdef MINIZ_COMPRESSION
 	{  8, "comp",		"Use compression",				"c", 0 },
 #endif
@@ -249,6 +352,9 @@ static void parse_args(int argc, char **argv)
 				g_comp = 1;
 				break;
 #endif
+			case 9:
+				g_batch = strdup(args);
+				break;
 			case 10:
 				g_verbosity = 0;
 				break;
@@ -274,6 +380,18 @@ static void parse_args(int argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 
+	if(g_batch) {
+		if(g_token || g_filename || g_message) {
+			fprintf(stderr, "A batch takes its messages from the listed files (Drop -t/-f/-m)\n");
+			exit(EXIT_FAILURE);
+		}
+		if((g_alg < HASHALG128) || (g_alg > HASHALG512)) {
+			fprintf(stderr, "Please choose to an algorithm (Fix with -a)\n");
+			exit(EXIT_FAILURE);
+		}
+		return;
+	}
+
 	if(g_token) {
 		if(!valid_token(g_token)) {
 			fprintf(stderr, "Invalid Token!\n");